@@ -0,0 +1,99 @@
+open FFmpeg
+
+(* The frames read are kept as their kind, stream index and pts *)
+let add_frame frames = function
+  | `Audio (i, f) -> (`Audio, i, Avutil.frame_get_pts f) :: frames
+  | `Video (i, f) -> (`Video, i, Avutil.frame_get_pts f) :: frames
+  | `Subtitle (i, f) -> (`Subtitle, i, Avutil.frame_get_pts f) :: frames
+  | `End_of_file -> frames
+
+(* Read all the frames one at a time *)
+let read_one src =
+  let rec read frames = match Av.read_input_frame src with
+    | `End_of_file -> frames
+    | result -> read (add_frame frames result)
+  in
+  List.rev (read [])
+
+(* Read all the frames by batches of at most max frames *)
+let read_batch max src =
+  let rec read frames =
+    let results = Av.read_input_frames src ~max in
+    let frames = Array.fold_left add_frame frames results in
+    match results.(Array.length results - 1) with
+    | `End_of_file -> frames
+    | _ -> read frames
+  in
+  List.rev (read [])
+
+(* Read all the frames with a decoding thread per stream *)
+let read_parallel src =
+  let frames = ref [] in
+  Av.iter_input_frame ~parallel:true
+    ~audio:(fun i f -> frames := add_frame !frames (`Audio(i, f)))
+    ~video:(fun i f -> frames := add_frame !frames (`Video(i, f)))
+    ~subtitle:(fun i f -> frames := add_frame !frames (`Subtitle(i, f))) src;
+  List.rev !frames
+
+let count kind frames =
+  List.length (List.filter (fun (k, _, _) -> k = kind) frames)
+
+let bench name filename read =
+  let src = Av.open_input filename in
+  let t0 = Unix.gettimeofday() in
+  let frames = read src in
+  let t = Unix.gettimeofday() -. t0 in
+  Av.close src;
+  let nb_frames = List.length frames in
+  Printf.printf "%-12s : %d audio, %d video, %d subtitle frames in %.3f s, %.2f us per frame\n"
+    name (count `Audio frames) (count `Video frames) (count `Subtitle frames)
+    t (if nb_frames > 0 then 1e6 *. t /. float nb_frames else 0.);
+  frames
+
+(* The pts of the frames of each stream, in reading order; the streams
+   are interleaved differently by each way of reading *)
+let per_stream frames =
+  List.sort_uniq compare (List.map (fun (_, i, _) -> i) frames)
+  |> List.map (fun i ->
+      i, List.map (fun (_, _, pts) -> pts) (List.filter (fun (_, j, _) -> j = i) frames))
+
+let check name reference frames =
+  let reference = per_stream reference and streams = per_stream frames in
+  List.iter (fun (i, pts) ->
+      let ref_pts = try List.assoc i reference with Not_found -> [] in
+      if List.length pts <> List.length ref_pts then (
+        Printf.eprintf "%s : %d frames of stream %d read, %d read one at a time\n"
+          name (List.length pts) i (List.length ref_pts);
+        exit 1
+      );
+      if pts <> ref_pts then (
+        Printf.eprintf "%s : frames of stream %d read with other pts than one at a time\n"
+          name i;
+        exit 1
+      ))
+    streams;
+  if List.length streams <> List.length reference then (
+    Printf.eprintf "%s : %d streams read, %d read one at a time\n"
+      name (List.length streams) (List.length reference);
+    exit 1
+  )
+
+let () =
+  if Array.length Sys.argv < 2 then (
+    Printf.eprintf
+      "      \
+       usage: %s input_file [batch_size]\n      \
+       API example program to compare the reading of frames one at a time\n      \
+       with Av.read_input_frame, by batches with Av.read_input_frames and\n      \
+       with a decoding thread per stream, checking that they all read the\n      \
+       same frames.\n" Sys.argv.(0);
+    exit 1
+  );
+
+  let filename = Sys.argv.(1) in
+  let max = if Array.length Sys.argv > 2 then int_of_string Sys.argv.(2) else 64 in
+
+  let reference = bench "one" filename read_one in
+  let batch = "batch of " ^ string_of_int max in
+  check batch reference (bench batch filename (read_batch max));
+  check "parallel" reference (bench "parallel" filename read_parallel)
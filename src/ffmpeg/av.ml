@@ -10,6 +10,8 @@ module Format = struct
   external get_audio_codec_id : (output, audio)format -> Avcodec.Audio.id = "ocaml_av_output_format_get_audio_codec_id"
   external get_video_codec_id : (output, video)format -> Avcodec.Video.id = "ocaml_av_output_format_get_video_codec_id"
   external get_subtitle_codec_id : (output, subtitle)format -> Avcodec.Subtitle.id = "ocaml_av_output_format_get_subtitle_codec_id"
+
+  external find_output_format : string -> (output, _)format option = "ocaml_av_output_format_find"
 end
 
 
@@ -17,8 +19,18 @@ end
 
 (* Input *)
 external open_input : string -> input container = "ocaml_av_open_input"
+external open_input_mmap : string -> input container = "ocaml_av_open_input_mmap"
+let open_input ?(mmap=false) url = if mmap then open_input_mmap url else open_input url
 external open_input_format : (input, _)format -> input container = "ocaml_av_open_input_format"
 
+external open_input_data : data -> (input, _)format option -> input container = "ocaml_av_open_input_data"
+let open_input_data ?format data = open_input_data data format
+
+type seek_command = Seek_set | Seek_cur | Seek_end
+
+external open_input_stream : (bytes -> int -> int -> int) -> (int -> seek_command -> int) option -> (input, _)format option -> input container = "ocaml_av_open_input_stream"
+let open_input_stream ?format ?seek read = open_input_stream read seek format
+
 external _get_duration : input container -> int -> Time_format.t -> Int64.t = "ocaml_av_get_duration"
 let get_input_duration ?(format=`Second) i = _get_duration i (-1) format
 
@@ -72,7 +84,11 @@ let get_metadata s = List.rev(_get_metadata s.container s.index)
 external get_r_frame_rate : (_, _)stream -> Avutil.rational = "ocaml_av_get_stream_r_frame_rate"
 external get_nb_frames : (_, _)stream -> int = "ocaml_av_get_stream_nb_frames"
 
-external select : (input, _)stream -> unit = "ocaml_av_select_stream"
+external select : (input, _)stream -> Avcodec.decode_hint array -> unit = "ocaml_av_select_stream"
+let select ?(decode_hints=[]) stream = select stream (Array.of_list decode_hints)
+external get_nb_read_packets : (input, _)stream -> int = "ocaml_av_get_stream_nb_read_packets"
+
+external get_thread_count : (_, _)stream -> int = "ocaml_av_get_stream_thread_count"
 
 
 type 'a stream_packet_result = [`Packet of 'a Avcodec.Packet.t | `End_of_file]
@@ -127,9 +143,15 @@ type input_frame_result = [
 (** Reads the selected streams if any or all streams otherwise. *)
 external read_input_frame : input container -> input_frame_result = "ocaml_av_read_input_frame"
 
+(** Reads up to [max] frames of the selected streams if any or all streams otherwise. *)
+external read_input_frames : input container -> max:int -> input_frame_result array = "ocaml_av_read_input_frames"
+
+external read_parallel_input_frame : input container -> input_frame_result = "ocaml_av_read_parallel_input_frame"
+
 (** Reads iteratively the selected streams if any or all streams otherwise. *)
-let iter_input_frame ?(audio=(fun _ _->())) ?(video=(fun _ _->())) ?(subtitle=(fun _ _->())) src =
-  let rec iter() = match read_input_frame src with
+let iter_input_frame ?(parallel=false) ?(audio=(fun _ _->())) ?(video=(fun _ _->())) ?(subtitle=(fun _ _->())) src =
+  let read = if parallel then read_parallel_input_frame else read_input_frame in
+  let rec iter() = match read src with
     | `Audio(index, frame) -> audio index frame; iter()
     | `Video(index, frame) -> video index frame; iter()
     | `Subtitle(index, frame) -> subtitle index frame; iter()
@@ -144,12 +166,26 @@ external seek : (input, _)stream -> Time_format.t -> Int64.t -> seek_flag array
 
 external reuse_output : input container -> bool -> unit = "ocaml_av_reuse_output"
 
+external pool_output : input container -> int -> unit = "ocaml_av_pool_output"
+
+external set_decoder_threads : input container -> int -> Avcodec.thread_type array -> unit = "ocaml_av_set_decoder_threads"
+let set_decoder_threads ?(thread_type=[]) src thread_count = set_decoder_threads src thread_count (Array.of_list thread_type)
+
+external release_frame : _ frame -> unit = "ocaml_av_release_frame"
+
 
 (* Output *)
 external open_output : string -> output container = "ocaml_av_open_output"
 external open_output_format : (output, _)format -> output container = "ocaml_av_open_output_format"
 external open_output_format_name : string -> output container = "ocaml_av_open_output_format_name"
 
+type output_sink =
+  | Write of (bytes -> int -> int -> unit)
+  | Ring of data * (int -> int -> unit)
+
+external open_output_stream : (output, _)format -> output_sink -> (int -> seek_command -> int) option -> int -> output container = "ocaml_av_open_output_stream"
+let open_output_stream ?(buffer_size=1048576) ?seek format sink = open_output_stream format sink seek buffer_size
+
 
 external _set_metadata : output container -> int -> (string * string) array -> unit = "ocaml_av_set_metadata"
 let set_output_metadata o tags = _set_metadata o (-1) (Array.of_list tags)
@@ -159,9 +195,9 @@ let set_metadata s tags = _set_metadata s.container s.index (Array.of_list tags)
 let get_output s = s.container
 
 
-external new_audio_stream : output container -> Avcodec.Audio.id -> Channel_layout.t -> Sample_format.t -> int -> int -> Avutil.rational -> int = "ocaml_av_new_audio_stream_byte" "ocaml_av_new_audio_stream"
+external new_audio_stream : output container -> Avcodec.Audio.id -> Channel_layout.t -> Sample_format.t -> int -> int -> Avutil.rational -> int -> Avcodec.thread_type array -> int = "ocaml_av_new_audio_stream_byte" "ocaml_av_new_audio_stream"
 
-let new_audio_stream ?codec_id ?codec_name ?channel_layout ?sample_format ?bit_rate ?sample_rate ?codec ?time_base ?stream o =
+let new_audio_stream ?codec_id ?codec_name ?channel_layout ?sample_format ?bit_rate ?sample_rate ?codec ?time_base ?(thread_count=(-1)) ?(thread_type=[]) ?stream o =
 
   let codec = match codec with
     | Some _ -> codec
@@ -207,12 +243,12 @@ let new_audio_stream ?codec_id ?codec_name ?channel_layout ?sample_format ?bit_r
       | Some stm -> get_time_base stm
       | None -> {num = 1; den = sr}
   in
-  mk_stream o (new_audio_stream o ci cl sf br sr tb)
+  mk_stream o (new_audio_stream o ci cl sf br sr tb thread_count (Array.of_list thread_type))
 
 
-external new_video_stream : output container -> Avcodec.Video.id -> int -> int -> Pixel_format.t -> int -> int -> Avutil.rational -> int = "ocaml_av_new_video_stream_byte" "ocaml_av_new_video_stream"
+external new_video_stream : output container -> Avcodec.Video.id -> int -> int -> Pixel_format.t -> int -> int -> Avutil.rational -> Swscale.flag array -> int -> Avcodec.thread_type array -> int = "ocaml_av_new_video_stream_byte" "ocaml_av_new_video_stream"
 
-let new_video_stream ?codec_id ?codec_name ?width ?height ?pixel_format ?bit_rate ?(frame_rate=25) ?codec ?time_base ?stream o =
+let new_video_stream ?codec_id ?codec_name ?width ?height ?pixel_format ?bit_rate ?(frame_rate=25) ?codec ?time_base ?(scaler_flags=[Swscale.Bicubic]) ?(thread_count=(-1)) ?(thread_type=[]) ?stream o =
 
   let codec = match codec with
     | Some _ -> codec
@@ -258,12 +294,12 @@ let new_video_stream ?codec_id ?codec_name ?width ?height ?pixel_format ?bit_rat
       | Some stm -> get_time_base stm
       | None -> {num = 1; den = frame_rate}
   in
-  mk_stream o (new_video_stream o ci w h pf br frame_rate tb)
+  mk_stream o (new_video_stream o ci w h pf br frame_rate tb (Array.of_list scaler_flags) thread_count (Array.of_list thread_type))
 
 
-external new_subtitle_stream : output container -> Avcodec.Subtitle.id -> Avutil.rational -> int = "ocaml_av_new_subtitle_stream"
+external new_subtitle_stream : output container -> Avcodec.Subtitle.id -> Avutil.rational -> int -> Avcodec.thread_type array -> int = "ocaml_av_new_subtitle_stream"
 
-let new_subtitle_stream ?codec_id ?codec_name ?codec ?time_base ?stream o =
+let new_subtitle_stream ?codec_id ?codec_name ?codec ?time_base ?(thread_count=(-1)) ?(thread_type=[]) ?stream o =
 
   let codec = match codec with
     | Some _ -> codec
@@ -285,7 +321,7 @@ let new_subtitle_stream ?codec_id ?codec_name ?codec ?time_base ?stream o =
       | Some stm -> get_time_base stm
       | None -> Subtitle.time_base()
   in
-  mk_stream o (new_subtitle_stream o ci tb)
+  mk_stream o (new_subtitle_stream o ci tb thread_count (Array.of_list thread_type))
 
 
 external write_packet : (output, 'media)stream -> 'media Avcodec.Packet.t -> unit = "ocaml_av_write_stream_packet"
@@ -26,17 +26,29 @@ module Format : sig
 
   val get_subtitle_codec_id : (output, subtitle)format -> Avcodec.Subtitle.id
   (** Return the subtitle codec id of the output subtitle format *)
+
+  val find_output_format : string -> (output, _)format option
+  (** Return the output format of the given short name, such as ["matroska"], if any *)
 end
 
 
 (** {5 Input} *)
 
-val open_input : string -> input container
-(** [Av.open_input url] open the input [url] (a file name or http URL). @raise Failure if the opening failed. *)
+val open_input : ?mmap:bool -> string -> input container
+(** [Av.open_input ~mmap:m url] open the input [url] (a file name or http URL). If [m] is [true] (default: [false]), [url] must be a local file name and the file is mapped in memory, the demuxer reading from the mapping. @raise Failure if the opening failed. *)
 
 val open_input_format : (input, _)format -> input container
 (** [Av.open_input_format format] open the input [format]. @raise Failure if the opening failed. *)
 
+val open_input_data : ?format:(input, _)format -> data -> input container
+(** [Av.open_input_data ~format:fmt data] open the input whose content is the [data] bigarray, which is read in place. The [fmt] format is probed from the content if not given. @raise Failure if the opening failed. *)
+
+(** Origin of a position given to an input or output stream seek function. *)
+type seek_command = Seek_set | Seek_cur | Seek_end
+
+val open_input_stream : ?format:(input, _)format -> ?seek:(int -> seek_command -> int) -> (bytes -> int -> int -> int) -> input container
+(** [Av.open_input_stream ~format:fmt ~seek:sf rf] open the input read by the [rf] function. [rf buf ofs len] must store up to [len] bytes in [buf] from [ofs] and return the number of bytes stored, [0] at the end of the input. [sf ofs cmd] must move to the [ofs] position relative to [cmd] and return the new position from the beginning, or a negative value on failure. Without [sf], the input is not seekable. The functions are called by the reading functions of the input and must not use it. The [fmt] format is probed from the content if not given. @raise Failure if the opening failed. *)
+
 
 val get_input_duration : ?format:Time_format.t -> input container -> Int64.t
 (** [Av.get_input_duration ~format:fmt input] return the duration of an [input] in the [fmt] time format (in second by default). *)
@@ -100,8 +112,14 @@ val get_r_frame_rate : (_, _)stream -> Avutil.rational
 val get_nb_frames : (_, _)stream -> int
 (** [Av.get_nb_frames stream] return the number of frames of the [stream]. *)
 
-val select : (input, _)stream -> unit
-(** [Av.select stream] select the input [stream] for reading. @raise Failure if the selection failed. *)
+val select : ?decode_hints:Avcodec.decode_hint list -> (input, _)stream -> unit
+(** [Av.select ~decode_hints:dh stream] select the input [stream] for reading. The streams that are neither selected nor read otherwise are discarded by the demuxer. The decoder of the [stream] follows the [dh] hints, a [Skip_frame] of [Discard_nonkey] or more also making the demuxer drop the non-key packets. The [Lowres] level can only be set before the decoder is opened by a first selection or reading. @raise Failure if the selection failed. *)
+
+val get_nb_read_packets : (input, _)stream -> int
+(** [Av.get_nb_read_packets stream] return the number of packets of the input [stream] returned by the demuxer so far, whether they were used or dropped. *)
+
+val get_thread_count : (_, _)stream -> int
+(** [Av.get_thread_count stream] return the number of threads used by the decoder or encoder of the [stream], [1] if it is not threaded. For an input stream whose decoder is not opened yet, the count set by {!Av.set_decoder_threads} ([1] by default) is returned without opening it. @raise Failure if the stream has no codec. *)
 
 (** Stream packet reading result. *)
 type 'media stream_packet_result = [ `Packet of 'media Avcodec.Packet.t | `End_of_file ]
@@ -149,11 +167,15 @@ type input_frame_result = [
 val read_input_frame : input container -> input_frame_result
 (** Reads the selected streams if any or all streams otherwise. Return the next [Audio] [Video] or [Subtitle] index and frame of the input or [End_of_file] if the end of the input is reached. @raise Failure if the reading failed. *)
 
-val iter_input_frame : ?audio:(int -> audio frame -> unit) ->
+val read_input_frames : input container -> max:int -> input_frame_result array
+(** [Av.read_input_frames src ~max:n] reads up to [n] frames of the selected streams if any or all streams of the [src] input otherwise, decoding them in a single call to the C side. Return the [Audio] [Video] or [Subtitle] index and frame of each frame read, followed by [End_of_file] if the end of the input is reached. The frames are distinct even if {!Av.reuse_output} is enabled and are taken from the pool set by {!Av.pool_output} if any. @raise Failure if the reading failed or [n] is not positive. *)
+
+val iter_input_frame : ?parallel:bool ->
+  ?audio:(int -> audio frame -> unit) ->
   ?video:(int -> video frame -> unit) ->
   ?subtitle:(int -> subtitle frame -> unit) ->
   input container -> unit
-(** [Av.iter_input_frame ~audio:af ~video:vf ~subtitle:sf src] reads iteratively the selected streams if any or all streams of the [src] input otherwise. It applies function [af] to the audio frames, [vf] to the video frames and [sf] to the subtitle frames with the index of the related stream as first parameter. @raise Failure if the reading failed. *)
+(** [Av.iter_input_frame ~parallel:p ~audio:af ~video:vf ~subtitle:sf src] reads iteratively the selected streams if any or all streams of the [src] input otherwise. It applies function [af] to the audio frames, [vf] to the video frames and [sf] to the subtitle frames with the index of the related stream as first parameter. If [p] is [true] (default: [false]), each audio and video stream is decoded by its own thread and the frames, subtitles included, are given in timestamp order, unless a stream gets 64 frames ahead of a stream waiting for its packets, or a subtitle is read while the previous one is still held back, whose frames may then come late. A selected or opened stream waits for its packets until the end of the input. The decoding threads keep running until the input is closed or {!Av.seek} is called, so the other frame reading functions must not be used on the input in the meantime. @raise Failure if the reading failed. *)
 
 
 (** Seek mode. *)
@@ -165,6 +187,15 @@ val seek : (input, _)stream -> Time_format.t -> Int64.t -> seek_flag array -> un
 val reuse_output : input container -> bool -> unit
 (** [Av.reuse_output ro] enables or disables the reuse of {!Av.read_packet}, {!Av.iter_packet}, {!Av.read_frame}, {!Av.iter_frame}, {!Av.read_input_packet}, {!Av.iter_input_packet}, {!Av.read_input_frame} and {!Av.iter_input_frame} output according to the value of [ro]. Reusing the output reduces the number of memory allocations. In this cas, the data returned by a reading function is invalidated by a new call to this function. *)
 
+val pool_output : input container -> int -> unit
+(** [Av.pool_output src n] makes {!Av.read_frame}, {!Av.iter_frame}, {!Av.read_input_frame} and {!Av.iter_input_frame} take their audio and video frames from a pool keeping up to [n] unused frames of the [src] input, [0] disabling the pool. The frames given back by {!Av.release_frame} or collected by the GC are reused for the next frames read, each in a new OCaml value, so that several frames can be held at once without being invalidated. This takes precedence over {!Av.reuse_output}. @raise Failure if the pool allocation failed. *)
+
+val set_decoder_threads : ?thread_type:Avcodec.thread_type list -> input container -> int -> unit
+(** [Av.set_decoder_threads ~thread_type:tt src n] makes the decoders of the [src] input opened afterwards use [n] threads ([0] for an automatic count) with the allowed [tt] threading methods. The decoders are opened by the first stream selection or reading. *)
+
+val release_frame : _ frame -> unit
+(** [Av.release_frame frm] gives the data of the [frm] frame taken from a pool back to the decoder without waiting for the frame to be collected, along with its underlying frame, which is then reused for a later frame. The [frm] value is empty afterwards and must not be used anymore, but is never handed back by the reading functions. Frames that do not come from a pool are left untouched. *)
+
 
 (** {5 Output} *)
 
@@ -177,6 +208,14 @@ val open_output_format : (output, _) format -> output container
 val open_output_format_name : string -> output container
 (** [Av.open_output_format_name name] open the output format of name [name]. @raise Failure if the opening failed. *)
 
+(** Destination of the data written by an output stream. [Write wf] calls [wf buf ofs len] with the [len] bytes to write stored in [buf] from [ofs]. [Ring (data, nf)] copies the bytes in the [data] bigarray, wrapping around at its end, and calls [nf ofs len] with the position of each copied chunk, which must be consumed before the ring wraps around. *)
+type output_sink =
+  | Write of (bytes -> int -> int -> unit)
+  | Ring of data * (int -> int -> unit)
+
+val open_output_stream : ?buffer_size:int -> ?seek:(int -> seek_command -> int) -> (output, _) format -> output_sink -> output container
+(** [Av.open_output_stream ~buffer_size:n ~seek:sf format sink] open the output [format] writing its data to [sink] by blocks of up to [n] bytes (1 MiB by default). [sf ofs cmd] must move to the [ofs] position relative to [cmd] and return the new position from the beginning, or a negative value on failure. Without [sf], the output is not seekable, which some formats require. The functions are called by the writing functions of the output and must not use it. @raise Failure if the opening failed. *)
+
 
 val set_output_metadata : output container -> (string * string) list -> unit
 (** [Av.set_output_metadata dst tags] set the metadata of the [dst] output with the [tags] tag list. This must be set before starting writing streams. @raise Failure if a writing already taken place or if the setting failed. *)
@@ -190,15 +229,15 @@ val get_output : (output, _)stream -> output container
 (** Return the output container of the output stream. *)
 
 
-val new_audio_stream : ?codec_id:Avcodec.Audio.id -> ?codec_name:string -> ?channel_layout:Channel_layout.t -> ?sample_format:Sample_format.t -> ?bit_rate:int -> ?sample_rate:int -> ?codec:audio Avcodec.t -> ?time_base:Avutil.rational -> ?stream:(_, audio)stream -> output container -> (output, audio)stream
-(** [Av.new_audio_stream ~codec_id:ci ~codec_name:cn ~channel_layout:cl ~sample_format:sf ~bit_rate:br ~sample_rate:sr ~codec:c ~time_base:tb ~stream:s dst] add a new audio stream to the [dst] media file. Parameters [ci], [cn], [cl], [sf], [br], [sr] passed unitarily take precedence over those of the [c] codec. The [c] codec and [tb] time base parameters take precedence over those of the [s] stream. This must be set before starting writing streams. @raise Failure if a writing already taken place or if the stream allocation failed. *)
+val new_audio_stream : ?codec_id:Avcodec.Audio.id -> ?codec_name:string -> ?channel_layout:Channel_layout.t -> ?sample_format:Sample_format.t -> ?bit_rate:int -> ?sample_rate:int -> ?codec:audio Avcodec.t -> ?time_base:Avutil.rational -> ?thread_count:int -> ?thread_type:Avcodec.thread_type list -> ?stream:(_, audio)stream -> output container -> (output, audio)stream
+(** [Av.new_audio_stream ~codec_id:ci ~codec_name:cn ~channel_layout:cl ~sample_format:sf ~bit_rate:br ~sample_rate:sr ~codec:c ~time_base:tb ~thread_count:n ~thread_type:tt ~stream:s dst] add a new audio stream to the [dst] media file. Parameters [ci], [cn], [cl], [sf], [br], [sr] passed unitarily take precedence over those of the [c] codec. The [c] codec and [tb] time base parameters take precedence over those of the [s] stream. The encoder uses [n] threads ([0] for an automatic count) with the allowed [tt] threading methods, the codec defaults being kept if not given. This must be set before starting writing streams. @raise Failure if a writing already taken place or if the stream allocation failed. *)
 
 
-val new_video_stream : ?codec_id:Avcodec.Video.id -> ?codec_name:string -> ?width:int -> ?height:int -> ?pixel_format:Pixel_format.t -> ?bit_rate:int -> ?frame_rate:int -> ?codec:video Avcodec.t -> ?time_base:Avutil.rational -> ?stream:(_, video)stream -> output container -> (output, video)stream
-(** Same as {!Av.new_audio_stream} for video stream. *)
+val new_video_stream : ?codec_id:Avcodec.Video.id -> ?codec_name:string -> ?width:int -> ?height:int -> ?pixel_format:Pixel_format.t -> ?bit_rate:int -> ?frame_rate:int -> ?codec:video Avcodec.t -> ?time_base:Avutil.rational -> ?scaler_flags:Swscale.flag list -> ?thread_count:int -> ?thread_type:Avcodec.thread_type list -> ?stream:(_, video)stream -> output container -> (output, video)stream
+(** Same as {!Av.new_audio_stream} for video stream. The frames written in another size or pixel format are scaled according to the [scaler_flags] (default: [[Bicubic]]), a scale context being kept for each of the last input formats met. *)
 
 
-val new_subtitle_stream : ?codec_id:Avcodec.Subtitle.id -> ?codec_name:string -> ?codec:subtitle Avcodec.t -> ?time_base:Avutil.rational -> ?stream:(_, subtitle)stream -> output container -> (output, subtitle)stream
+val new_subtitle_stream : ?codec_id:Avcodec.Subtitle.id -> ?codec_name:string -> ?codec:subtitle Avcodec.t -> ?time_base:Avutil.rational -> ?thread_count:int -> ?thread_type:Avcodec.thread_type list -> ?stream:(_, subtitle)stream -> output container -> (output, subtitle)stream
 (** Same as {!Av.new_audio_stream} for subtitle stream. *)
 
 
@@ -1,4 +1,10 @@
 #include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include <caml/mlvalues.h>
 #include <caml/memory.h>
@@ -14,18 +20,38 @@
 #include <libavutil/avstring.h>
 #include <libavformat/avformat.h>
 #include <libavutil/audio_fifo.h>
+#include <libavutil/fifo.h>
+#include <libavutil/threadmessage.h>
 #include <libswresample/swresample.h>
 #include <libswscale/swscale.h>
 
 #include "avutil_stubs.h"
 #include "avcodec_stubs.h"
 #include "av_stubs.h"
+#include "swscale_stubs.h"
 
 #include <libavutil/timestamp.h>
 #include <libavformat/avformat.h>
 
 /**** Context ****/
 
+// Number of packets or frames queued for a decoding thread
+#define DECODE_QUEUE_SIZE 16
+
+// Number of frames of a stream kept while waiting for the frames of the
+// other streams, the earliest frame being given once it is reached
+#define MAX_DECODED_FRAMES 64
+
+// Number of input formats for which an output stream keeps a scale context
+#define SCALER_CACHE_SIZE 4
+
+typedef struct {
+  struct SwsContext *sws_ctx;
+  int width, height;
+  enum AVPixelFormat format;
+  unsigned last_use;
+} scaler_t;
+
 typedef struct {
   int index;
   AVCodecContext *codec_context;
@@ -35,8 +61,20 @@ typedef struct {
   value frame_value;
   int got_frame;
 
+  // parallel decoding
+  struct av_t *av;
+  int threaded;
+  pthread_t thread;
+  AVThreadMessageQueue *packet_queue;
+  AVThreadMessageQueue *frame_queue;
+  AVFifoBuffer *frames;   // frames received from the thread, in decoding order, up to MAX_DECODED_FRAMES
+  atomic_int nb_pending;  // packets sent to the thread and not decoded yet
+  int decoded_eof;
+
   // output
-  struct SwsContext *sws_ctx;
+  scaler_t scalers[SCALER_CACHE_SIZE];
+  int sws_flags;
+  unsigned nb_scaled_frames;
   struct SwrContext *swr_ctx;
   AVFrame *sw_frame;
   AVAudioFifo *audio_fifo;
@@ -44,6 +82,47 @@ typedef struct {
   int64_t pts;
 } stream_t;
 
+// Custom input, read from a bigarray or through OCaml callbacks
+typedef struct {
+  AVIOContext *avio;
+
+  // bigarray or file mapping
+  value data;
+  uint8_t *bytes;
+  int64_t size;
+  int64_t pos;
+  void *mapping;
+
+  // callbacks
+  value read;
+  value seek;
+  value buffer;
+} input_io_t;
+
+// Custom output, written to a bigarray ring or through an OCaml callback
+struct output_io_t {
+  AVIOContext *avio;
+
+  // bigarray ring
+  value ring;
+  uint8_t *bytes;
+  int64_t size;
+  int64_t pos;
+
+  // callbacks
+  value write;  // write function, or ring notification function
+  value seek;
+  value buffer;
+};
+
+// Frame decoded by a batch read, before being given to OCaml
+typedef struct {
+  stream_t * stream;
+  value frame_kind;
+  AVFrame * frame;
+  AVSubtitle subtitle;
+} batch_frame_t;
+
 typedef struct av_t {
   AVFormatContext *format_context;
   stream_t ** streams;
@@ -51,16 +130,32 @@ typedef struct av_t {
   int is_input;
 
   // input
+  input_io_t * io;
   value packet_value;
   int end_of_file;
   int selected_streams;
+  unsigned int nb_counted_streams;
+  int64_t * nb_read_packets; // packets returned by the demuxer, per stream
   stream_t * best_audio_stream;
   stream_t * best_video_stream;
   stream_t * best_subtitle_stream;
+  batch_frame_t * batch;
+  int batch_size;
+  int dec_thread_count; // threading of the decoders opened, negative for the defaults
+  int dec_thread_type;
+  int parallel;
+  int packet_pending; // the packet read is not sent to its thread yet
+  AVSubtitle subtitle; // decoded subtitle waiting for the earlier frames of the threads
+  stream_t * subtitle_stream;
+  pthread_mutex_t frame_lock;
+  pthread_cond_t frame_cond;  // signaled by the threads after each packet or frame
+  unsigned frame_generation;
 
   // output
+  output_io_t * out_io;
   int header_written;
   int release_out;
+  frame_pool_t * frame_pool;
 } av_t;
 
 #define Av_val(v) (*(av_t**)Data_custom_val(v))
@@ -86,10 +181,57 @@ enum AVMediaType MediaType_val(value v)
 }
 
 
+// Stop the decoding thread of a stream and drop the frames it decoded
+static void free_decode_thread(stream_t * stream)
+{
+  AVPacket packet;
+  AVFrame * frame;
+
+  if(stream->threaded) {
+    // AVERROR_EXIT tells the thread to stop without flushing the decoder
+    av_thread_message_queue_set_err_send(stream->packet_queue, AVERROR_EXIT);
+    av_thread_message_queue_set_err_recv(stream->packet_queue, AVERROR_EXIT);
+    av_thread_message_queue_set_err_send(stream->frame_queue, AVERROR_EXIT);
+    while(av_thread_message_queue_recv(stream->frame_queue, &frame, AV_THREAD_MESSAGE_NONBLOCK) >= 0)
+      av_frame_free(&frame);
+
+    pthread_join(stream->thread, NULL);
+    stream->threaded = 0;
+
+    // The decoder is left ready for the packets following a seek
+    avcodec_flush_buffers(stream->codec_context);
+  }
+
+  if(stream->packet_queue) {
+    while(av_thread_message_queue_recv(stream->packet_queue, &packet, AV_THREAD_MESSAGE_NONBLOCK) >= 0)
+      av_packet_unref(&packet);
+    av_thread_message_queue_free(&stream->packet_queue);
+  }
+
+  if(stream->frame_queue) {
+    while(av_thread_message_queue_recv(stream->frame_queue, &frame, AV_THREAD_MESSAGE_NONBLOCK) >= 0)
+      av_frame_free(&frame);
+    av_thread_message_queue_free(&stream->frame_queue);
+  }
+
+  if(stream->frames) {
+    while(av_fifo_size(stream->frames) >= (int)sizeof(AVFrame*)) {
+      av_fifo_generic_read(stream->frames, &frame, sizeof(AVFrame*), NULL);
+      av_frame_free(&frame);
+    }
+    av_fifo_freep(&stream->frames);
+  }
+
+  atomic_store(&stream->nb_pending, 0);
+  stream->decoded_eof = 0;
+}
+
 static void free_stream(stream_t * stream)
 {
   if( ! stream) return;
 
+  free_decode_thread(stream);
+
   if(stream->codec_context) avcodec_free_context(&stream->codec_context);
 
   if(stream->packet_value) caml_remove_generational_global_root(&stream->packet_value);
@@ -100,8 +242,9 @@ static void free_stream(stream_t * stream)
     swr_free(&stream->swr_ctx);
   }
 
-  if(stream->sws_ctx) {
-    sws_freeContext(stream->sws_ctx);
+  int i;
+  for(i = 0; i < SCALER_CACHE_SIZE; i++) {
+    if(stream->scalers[i].sws_ctx) sws_freeContext(stream->scalers[i].sws_ctx);
   }
 
   if(stream->sw_frame) {
@@ -119,6 +262,44 @@ static void free_stream(stream_t * stream)
   free(stream);
 }
 
+static void free_input_io(input_io_t * io)
+{
+  if(io->avio) {
+    av_freep(&io->avio->buffer);
+    avio_context_free(&io->avio);
+  }
+
+  if(io->mapping) munmap(io->mapping, io->size);
+
+  if(io->data) caml_remove_generational_global_root(&io->data);
+  if(io->read) caml_remove_generational_global_root(&io->read);
+  if(io->seek) caml_remove_generational_global_root(&io->seek);
+  if(io->buffer) caml_remove_generational_global_root(&io->buffer);
+
+  free(io);
+}
+
+static void clear_batch(av_t * av)
+{
+  int i;
+  for(i = 0; i < av->batch_size; i++) {
+    av_frame_unref(av->batch[i].frame);
+    avsubtitle_free(&av->batch[i].subtitle);
+  }
+}
+
+static void free_batch(av_t * av)
+{
+  int i;
+  for(i = 0; i < av->batch_size; i++) {
+    av_frame_free(&av->batch[i].frame);
+    avsubtitle_free(&av->batch[i].subtitle);
+  }
+  free(av->batch);
+  av->batch = NULL;
+  av->batch_size = 0;
+}
+
 static void close_av(av_t * av)
 {
   if( ! av) return;
@@ -134,12 +315,26 @@ static void close_av(av_t * av)
       av->streams = NULL;
     }
 
+    if(av->batch) free_batch(av);
+
+    if(av->subtitle_stream) {
+      avsubtitle_free(&av->subtitle);
+      av->subtitle_stream = NULL;
+    }
+
+    if(av->nb_read_packets) {
+      free(av->nb_read_packets);
+      av->nb_read_packets = NULL;
+      av->nb_counted_streams = 0;
+    }
+
     if(av->format_context->iformat) {
       avformat_close_input(&av->format_context);
     }
     else if(av->format_context->oformat) {
-      // Close the output file if needed.
-      if( ! (av->format_context->oformat->flags & AVFMT_NOFILE))
+      // Close the output file if needed. A custom output is freed with its I/O.
+      if( ! (av->format_context->oformat->flags & AVFMT_NOFILE)
+          && ! (av->format_context->flags & AVFMT_FLAG_CUSTOM_IO))
         avio_closep(&av->format_context->pb);
 
       avformat_free_context(av->format_context);
@@ -150,6 +345,19 @@ static void close_av(av_t * av)
     av->best_video_stream = NULL;
     av->best_subtitle_stream = NULL;
   }
+
+  if(av->io) {
+    free_input_io(av->io);
+    av->io = NULL;
+  }
+
+  if(av->out_io) {
+    ocaml_av_free_output_io(av->out_io);
+    av->out_io = NULL;
+  }
+
+  frame_pool_close(av->frame_pool);
+  av->frame_pool = NULL;
 }
 
 static void free_av(av_t * av)
@@ -158,6 +366,11 @@ static void free_av(av_t * av)
 
   close_av(av);
 
+  if(av->parallel) {
+    pthread_cond_destroy(&av->frame_cond);
+    pthread_mutex_destroy(&av->frame_lock);
+  }
+
   if(av->packet_value) caml_remove_generational_global_root(&av->packet_value);
 
   if(av->control_message_callback) {
@@ -290,32 +503,47 @@ CAMLprim value ocaml_av_input_format_get_long_name(value _format)
 }
 
 
-static av_t * open_input(char *url, AVInputFormat *format)
+static av_t * open_input(char *url, AVInputFormat *format, input_io_t *io)
 {
   av_t *av = (av_t*)calloc(1, sizeof(av_t));
   if ( ! av) Fail("Failed to allocate input context");
 
   av->is_input = 1;
   av->release_out = 1;
+  av->dec_thread_count = -1;
 
   if(url && 0 == strncmp("http", url, 4)) {
     avformat_network_init();
   }
 
+  // A custom input is read through the I/O context given to the format context
+  if(io) {
+    av->format_context = avformat_alloc_context();
+
+    if( ! av->format_context) {
+      free(av);
+      Fail("Failed to allocate input format context");
+    }
+    av->format_context->pb = io->avio;
+  }
+
   int ret = avformat_open_input(&av->format_context, url, format, NULL);
 
   if (ret < 0 || ! av->format_context) {
     free(av);
-    Fail("Failed to open input %s", format ? format->name : url);
+    Fail("Failed to open input %s", format ? format->name : url ? url : "stream");
   }
 
   // retrieve stream information
   ret = avformat_find_stream_info(av->format_context, NULL);
 
   if (ret < 0) {
+    avformat_close_input(&av->format_context);
     free(av);
     Fail("Stream information not found");
   }
+
+  av->io = io;
   return av;
 }
 
@@ -327,7 +555,7 @@ CAMLprim value ocaml_av_open_input(value _url)
 
   // open input url
   caml_release_runtime_system();
-  av_t *av = open_input(url, NULL);
+  av_t *av = open_input(url, NULL, NULL);
 
   free(url);
   caml_acquire_runtime_system();
@@ -348,7 +576,7 @@ CAMLprim value ocaml_av_open_input_format(value _format)
 
   // open input format
   caml_release_runtime_system();
-  av_t *av = open_input(NULL, format);
+  av_t *av = open_input(NULL, format, NULL);
   caml_acquire_runtime_system();
   if( ! av) Raise(EXN_FAILURE, "%s", ocaml_av_error_msg);
 
@@ -359,6 +587,217 @@ CAMLprim value ocaml_av_open_input_format(value _format)
   CAMLreturn(ans);
 }
 
+
+/***** Custom input *****/
+
+#define INPUT_IO_BUFFER_SIZE 65536
+
+static int read_data(void *opaque, uint8_t *buf, int size)
+{
+  input_io_t * io = (input_io_t*)opaque;
+  int64_t len = io->size - io->pos;
+
+  if(len <= 0) return AVERROR_EOF;
+  if(len > size) len = size;
+
+  memcpy(buf, io->bytes + io->pos, len);
+  io->pos += len;
+
+  return (int)len;
+}
+
+static int64_t seek_data(void *opaque, int64_t offset, int whence)
+{
+  input_io_t * io = (input_io_t*)opaque;
+  int64_t pos;
+
+  switch(whence & ~AVSEEK_FORCE) {
+  case AVSEEK_SIZE: return io->size;
+  case SEEK_SET: pos = offset; break;
+  case SEEK_CUR: pos = io->pos + offset; break;
+  case SEEK_END: pos = io->size + offset; break;
+  default: return AVERROR(EINVAL);
+  }
+
+  if(pos < 0 || pos > io->size) return AVERROR(EINVAL);
+
+  io->pos = pos;
+  return pos;
+}
+
+// The callbacks are called by the demuxer, with the runtime lock released
+static int read_callback(void *opaque, uint8_t *buf, int size)
+{
+  input_io_t * io = (input_io_t*)opaque;
+  int len;
+
+  caml_acquire_runtime_system();
+
+  if(size > caml_string_length(io->buffer)) size = caml_string_length(io->buffer);
+
+  value ret = caml_callback3_exn(io->read, io->buffer, Val_int(0), Val_int(size));
+
+  if(Is_exception_result(ret)) {
+    len = AVERROR_EXTERNAL;
+  }
+  else {
+    len = Int_val(ret);
+
+    if(len > size) len = AVERROR_EXTERNAL;
+    else if(len > 0) memcpy(buf, String_val(io->buffer), len);
+    else if(len == 0) len = AVERROR_EOF;
+    else len = AVERROR_EXTERNAL;
+  }
+
+  caml_release_runtime_system();
+
+  return len;
+}
+
+// Call an OCaml seek function, with the runtime lock released
+static int64_t call_seek(value * seek, int64_t offset, int whence)
+{
+  int64_t pos;
+  int command;
+
+  switch(whence & ~AVSEEK_FORCE) {
+  case SEEK_SET: command = 0; break;
+  case SEEK_CUR: command = 1; break;
+  case SEEK_END: command = 2; break;
+  default: return AVERROR(ENOSYS);
+  }
+
+  ocaml_ffmpeg_register_thread();
+  caml_acquire_runtime_system();
+
+  value ret = caml_callback2_exn(*seek, Val_long(offset), Val_int(command));
+
+  pos = Is_exception_result(ret) ? AVERROR_EXTERNAL : Long_val(ret);
+
+  caml_release_runtime_system();
+
+  return pos < 0 ? AVERROR(EINVAL) : pos;
+}
+
+static int64_t seek_callback(void *opaque, int64_t offset, int whence)
+{
+  return call_seek(&((input_io_t*)opaque)->seek, offset, whence);
+}
+
+static input_io_t * alloc_input_io(int (*read)(void *, uint8_t *, int), int64_t (*seek)(void *, int64_t, int))
+{
+  input_io_t * io = (input_io_t*)calloc(1, sizeof(input_io_t));
+  if( ! io) Fail("Failed to allocate input I/O");
+
+  unsigned char * buffer = (unsigned char*)av_malloc(INPUT_IO_BUFFER_SIZE);
+
+  if( ! buffer) {
+    free(io);
+    Fail("Failed to allocate input I/O buffer");
+  }
+
+  io->avio = avio_alloc_context(buffer, INPUT_IO_BUFFER_SIZE, 0, io, read, NULL, seek);
+
+  if( ! io->avio) {
+    av_free(buffer);
+    free(io);
+    Fail("Failed to allocate input I/O context");
+  }
+  return io;
+}
+
+static value open_input_io(input_io_t * io, value _format)
+{
+  CAMLparam1(_format);
+  CAMLlocal1(ans);
+  AVInputFormat * format = Is_block(_format) ? InputFormat_val(Field(_format, 0)) : NULL;
+
+  caml_release_runtime_system();
+  av_t *av = open_input(NULL, format, io);
+  caml_acquire_runtime_system();
+
+  if( ! av) {
+    free_input_io(io);
+    Raise(EXN_FAILURE, "%s", ocaml_av_error_msg);
+  }
+
+  ans = caml_alloc_custom(&av_ops, sizeof(av_t*), 0, 1);
+  Av_val(ans) = av;
+
+  CAMLreturn(ans);
+}
+
+CAMLprim value ocaml_av_open_input_data(value _data, value _format)
+{
+  CAMLparam2(_data, _format);
+
+  input_io_t * io = alloc_input_io(read_data, seek_data);
+  if( ! io) Raise(EXN_FAILURE, "%s", ocaml_av_error_msg);
+
+  io->data = _data;
+  caml_register_generational_global_root(&io->data);
+  io->bytes = (uint8_t*)Caml_ba_data_val(_data);
+  io->size = Caml_ba_array_val(_data)->dim[0];
+
+  CAMLreturn(open_input_io(io, _format));
+}
+
+CAMLprim value ocaml_av_open_input_mmap(value _url)
+{
+  CAMLparam1(_url);
+  struct stat st;
+
+  input_io_t * io = alloc_input_io(read_data, seek_data);
+  if( ! io) Raise(EXN_FAILURE, "%s", ocaml_av_error_msg);
+
+  int fd = open(String_val(_url), O_RDONLY);
+
+  if(fd < 0 || fstat(fd, &st) < 0 || st.st_size == 0) {
+    if(fd >= 0) close(fd);
+    free_input_io(io);
+    Raise(EXN_FAILURE, "Failed to open input %s", String_val(_url));
+  }
+
+  void * mapping = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+
+  if(mapping == MAP_FAILED) {
+    free_input_io(io);
+    Raise(EXN_FAILURE, "Failed to map input %s", String_val(_url));
+  }
+  madvise(mapping, st.st_size, MADV_SEQUENTIAL);
+
+  io->mapping = mapping;
+  io->bytes = (uint8_t*)mapping;
+  io->size = st.st_size;
+
+  // The demuxer reads are served straight from the mapping, without going through the I/O buffer
+  io->avio->direct = 1;
+
+  CAMLreturn(open_input_io(io, Val_int(0)));
+}
+
+CAMLprim value ocaml_av_open_input_stream(value _read, value _seek, value _format)
+{
+  CAMLparam3(_read, _seek, _format);
+
+  input_io_t * io = alloc_input_io(read_callback, Is_block(_seek) ? seek_callback : NULL);
+  if( ! io) Raise(EXN_FAILURE, "%s", ocaml_av_error_msg);
+
+  io->read = _read;
+  caml_register_generational_global_root(&io->read);
+
+  if(Is_block(_seek)) {
+    io->seek = Field(_seek, 0);
+    caml_register_generational_global_root(&io->seek);
+  }
+
+  io->buffer = caml_alloc_string(INPUT_IO_BUFFER_SIZE);
+  caml_register_generational_global_root(&io->buffer);
+
+  CAMLreturn(open_input_io(io, _format));
+}
+
 CAMLprim value ocaml_av_get_metadata(value _av, value _stream_index)
 {
   CAMLparam1(_av);
@@ -467,6 +906,29 @@ CAMLprim value ocaml_av_reuse_output(value _av, value _reuse_output)
   CAMLreturn(Val_unit);
 }
 
+CAMLprim value ocaml_av_pool_output(value _av, value _size)
+{
+  CAMLparam2(_av, _size);
+  av_t * av = Av_val(_av);
+  int size = Int_val(_size);
+
+  frame_pool_close(av->frame_pool);
+  av->frame_pool = NULL;
+
+  if(size > 0) {
+    av->frame_pool = frame_pool_create(size);
+    if( ! av->frame_pool) Raise(EXN_FAILURE, "%s", ocaml_av_error_msg);
+  }
+  CAMLreturn(Val_unit);
+}
+
+CAMLprim value ocaml_av_release_frame(value _frame)
+{
+  CAMLparam1(_frame);
+  frame_pool_release_value(_frame);
+  CAMLreturn(Val_unit);
+}
+
 static value provide_packet_value(value * packet_value)
 {
   // Allocate the packet if needed
@@ -485,6 +947,10 @@ static stream_t** allocate_input_context(av_t *av)
   av->streams = (stream_t**)calloc(av->format_context->nb_streams, sizeof(stream_t*));
   if( ! av->streams) Fail("Failed to allocate streams array");
 
+  av->nb_read_packets = (int64_t*)calloc(av->format_context->nb_streams, sizeof(int64_t));
+  if( ! av->nb_read_packets) Fail("Failed to allocate packet counters");
+  av->nb_counted_streams = av->format_context->nb_streams;
+
   return av->streams;
 }
 
@@ -500,7 +966,10 @@ static AVFrame * allocate_type_frame(enum AVMediaType type, value * pvalue)
 
 static AVFrame * provide_stream_frame(av_t * av, stream_t * stream, value * frame_value)
 {
-  if(av->release_out) {
+  if(av->frame_pool && stream->codec_context->codec_type != AVMEDIA_TYPE_SUBTITLE) {
+    return alloc_pooled_frame_value(av->frame_pool, frame_value);
+  }
+  else if(av->release_out) {
     return allocate_type_frame(stream->codec_context->codec_type, frame_value);
   }
   else {
@@ -519,6 +988,17 @@ static AVFrame * provide_stream_frame(av_t * av, stream_t * stream, value * fram
   }
 }
 
+// Report the data size of a decoded frame value to the GC
+static void account_stream_frame(stream_t * stream, value frame_value)
+{
+  if(stream->codec_context->codec_type == AVMEDIA_TYPE_SUBTITLE) {
+    account_subtitle_value(frame_value);
+  }
+  else {
+    account_frame_value(frame_value);
+  }
+}
+
 static stream_t * allocate_stream_context(av_t *av, int index, AVCodec *codec)
 {
   enum AVMediaType type = codec->type;
@@ -538,7 +1018,7 @@ static stream_t * allocate_stream_context(av_t *av, int index, AVCodec *codec)
   return stream;
 }
 
-static stream_t * open_stream_index(av_t *av, int index)
+static stream_t * open_stream_index(av_t *av, int index, const decode_hints_t *hints)
 {
   if( ! av->format_context) Fail("Failed to open stream %d of closed input", index);
 
@@ -559,17 +1039,28 @@ static stream_t * open_stream_index(av_t *av, int index)
   int ret = avcodec_parameters_to_context(stream->codec_context, dec_param);
   if(ret < 0) Fail("Failed to initialize the stream context with the stream parameters : %s", av_err2str(ret));
 
+  // Needed for the timestamps of the decoded subtitles
+  stream->codec_context->pkt_timebase = av->format_context->streams[index]->time_base;
+
+  set_codec_context_threads(stream->codec_context, av->dec_thread_count, av->dec_thread_type);
+  if(hints) set_codec_context_hints(stream->codec_context, hints);
+
   // Open the decoder
   ret = avcodec_open2(stream->codec_context, dec, NULL);
   if(ret < 0) Fail("Failed to open stream %d codec : %s", index, av_err2str(ret));
 
+  // An opened stream is read, even if discarded by a previous selection,
+  // the demuxer dropping the non-key packets if the decoder skips them anyway
+  av->format_context->streams[index]->discard =
+    hints && hints->skip_frame >= AVDISCARD_NONKEY ? AVDISCARD_NONKEY : AVDISCARD_DEFAULT;
+
   return stream;
 }
 
 #define Check_stream(av, index) {                               \
     if( ! (av)->streams || ! (av)->streams[(index)]) {          \
       caml_release_runtime_system();                            \
-      stream_t * stream = open_stream_index((av), (index));     \
+      stream_t * stream = open_stream_index((av), (index), NULL); \
       caml_acquire_runtime_system();                            \
       if( ! stream) Raise(EXN_FAILURE, "%s", ocaml_av_error_msg);     \
     }                                                           \
@@ -588,19 +1079,82 @@ CAMLprim value ocaml_av_find_best_stream(value _av, value _media_type)
 }
 
 
-CAMLprim value ocaml_av_select_stream(value _stream)
+CAMLprim value ocaml_av_select_stream(value _stream, value _hints)
 {
-  CAMLparam1(_stream);
+  CAMLparam2(_stream, _hints);
   av_t * av = StreamAv_val(_stream);
   int index = StreamIndex_val(_stream);
+  decode_hints_t hints;
+  DecodeHints_val(_hints, &hints);
 
-  Check_stream(av, index);
+  if( ! av->streams || ! av->streams[index]) {
+    caml_release_runtime_system();
+    stream_t * stream = open_stream_index(av, index, &hints);
+    caml_acquire_runtime_system();
+    if( ! stream) Raise(EXN_FAILURE, "%s", ocaml_av_error_msg);
+  }
+  else if(Wosize_val(_hints) > 0) {
+    // The skipping takes effect on the next packets of an opened decoder, unlike lowres
+    AVCodecContext * dec_ctx = av->streams[index]->codec_context;
+
+    if(hints.lowres >= 0 && hints.lowres != dec_ctx->lowres) Raise(EXN_FAILURE, "Failed to set lowres of stream %d : decoder already opened", index);
+
+    set_codec_context_hints(dec_ctx, &hints);
+    av->format_context->streams[index]->discard =
+      hints.skip_frame >= AVDISCARD_NONKEY ? AVDISCARD_NONKEY : AVDISCARD_DEFAULT;
+  }
+
+  // On every selection, have the demuxer skip the streams not opened,
+  // including those it added since the previous selection
+  unsigned int i;
+  for(i = 0; i < av->format_context->nb_streams; i++) {
+    if(i >= av->nb_counted_streams || ! av->streams[i])
+      av->format_context->streams[i]->discard = AVDISCARD_ALL;
+  }
 
   av->selected_streams = 1;
 
   CAMLreturn(Val_unit);
 }
 
+CAMLprim value ocaml_av_set_decoder_threads(value _av, value _thread_count, value _thread_type)
+{
+  CAMLparam2(_av, _thread_type);
+  av_t * av = Av_val(_av);
+
+  av->dec_thread_count = Int_val(_thread_count);
+  av->dec_thread_type = ThreadType_val(_thread_type);
+
+  CAMLreturn(Val_unit);
+}
+
+CAMLprim value ocaml_av_get_stream_thread_count(value _stream)
+{
+  CAMLparam1(_stream);
+  av_t * av = StreamAv_val(_stream);
+  int index = StreamIndex_val(_stream);
+
+  // The decoder is not opened for this, which would undo the discarding of the stream
+  if(av->is_input && ( ! av->streams || ! av->streams[index]))
+    CAMLreturn(Val_int(av->dec_thread_count >= 0 ? av->dec_thread_count : 1));
+
+  if( ! av->streams || ! av->streams[index]->codec_context) Raise(EXN_FAILURE, "Failed to get thread count of stream %d without codec", index);
+
+  CAMLreturn(Val_int(av->streams[index]->codec_context->thread_count));
+}
+
+CAMLprim value ocaml_av_get_stream_nb_read_packets(value _stream) {
+  CAMLparam1(_stream);
+  av_t * av = StreamAv_val(_stream);
+  int index = StreamIndex_val(_stream);
+  intnat nb_read_packets = 0;
+
+  if(av->nb_read_packets && index < av->nb_counted_streams)
+    nb_read_packets = av->nb_read_packets[index];
+
+  CAMLreturn(Val_long(nb_read_packets));
+}
+
 
 static value decode_packet(av_t * av, stream_t * stream, AVPacket * packet, AVFrame * frame)
 {
@@ -672,6 +1226,9 @@ static void read_packet(av_t * av, AVPacket * packet, int stream_index, stream_t
       break;
     }
 
+    if(packet->stream_index < av->nb_counted_streams)
+      av->nb_read_packets[packet->stream_index]++;
+
     if(packet->stream_index == stream_index
        || (stream_index < 0
            && ( ! selected_streams
@@ -690,115 +1247,489 @@ CAMLprim value ocaml_av_read_stream_packet(value _stream) {
 
   Check_stream(av, index);
 
-  if(av->release_out) {
-    if( ! alloc_packet_value(&packet_value)) Raise(EXN_FAILURE, "%s", ocaml_av_error_msg);
-  }
-  else {
-    packet_value = provide_packet_value(&av->streams[index]->packet_value);
+  if(av->release_out) {
+    if( ! alloc_packet_value(&packet_value)) Raise(EXN_FAILURE, "%s", ocaml_av_error_msg);
+  }
+  else {
+    packet_value = provide_packet_value(&av->streams[index]->packet_value);
+  }
+  AVPacket * packet = Packet_val(packet_value);
+
+  caml_release_runtime_system();
+  read_packet(av, packet, index, NULL);
+  caml_acquire_runtime_system();
+
+  if(av->end_of_file) {
+    ans = PVV_End_of_file;
+  }
+  else {
+    account_packet_value(packet_value);
+
+    ans = caml_alloc_tuple(2);
+    Field(ans, 0) = PVV_Packet;
+    Field(ans, 1) = packet_value;
+  }
+  CAMLreturn(ans);
+}
+
+
+CAMLprim value ocaml_av_read_stream_frame(value _stream) {
+  CAMLparam1(_stream);
+  CAMLlocal2(ans, frame_value);
+  av_t * av = StreamAv_val(_stream);
+  int index = StreamIndex_val(_stream);
+
+  Check_stream(av, index);
+
+  stream_t * stream = av->streams[index];
+  AVPacket * packet = Packet_val(provide_packet_value(&stream->packet_value));
+  value frame_kind = 0;
+
+  AVFrame * frame = provide_stream_frame(av, stream, &frame_value);
+  if( ! frame) Raise(EXN_FAILURE, "%s", ocaml_av_error_msg);
+
+  caml_release_runtime_system();
+
+  for(; ! frame_kind;) {
+    if( ! av->end_of_file && packet->size <= 0) {
+      read_packet(av, packet, index, NULL);
+    }
+    frame_kind = decode_packet(av, stream, packet, frame);
+  }
+  caml_acquire_runtime_system();
+
+  if(frame_kind == PVV_Error) Raise(EXN_FAILURE, "%s", ocaml_av_error_msg);
+
+  if(frame_kind == PVV_End_of_file) {
+    ans = PVV_End_of_file;
+  }
+  else {
+    account_stream_frame(stream, frame_value);
+
+    ans = caml_alloc_tuple(2);
+    Field(ans, 0) = PVV_Frame;
+    Field(ans, 1) = frame_value;
+  }
+
+  CAMLreturn(ans);
+}
+
+
+CAMLprim value ocaml_av_read_input_packet(value _av) {
+  CAMLparam1(_av);
+  CAMLlocal3(ans, stream_packet, packet_value);
+  av_t * av = Av_val(_av);
+  stream_t ** selected_streams = av->selected_streams ? av->streams : NULL;
+
+  if(! av->streams && ! allocate_input_context(av)) Raise(EXN_FAILURE, "%s", ocaml_av_error_msg);
+
+  if(av->release_out) {
+    if( ! alloc_packet_value(&packet_value)) Raise(EXN_FAILURE, "%s", ocaml_av_error_msg);
+  }
+  else {
+    packet_value = provide_packet_value(&av->packet_value);
+  }
+  AVPacket * packet = Packet_val(packet_value);
+
+  caml_release_runtime_system();
+  read_packet(av, packet, -1, selected_streams);
+  caml_acquire_runtime_system();
+
+  if(av->end_of_file) {
+    ans = PVV_End_of_file;
+  }
+  else {
+    int index = packet->stream_index;
+
+    Check_stream(av, index);
+
+    account_packet_value(packet_value);
+
+    stream_packet = caml_alloc_tuple(2);
+    Field(stream_packet, 0) = Val_int(index);
+    Field(stream_packet, 1) = packet_value;
+
+    ans = caml_alloc_tuple(2);
+    switch(av->streams[index]->codec_context->codec_type) {
+    case AVMEDIA_TYPE_AUDIO : Field(ans, 0) = PVV_Audio; break;
+    case AVMEDIA_TYPE_VIDEO : Field(ans, 0) = PVV_Video; break;
+    default : Field(ans, 0) = PVV_Subtitle; break;
+    }
+    Field(ans, 1) = stream_packet;
+  }
+  CAMLreturn(ans);
+}
+
+
+// Provide the stream of the next packet to decode, or of a decoder to flush
+static stream_t * read_input_stream(av_t * av, AVPacket * packet, stream_t ** selected_streams, value * frame_kind)
+{
+  stream_t * stream;
+
+  if( ! av->end_of_file && packet->size <= 0) {
+    read_packet(av, packet, -1, selected_streams);
+  }
+
+  if( ! av->end_of_file) {
+    if((stream = av->streams[packet->stream_index]) == NULL) {
+      if(NULL == (stream = open_stream_index(av, packet->stream_index, NULL))) {
+        *frame_kind = PVV_Error;
+      }
+    }
+    return stream;
+  }
+
+  // If the end of file is reached, iteration on the streams to find one to flush
+  unsigned int i;
+  for(i = 0; i < av->format_context->nb_streams; i++) {
+    if((stream = av->streams[i]) && stream->got_frame) return stream;
+  }
+
+  *frame_kind = PVV_End_of_file;
+  return NULL;
+}
+
+CAMLprim value ocaml_av_read_input_frame(value _av)
+{
+  CAMLparam1(_av);
+  CAMLlocal3(ans, stream_frame, frame_value);
+  av_t * av = Av_val(_av);
+
+  if(! av->streams && ! allocate_input_context(av)) Raise(EXN_FAILURE, "%s", ocaml_av_error_msg);
+
+  AVPacket * packet = Packet_val(provide_packet_value(&av->packet_value));
+  stream_t ** selected_streams = av->selected_streams ? av->streams : NULL;
+  stream_t * stream = NULL;
+  value frame_kind = 0;
+  stream_t * frame_stream = NULL;
+  AVFrame * frame = NULL;
+
+  caml_release_runtime_system();
+
+  for(; ! frame_kind;) {
+    stream = read_input_stream(av, packet, selected_streams, &frame_kind);
+    if( ! stream) break;
+
+    // A frame left empty by the previous iteration on the stream is used again
+    if(stream != frame_stream) {
+      caml_acquire_runtime_system();
+
+      frame = provide_stream_frame(av, stream, &frame_value);
+      if( ! frame) Raise(EXN_FAILURE, "%s", ocaml_av_error_msg);
+      frame_stream = stream;
+
+      caml_release_runtime_system();
+    }
+
+    frame_kind = decode_packet(av, stream, packet, frame);
+  }
+
+  caml_acquire_runtime_system();
+  if(frame_kind == PVV_Error) Raise(EXN_FAILURE, "%s", ocaml_av_error_msg);
+
+  if(frame_kind == PVV_End_of_file) {
+    ans = PVV_End_of_file;
+  }
+  else {
+    account_stream_frame(stream, frame_value);
+
+    stream_frame = caml_alloc_tuple(2);
+    Field(stream_frame, 0) = Val_int(stream->index);
+    Field(stream_frame, 1) = frame_value;
+
+    ans = caml_alloc_tuple(2);
+    Field(ans, 0) = frame_kind;
+    Field(ans, 1) = stream_frame;
+  }
+  CAMLreturn(ans);
+}
+
+
+static batch_frame_t * provide_batch(av_t * av, int size)
+{
+  if(size <= av->batch_size) return av->batch;
+
+  batch_frame_t * batch = (batch_frame_t*)realloc(av->batch, size * sizeof(batch_frame_t));
+  if( ! batch) Fail("Failed to allocate %d frames batch", size);
+  av->batch = batch;
+
+  for(; av->batch_size < size; av->batch_size++) {
+    batch_frame_t * entry = &batch[av->batch_size];
+    memset(entry, 0, sizeof(batch_frame_t));
+
+    entry->frame = av_frame_alloc();
+    if( ! entry->frame) Fail("Failed to allocate frame");
+  }
+  return batch;
+}
+
+// Move a decoded frame of a batch into a new frame value
+static int value_of_batch_frame(av_t * av, batch_frame_t * entry, value * frame_value)
+{
+  if(entry->stream->codec_context->codec_type == AVMEDIA_TYPE_SUBTITLE) {
+    AVSubtitle * subtitle = alloc_subtitle_value(frame_value);
+    if( ! subtitle) return 0;
+
+    *subtitle = entry->subtitle;
+    memset(&entry->subtitle, 0, sizeof(AVSubtitle));
+    account_subtitle_value(*frame_value);
+  }
+  else {
+    AVFrame * frame = av->frame_pool ? alloc_pooled_frame_value(av->frame_pool, frame_value) : alloc_frame_value(frame_value);
+    if( ! frame) return 0;
+
+    av_frame_move_ref(frame, entry->frame);
+    account_frame_value(*frame_value);
+  }
+  return 1;
+}
+
+CAMLprim value ocaml_av_read_input_frames(value _av, value _max)
+{
+  CAMLparam2(_av, _max);
+  CAMLlocal4(ans, result, stream_frame, frame_value);
+  av_t * av = Av_val(_av);
+  int max = Int_val(_max);
+
+  if(max <= 0) Raise(EXN_FAILURE, "Failed to read %d frames", max);
+
+  if(! av->streams && ! allocate_input_context(av)) Raise(EXN_FAILURE, "%s", ocaml_av_error_msg);
+
+  batch_frame_t * batch = provide_batch(av, max);
+  if( ! batch) Raise(EXN_FAILURE, "%s", ocaml_av_error_msg);
+
+  AVPacket * packet = Packet_val(provide_packet_value(&av->packet_value));
+  stream_t ** selected_streams = av->selected_streams ? av->streams : NULL;
+  value frame_kind = 0;
+  int nb_frames = 0, i;
+
+  // All the frames are decoded without the runtime lock, then given to OCaml
+  caml_release_runtime_system();
+
+  while(nb_frames < max) {
+    stream_t * stream = read_input_stream(av, packet, selected_streams, &frame_kind);
+    if( ! stream) break;
+
+    batch_frame_t * entry = &batch[nb_frames];
+    AVFrame * frame = entry->frame;
+
+    if(stream->codec_context->codec_type == AVMEDIA_TYPE_SUBTITLE)
+      frame = (AVFrame *)&entry->subtitle;
+
+    frame_kind = decode_packet(av, stream, packet, frame);
+
+    if(frame_kind == PVV_Error) break;
+
+    // A flushed decoder ends its stream only, the others are still flushed
+    if(frame_kind && frame_kind != PVV_End_of_file) {
+      entry->stream = stream;
+      entry->frame_kind = frame_kind;
+      nb_frames++;
+    }
+    frame_kind = 0;
+  }
+
+  caml_acquire_runtime_system();
+
+  if(frame_kind == PVV_Error) {
+    clear_batch(av);
+    Raise(EXN_FAILURE, "%s", ocaml_av_error_msg);
+  }
+
+  ans = caml_alloc_tuple(nb_frames + (frame_kind == PVV_End_of_file));
+
+  for(i = 0; i < nb_frames; i++) {
+    batch_frame_t * entry = &batch[i];
+
+    if( ! value_of_batch_frame(av, entry, &frame_value)) {
+      clear_batch(av);
+      Raise(EXN_FAILURE, "%s", ocaml_av_error_msg);
+    }
+
+    stream_frame = caml_alloc_tuple(2);
+    Field(stream_frame, 0) = Val_int(entry->stream->index);
+    Field(stream_frame, 1) = frame_value;
+
+    result = caml_alloc_tuple(2);
+    Field(result, 0) = entry->frame_kind;
+    Field(result, 1) = stream_frame;
+
+    Store_field(ans, i, result);
+  }
+
+  if(frame_kind == PVV_End_of_file) Store_field(ans, nb_frames, PVV_End_of_file);
+
+  CAMLreturn(ans);
+}
+
+
+/***** Parallel decoding *****/
+
+// Wake the reading thread up if it waits for the decoding threads
+static void signal_decoded_frame(av_t * av)
+{
+  pthread_mutex_lock(&av->frame_lock);
+  av->frame_generation++;
+  pthread_cond_signal(&av->frame_cond);
+  pthread_mutex_unlock(&av->frame_lock);
+}
+
+// Send a packet (or NULL to flush) to the decoder, and all the frames it outputs to the frame queue
+static int decode_thread_packet(stream_t * stream, AVPacket * packet)
+{
+  AVCodecContext * dec = stream->codec_context;
+  AVFrame * frame;
+  int ret, sent;
+
+  do {
+    ret = avcodec_send_packet(dec, packet);
+
+    // On EAGAIN, the decoder is drained before sending the packet again
+    sent = ret != AVERROR(EAGAIN);
+    if(ret < 0 && sent && ret != AVERROR_EOF) return ret;
+
+    for(;;) {
+      frame = av_frame_alloc();
+      if( ! frame) return AVERROR(ENOMEM);
+
+      ret = avcodec_receive_frame(dec, frame);
+
+      if(ret < 0) {
+        av_frame_free(&frame);
+        if(ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) break;
+        return ret;
+      }
+
+      ret = av_thread_message_queue_send(stream->frame_queue, &frame, 0);
+
+      if(ret < 0) {
+        av_frame_free(&frame);
+        return ret;
+      }
+      signal_decoded_frame(stream->av);
+    }
+  } while( ! sent);
+
+  return 0;
+}
+
+// Decode the packets of a stream until its packet queue ends, then flush the decoder at the end of the input
+static void * decode_thread(void * arg)
+{
+  stream_t * stream = (stream_t*)arg;
+  AVPacket packet;
+  int ret;
+
+  while((ret = av_thread_message_queue_recv(stream->packet_queue, &packet, 0)) >= 0) {
+    ret = decode_thread_packet(stream, &packet);
+    av_packet_unref(&packet);
+
+    atomic_fetch_sub(&stream->nb_pending, 1);
+    signal_decoded_frame(stream->av);
+
+    if(ret < 0) break;
   }
-  AVPacket * packet = Packet_val(packet_value);
 
-  caml_release_runtime_system();
-  read_packet(av, packet, index, NULL);
-  caml_acquire_runtime_system();
+  // A thread stopped with AVERROR_EXIT leaves the decoder as is
+  if(ret == AVERROR_EOF) ret = decode_thread_packet(stream, NULL);
 
-  if(av->end_of_file) {
-    ans = PVV_End_of_file;
-  }
-  else {
-    ans = caml_alloc_tuple(2);
-    Field(ans, 0) = PVV_Packet;
-    Field(ans, 1) = packet_value;
-  }
-  CAMLreturn(ans);
+  av_thread_message_queue_set_err_recv(stream->frame_queue, ret < 0 ? ret : AVERROR_EOF);
+  signal_decoded_frame(stream->av);
+
+  return NULL;
 }
 
+static stream_t * start_decode_thread(av_t * av, stream_t * stream)
+{
+  int ret;
 
-CAMLprim value ocaml_av_read_stream_frame(value _stream) {
-  CAMLparam1(_stream);
-  CAMLlocal2(ans, frame_value);
-  av_t * av = StreamAv_val(_stream);
-  int index = StreamIndex_val(_stream);
+  stream->av = av;
 
-  Check_stream(av, index);
+  if((ret = av_thread_message_queue_alloc(&stream->packet_queue, DECODE_QUEUE_SIZE, sizeof(AVPacket))) < 0
+     || (ret = av_thread_message_queue_alloc(&stream->frame_queue, DECODE_QUEUE_SIZE, sizeof(AVFrame*))) < 0)
+    Fail("Failed to allocate stream %d decoding queues : %s", stream->index, av_err2str(ret));
 
-  stream_t * stream = av->streams[index];
-  AVPacket * packet = Packet_val(provide_packet_value(&stream->packet_value));
-  value frame_kind = 0;
+  stream->frames = av_fifo_alloc(MAX_DECODED_FRAMES * sizeof(AVFrame*));
+  if( ! stream->frames) Fail("Failed to allocate stream %d frames", stream->index);
 
-  AVFrame * frame = provide_stream_frame(av, stream, &frame_value);
-  if( ! frame) Raise(EXN_FAILURE, "%s", ocaml_av_error_msg);
+  if((ret = pthread_create(&stream->thread, NULL, decode_thread, stream)) != 0)
+    Fail("Failed to create stream %d decoding thread : %s", stream->index, strerror(ret));
 
-  caml_release_runtime_system();
+  stream->threaded = 1;
+  return stream;
+}
 
-  for(; ! frame_kind;) {
-    if( ! av->end_of_file && packet->size <= 0) {
-      read_packet(av, packet, index, NULL);
-    }
-    frame_kind = decode_packet(av, stream, packet, frame);
-  }
-  caml_acquire_runtime_system();
+// Move the frames decoded by the thread of a stream after its previous ones, the others staying in the frame queue
+static int receive_decoded_frames(stream_t * stream)
+{
+  AVFrame * frame;
+  int ret;
 
-  if(frame_kind == PVV_Error) Raise(EXN_FAILURE, "%s", ocaml_av_error_msg);
+  while(av_fifo_space(stream->frames) >= (int)sizeof(AVFrame*)) {
+    ret = av_thread_message_queue_recv(stream->frame_queue, &frame, AV_THREAD_MESSAGE_NONBLOCK);
 
-  if(frame_kind == PVV_End_of_file) {
-    ans = PVV_End_of_file;
-  }
-  else {
-    ans = caml_alloc_tuple(2);
-    Field(ans, 0) = PVV_Frame;
-    Field(ans, 1) = frame_value;
+    if(ret == AVERROR_EOF) stream->decoded_eof = 1;
+    if(ret == AVERROR_EOF || ret == AVERROR(EAGAIN)) break;
+    if(ret < 0) return ret;
+
+    av_fifo_generic_write(stream->frames, &frame, sizeof(AVFrame*), NULL);
   }
 
-  CAMLreturn(ans);
+  return 0;
 }
 
+static int64_t decoded_frame_ts(AVFrame * frame)
+{
+  return frame->best_effort_timestamp != AV_NOPTS_VALUE ? frame->best_effort_timestamp : frame->pts;
+}
 
-CAMLprim value ocaml_av_read_input_packet(value _av) {
-  CAMLparam1(_av);
-  CAMLlocal3(ans, stream_packet, packet_value);
-  av_t * av = Av_val(_av);
-  stream_t ** selected_streams = av->selected_streams ? av->streams : NULL;
+// Tell if the frame of the stream s comes before the frame of the stream t, frames without timestamp coming first
+static int frame_precedes(av_t * av, AVFrame * frame, stream_t * s, AVFrame * other, stream_t * t)
+{
+  int64_t ts = decoded_frame_ts(frame), other_ts = decoded_frame_ts(other);
 
-  if(! av->streams && ! allocate_input_context(av)) Raise(EXN_FAILURE, "%s", ocaml_av_error_msg);
+  if(ts == AV_NOPTS_VALUE) return 1;
+  if(other_ts == AV_NOPTS_VALUE) return 0;
 
-  if(av->release_out) {
-    if( ! alloc_packet_value(&packet_value)) Raise(EXN_FAILURE, "%s", ocaml_av_error_msg);
-  }
-  else {
-    packet_value = provide_packet_value(&av->packet_value);
-  }
-  AVPacket * packet = Packet_val(packet_value);
+  return av_compare_ts(ts, av->format_context->streams[s->index]->time_base,
+                       other_ts, av->format_context->streams[t->index]->time_base) < 0;
+}
 
-  caml_release_runtime_system();
-  read_packet(av, packet, -1, selected_streams);
-  caml_acquire_runtime_system();
+// Tell if the decoded subtitle of the input comes before the frame of the stream t, subtitles without timestamp coming first
+static int subtitle_precedes(av_t * av, AVFrame * other, stream_t * t)
+{
+  int64_t other_ts = decoded_frame_ts(other);
 
-  if(av->end_of_file) {
-    ans = PVV_End_of_file;
-  }
-  else {
-    int index = packet->stream_index;
+  if(av->subtitle.pts == AV_NOPTS_VALUE) return 1;
+  if(other_ts == AV_NOPTS_VALUE) return 0;
 
-    Check_stream(av, index);
+  return av_compare_ts(av->subtitle.pts, AV_TIME_BASE_Q,
+                       other_ts, av->format_context->streams[t->index]->time_base) < 0;
+}
 
-    stream_packet = caml_alloc_tuple(2);
-    Field(stream_packet, 0) = Val_int(index);
-    Field(stream_packet, 1) = packet_value;
+// Stop the decoding threads, which are started again by the next reading
+static void stop_decode_threads(av_t * av)
+{
+  unsigned int i;
 
-    ans = caml_alloc_tuple(2);
-    switch(av->streams[index]->codec_context->codec_type) {
-    case AVMEDIA_TYPE_AUDIO : Field(ans, 0) = PVV_Audio; break;
-    case AVMEDIA_TYPE_VIDEO : Field(ans, 0) = PVV_Video; break;
-    default : Field(ans, 0) = PVV_Subtitle; break;
+  if(av->streams) {
+    for(i = 0; i < av->format_context->nb_streams; i++) {
+      if(av->streams[i]) free_decode_thread(av->streams[i]);
     }
-    Field(ans, 1) = stream_packet;
   }
-  CAMLreturn(ans);
-}
 
+  if(av->packet_pending) {
+    av_packet_unref(Packet_val(av->packet_value));
+    av->packet_pending = 0;
+  }
+
+  if(av->subtitle_stream) {
+    avsubtitle_free(&av->subtitle);
+    av->subtitle_stream = NULL;
+  }
+}
 
-CAMLprim value ocaml_av_read_input_frame(value _av)
+CAMLprim value ocaml_av_read_parallel_input_frame(value _av)
 {
   CAMLparam1(_av);
   CAMLlocal3(ans, stream_frame, frame_value);
@@ -806,51 +1737,158 @@ CAMLprim value ocaml_av_read_input_frame(value _av)
 
   if(! av->streams && ! allocate_input_context(av)) Raise(EXN_FAILURE, "%s", ocaml_av_error_msg);
 
+  if( ! av->parallel) {
+    pthread_mutex_init(&av->frame_lock, NULL);
+    pthread_cond_init(&av->frame_cond, NULL);
+    av->parallel = 1;
+  }
+
   AVPacket * packet = Packet_val(provide_packet_value(&av->packet_value));
-  stream_t ** streams = av->streams;
   stream_t ** selected_streams = av->selected_streams ? av->streams : NULL;
   unsigned int nb_streams = av->format_context->nb_streams;
   stream_t * stream = NULL;
+  AVFrame * frame = NULL;
   value frame_kind = 0;
+  unsigned int i, generation;
+  int ret = 0, subtitle_blocked = 0;
 
   caml_release_runtime_system();
 
   for(; ! frame_kind;) {
-    if( ! av->end_of_file) {
+    pthread_mutex_lock(&av->frame_lock);
+    generation = av->frame_generation;
+    pthread_mutex_unlock(&av->frame_lock);
+    ret = 0;
+
+    // Find the earliest decoded frame, unless a thread still decoding could provide an earlier one
+    stream_t * earliest = NULL;
+    AVFrame * earliest_frame = NULL;
+    int nb_starving = 0, nb_busy = 0, nb_full = 0;
+
+    for(i = 0; i < nb_streams; i++) {
+      stream_t * s = av->streams[i];
+      if( ! s || ! s->codec_context || s->codec_context->codec_type == AVMEDIA_TYPE_SUBTITLE) continue;
+
+      // A stream selected or opened without a thread yet waits for its first packet
+      if( ! s->threaded) {
+        if( ! av->end_of_file) nb_starving++;
+        continue;
+      }
+
+      if((ret = receive_decoded_frames(s)) < 0) break;
+
+      if(av_fifo_size(s->frames) > 0) {
+        AVFrame * head;
+        av_fifo_generic_peek(s->frames, &head, sizeof(AVFrame*), NULL);
+
+        if(av_fifo_space(s->frames) < (int)sizeof(AVFrame*)) nb_full++;
+
+        if( ! earliest || frame_precedes(av, head, s, earliest_frame, earliest)) {
+          earliest = s;
+          earliest_frame = head;
+        }
+      }
+      else if( ! s->decoded_eof) {
+        nb_starving++;
+        if(av->end_of_file || atomic_load(&s->nb_pending) > 0) nb_busy++;
+      }
+    }
+
+    if(ret < 0) {
+      Log("Failed to decode stream %d frame : %s", i, av_err2str(ret));
+      frame_kind = PVV_Error;
+      break;
+    }
+
+    // A stream holding MAX_DECODED_FRAMES frames does not wait for the starving ones anymore, nor does a
+    // decoded subtitle followed by another one
+    if(nb_starving == 0 || nb_full > 0 || subtitle_blocked) {
+      if(av->subtitle_stream && ( ! earliest || subtitle_precedes(av, earliest_frame, earliest))) {
+        stream = av->subtitle_stream;
+        frame_kind = PVV_Subtitle;
+        break;
+      }
+      if(earliest) {
+        av_fifo_generic_read(earliest->frames, &frame, sizeof(AVFrame*), NULL);
+        stream = earliest;
+        frame_kind = stream->codec_context->codec_type == AVMEDIA_TYPE_AUDIO ? PVV_Audio : PVV_Video;
+        break;
+      }
+      if(av->end_of_file) {
+        frame_kind = PVV_End_of_file;
+        break;
+      }
+    }
 
-      if(packet->size <= 0) {
+    // The demuxer is only read for a stream whose thread has nothing left to decode
+    if(nb_starving == 0 || nb_busy < nb_starving) {
+
+      if( ! av->packet_pending) {
         read_packet(av, packet, -1, selected_streams);
-        if(av->end_of_file) continue;
+
+        if(av->end_of_file) {
+          for(i = 0; i < nb_streams; i++) {
+            if(av->streams[i] && av->streams[i]->threaded)
+              av_thread_message_queue_set_err_recv(av->streams[i]->packet_queue, AVERROR_EOF);
+          }
+          continue;
+        }
+        av->packet_pending = 1;
       }
 
-      if((stream = streams[packet->stream_index]) == NULL) {
-        if(NULL == (stream = open_stream_index(av, packet->stream_index))) {
+      if((stream = av->streams[packet->stream_index]) == NULL) {
+        if(NULL == (stream = open_stream_index(av, packet->stream_index, NULL))) {
           frame_kind = PVV_Error;
           break;
         }
       }
-    }
-    else {
-      // If the end of file is reached, iteration on the streams to find one to flush
-      unsigned int i = 0;
-      for(; i < nb_streams; i++) {
-        if((stream = streams[i]) && stream->got_frame) break;
+
+      // Subtitles are decoded on this thread, one at a time, and wait for the earlier frames of the threads
+      if(stream->codec_context->codec_type == AVMEDIA_TYPE_SUBTITLE) {
+        if(av->subtitle_stream) {
+          subtitle_blocked = 1;
+          continue;
+        }
+
+        av->packet_pending = 0;
+        frame_kind = decode_packet(av, stream, packet, (AVFrame *)&av->subtitle);
+        if(frame_kind == PVV_Error) break;
+
+        if(frame_kind == PVV_Subtitle) av->subtitle_stream = stream;
+        frame_kind = 0;
+        continue;
       }
 
-      if(i == nb_streams) {
-        frame_kind = PVV_End_of_file;
+      if( ! stream->threaded && ! start_decode_thread(av, stream)) {
+        frame_kind = PVV_Error;
         break;
       }
-    }
 
-    caml_acquire_runtime_system();
+      // The packet is moved to the queue of the thread
+      atomic_fetch_add(&stream->nb_pending, 1);
+      ret = av_thread_message_queue_send(stream->packet_queue, packet, AV_THREAD_MESSAGE_NONBLOCK);
 
-    AVFrame * frame = allocate_type_frame(stream->codec_context->codec_type, &frame_value);
-    if( ! frame) Raise(EXN_FAILURE, "%s", ocaml_av_error_msg);
+      if(ret >= 0) {
+        av_init_packet(packet);
+        packet->data = NULL;
+        packet->size = 0;
+        av->packet_pending = 0;
+        continue;
+      }
+      atomic_fetch_sub(&stream->nb_pending, 1);
 
-    caml_release_runtime_system();
+      if(ret != AVERROR(EAGAIN)) {
+        Log("Failed to send stream %d packet : %s", stream->index, av_err2str(ret));
+        frame_kind = PVV_Error;
+        break;
+      }
+      // The queue of the thread is full, the packet stays pending
+    }
 
-    frame_kind = decode_packet(av, stream, packet, frame);
+    pthread_mutex_lock(&av->frame_lock);
+    while(generation == av->frame_generation)
+      pthread_cond_wait(&av->frame_cond, &av->frame_lock);
+    pthread_mutex_unlock(&av->frame_lock);
   }
 
   caml_acquire_runtime_system();
@@ -860,6 +1898,28 @@ CAMLprim value ocaml_av_read_input_frame(value _av)
     ans = PVV_End_of_file;
   }
   else {
+    // A subtitle or a frame decoded by a thread is moved into a frame value
+    if(frame_kind == PVV_Subtitle) {
+      AVSubtitle * subtitle = alloc_subtitle_value(&frame_value);
+      if( ! subtitle) Raise(EXN_FAILURE, "%s", ocaml_av_error_msg);
+
+      *subtitle = av->subtitle;
+      memset(&av->subtitle, 0, sizeof(AVSubtitle));
+      av->subtitle_stream = NULL;
+    }
+    else {
+      AVFrame * frame_data = av->frame_pool ? alloc_pooled_frame_value(av->frame_pool, &frame_value) : alloc_frame_value(&frame_value);
+
+      if( ! frame_data) {
+        av_frame_free(&frame);
+        Raise(EXN_FAILURE, "%s", ocaml_av_error_msg);
+      }
+      av_frame_move_ref(frame_data, frame);
+      av_frame_free(&frame);
+    }
+
+    account_stream_frame(stream, frame_value);
+
     stream_frame = caml_alloc_tuple(2);
     Field(stream_frame, 0) = Val_int(stream->index);
     Field(stream_frame, 1) = frame_value;
@@ -905,6 +1965,9 @@ CAMLprim value ocaml_av_seek_frame(value _stream, value _time_format, value _tim
   for(i = 0; i < Wosize_val(_flags); i++)
     flags |= seek_flags_val(Field(_flags, i));
 
+  // The frames and packets queued for the decoding threads precede the new position
+  if(av->parallel) stop_decode_threads(av);
+
   caml_release_runtime_system();
 
   int ret = av_seek_frame(av->format_context, index, timestamp, flags);
@@ -970,8 +2033,148 @@ CAMLprim value ocaml_av_output_format_get_subtitle_codec_id(value _output_format
   CAMLreturn(Val_SubtitleCodecID(OutputFormat_val(_output_format)->subtitle_codec));
 }
 
+CAMLprim value ocaml_av_output_format_find(value _name)
+{
+  CAMLparam1(_name);
+  CAMLlocal2(ans, _format);
+  AVOutputFormat * format = (AVOutputFormat*)av_guess_format(String_val(_name), NULL, NULL);
+
+  if( ! format) CAMLreturn(Val_int(0));
+
+  value_of_outputFormat(format, &_format);
+
+  ans = caml_alloc(1, 0);
+  Store_field(ans, 0, _format);
+
+  CAMLreturn(ans);
+}
+
+
+/***** Custom output *****/
+
+// The callbacks are called by the muxer, with the runtime lock released, possibly from a muxing thread
+static int write_callback(void *opaque, uint8_t *buf, int size)
+{
+  output_io_t * io = (output_io_t*)opaque;
+  int done = 0, ret = size;
+  value res;
+
+  ocaml_ffmpeg_register_thread();
+  caml_acquire_runtime_system();
+
+  while(done < size && ret >= 0) {
+    int64_t len = size - done;
+
+    if(io->bytes) {
+      // copy the data in the ring, and tell where it is
+      int64_t ofs = io->pos % io->size;
+      if(len > io->size - ofs) len = io->size - ofs;
+
+      memcpy(io->bytes + ofs, buf + done, len);
+      res = caml_callback2_exn(io->write, Val_long(ofs), Val_long(len));
+    }
+    else {
+      if(len > caml_string_length(io->buffer)) len = caml_string_length(io->buffer);
+
+      memcpy((uint8_t*)String_val(io->buffer), buf + done, len);
+      res = caml_callback3_exn(io->write, io->buffer, Val_int(0), Val_long(len));
+    }
+
+    if(Is_exception_result(res)) ret = AVERROR_EXTERNAL;
+
+    io->pos += len;
+    done += len;
+  }
+
+  caml_release_runtime_system();
+
+  return ret;
+}
+
+static int64_t output_seek_callback(void *opaque, int64_t offset, int whence)
+{
+  output_io_t * io = (output_io_t*)opaque;
+  int64_t pos = call_seek(&io->seek, offset, whence);
+
+  if(pos >= 0) io->pos = pos;
+  return pos;
+}
+
+output_io_t * ocaml_av_alloc_output_io(value _sink, value _seek, int buffer_size)
+{
+  if(buffer_size <= 0) Fail("Invalid output I/O buffer size");
+
+  output_io_t * io = (output_io_t*)calloc(1, sizeof(output_io_t));
+  if( ! io) Fail("Failed to allocate output I/O");
+
+  unsigned char * buffer = (unsigned char*)av_malloc(buffer_size);
+
+  if( ! buffer) {
+    free(io);
+    Fail("Failed to allocate output I/O buffer");
+  }
+
+  io->avio = avio_alloc_context(buffer, buffer_size, 1, io, NULL, write_callback,
+                                Is_block(_seek) ? output_seek_callback : NULL);
+
+  if( ! io->avio) {
+    av_free(buffer);
+    free(io);
+    Fail("Failed to allocate output I/O context");
+  }
+
+  // The callbacks are registered as roots before the buffer allocation, which may move them
+  if(Is_block(_seek)) {
+    io->seek = Field(_seek, 0);
+    caml_register_generational_global_root(&io->seek);
+  }
+
+  if(Tag_val(_sink) == 0) {
+    // Write of (bytes -> int -> int -> unit)
+    io->write = Field(_sink, 0);
+    caml_register_generational_global_root(&io->write);
+    io->buffer = caml_alloc_string(buffer_size);
+    caml_register_generational_global_root(&io->buffer);
+  }
+  else {
+    // Ring of data * (int -> int -> unit)
+    io->ring = Field(_sink, 0);
+    caml_register_generational_global_root(&io->ring);
+    io->bytes = (uint8_t*)Caml_ba_data_val(io->ring);
+    io->size = Caml_ba_array_val(io->ring)->dim[0];
+    io->write = Field(_sink, 1);
+    caml_register_generational_global_root(&io->write);
+
+    if(io->size == 0) {
+      ocaml_av_free_output_io(io);
+      Fail("Empty output ring");
+    }
+  }
+
+  return io;
+}
+
+AVIOContext * ocaml_av_output_io_context(output_io_t * io)
+{
+  return io->avio;
+}
+
+void ocaml_av_free_output_io(output_io_t * io)
+{
+  if(io->avio) {
+    av_freep(&io->avio->buffer);
+    avio_context_free(&io->avio);
+  }
+
+  if(io->ring) caml_remove_generational_global_root(&io->ring);
+  if(io->write) caml_remove_generational_global_root(&io->write);
+  if(io->seek) caml_remove_generational_global_root(&io->seek);
+  if(io->buffer) caml_remove_generational_global_root(&io->buffer);
+
+  free(io);
+}
 
-static av_t * open_output(AVOutputFormat *format, const char *format_name, const char *file_name)
+static av_t * open_output(AVOutputFormat *format, const char *format_name, const char *file_name, output_io_t *io)
 {
   av_t *av = (av_t*)calloc(1, sizeof(av_t));
   if ( ! av) Fail("Failed to allocate output context");
@@ -983,8 +2186,17 @@ static av_t * open_output(AVOutputFormat *format, const char *format_name, const
     Fail("Failed to allocate format context");
   }
 
+  if(io) {
+    if(av->format_context->oformat->flags & AVFMT_NOFILE) {
+      free_av(av);
+      Fail("Output format %s does not write to a file", av->format_context->oformat->name);
+    }
+
+    av->format_context->pb = io->avio;
+    av->format_context->flags |= AVFMT_FLAG_CUSTOM_IO;
+  }
   // open the output file, if needed
-  if( ! (av->format_context->oformat->flags & AVFMT_NOFILE)) {
+  else if( ! (av->format_context->oformat->flags & AVFMT_NOFILE)) {
     int ret = avio_open(&av->format_context->pb, file_name, AVIO_FLAG_WRITE);
     if (ret < 0) {
       free_av(av);
@@ -1002,7 +2214,7 @@ CAMLprim value ocaml_av_open_output(value _filename)
 
   // open output file
   caml_release_runtime_system();
-  av_t *av = open_output(NULL, NULL, filename);
+  av_t *av = open_output(NULL, NULL, filename, NULL);
 
   free(filename);
   caml_acquire_runtime_system();
@@ -1023,7 +2235,7 @@ CAMLprim value ocaml_av_open_output_format(value _format)
 
   // open output format
   caml_release_runtime_system();
-  av_t *av = open_output(format, NULL, NULL);
+  av_t *av = open_output(format, NULL, NULL, NULL);
   caml_acquire_runtime_system();
   if( ! av) Raise(EXN_FAILURE, "%s", ocaml_av_error_msg);
 
@@ -1042,7 +2254,7 @@ CAMLprim value ocaml_av_open_output_format_name(value _format_name)
 
   // open output file
   caml_release_runtime_system();
-  av_t *av = open_output(NULL, format_name, NULL);
+  av_t *av = open_output(NULL, format_name, NULL, NULL);
 
   free(format_name);
   caml_acquire_runtime_system();
@@ -1055,6 +2267,31 @@ CAMLprim value ocaml_av_open_output_format_name(value _format_name)
   CAMLreturn(ans);
 }
 
+CAMLprim value ocaml_av_open_output_stream(value _format, value _sink, value _seek, value _buffer_size)
+{
+  CAMLparam3(_format, _sink, _seek);
+  CAMLlocal1(ans);
+  AVOutputFormat *format = OutputFormat_val(_format);
+
+  output_io_t * io = ocaml_av_alloc_output_io(_sink, _seek, Int_val(_buffer_size));
+  if( ! io) Raise(EXN_FAILURE, "%s", ocaml_av_error_msg);
+
+  caml_release_runtime_system();
+  av_t *av = open_output(format, NULL, NULL, io);
+  caml_acquire_runtime_system();
+
+  if( ! av) {
+    ocaml_av_free_output_io(io);
+    Raise(EXN_FAILURE, "%s", ocaml_av_error_msg);
+  }
+  av->out_io = io;
+
+  ans = caml_alloc_custom(&av_ops, sizeof(av_t*), 0, 1);
+  Av_val(ans) = av;
+
+  CAMLreturn(ans);
+}
+
 CAMLprim value ocaml_av_set_metadata(value _av, value _stream_index, value _tags) {
   CAMLparam2(_av, _tags);
   CAMLlocal1(pair);
@@ -1088,7 +2325,7 @@ CAMLprim value ocaml_av_set_metadata(value _av, value _stream_index, value _tags
   CAMLreturn(Val_unit);
 }
 
-static stream_t * new_stream(av_t *av, enum AVCodecID codec_id)
+static stream_t * new_stream(av_t *av, enum AVCodecID codec_id, int thread_count, int thread_type)
 {
   if( ! av->format_context) Fail("Failed to add stream to closed output");
   if(av->header_written) Fail("Failed to create new stream : header already written");
@@ -1112,6 +2349,8 @@ static stream_t * new_stream(av_t *av, enum AVCodecID codec_id)
 
   avstream->id = av->format_context->nb_streams - 1;
 
+  set_codec_context_threads(stream->codec_context, thread_count, thread_type);
+
   return stream;
 }
 
@@ -1135,9 +2374,9 @@ static stream_t * init_stream_encoder(av_t *av, stream_t *stream)
   return stream;
 }
 
-static stream_t * new_audio_stream(av_t *av, enum AVCodecID codec_id, uint64_t channel_layout, enum AVSampleFormat sample_fmt, int bit_rate, int sample_rate, AVRational time_base)
+static stream_t * new_audio_stream(av_t *av, enum AVCodecID codec_id, uint64_t channel_layout, enum AVSampleFormat sample_fmt, int bit_rate, int sample_rate, AVRational time_base, int thread_count, int thread_type)
 {
-  stream_t * stream = new_stream(av, codec_id);
+  stream_t * stream = new_stream(av, codec_id, thread_count, thread_type);
   if( ! stream) return NULL;
 
   AVCodecContext * enc_ctx = stream->codec_context;
@@ -1168,16 +2407,19 @@ static stream_t * new_audio_stream(av_t *av, enum AVCodecID codec_id, uint64_t c
     if (ret < 0) Fail("Failed to allocate encoder frame samples : %s)", av_err2str(ret));
 
     // Create the FIFO buffer based on the specified output sample format.
-    stream->audio_fifo = av_audio_fifo_alloc(enc_ctx->sample_fmt, enc_ctx->channels, 1);
+    stream->audio_fifo = av_audio_fifo_alloc(enc_ctx->sample_fmt, enc_ctx->channels,
+                                             enc_ctx->frame_size + AUDIO_FIFO_MAX_INPUT);
     if( ! stream->audio_fifo) Fail("Failed to allocate audio FIFO");
   }
 
   return stream;
 }
 
-CAMLprim value ocaml_av_new_audio_stream(value _av, value _audio_codec_id, value _channel_layout, value _sample_fmt, value _bit_rate, value _sample_rate, value _time_base)
+CAMLprim value ocaml_av_new_audio_stream(value _av, value _audio_codec_id, value _channel_layout, value _sample_fmt, value _bit_rate, value _sample_rate, value _time_base, value _thread_count, value _thread_type)
 {
   CAMLparam5(_av, _audio_codec_id, _channel_layout, _sample_fmt, _time_base);
+  CAMLxparam1(_thread_type);
+  int thread_type = ThreadType_val(_thread_type);
 
   caml_release_runtime_system();
   stream_t * stream = new_audio_stream(Av_val(_av),
@@ -1186,7 +2428,9 @@ CAMLprim value ocaml_av_new_audio_stream(value _av, value _audio_codec_id, value
                                        SampleFormat_val(_sample_fmt),
                                        Int_val(_bit_rate),
                                        Int_val(_sample_rate),
-                                       rational_of_value(_time_base));
+                                       rational_of_value(_time_base),
+                                       Int_val(_thread_count),
+                                       thread_type);
   caml_acquire_runtime_system();
 
   if( ! stream) Raise(EXN_FAILURE, "%s", ocaml_av_error_msg);
@@ -1196,15 +2440,17 @@ CAMLprim value ocaml_av_new_audio_stream(value _av, value _audio_codec_id, value
 
 CAMLprim value ocaml_av_new_audio_stream_byte(value *argv, int argn)
 {
-  return ocaml_av_new_audio_stream(argv[0], argv[1], argv[2], argv[3], argv[4], argv[5], argv[6]);
+  return ocaml_av_new_audio_stream(argv[0], argv[1], argv[2], argv[3], argv[4], argv[5], argv[6], argv[7], argv[8]);
 }
 
 
-static stream_t * new_video_stream(av_t *av, enum AVCodecID codec_id, int width, int height, enum AVPixelFormat pix_fmt, int bit_rate, int frame_rate, AVRational time_base)
+static stream_t * new_video_stream(av_t *av, enum AVCodecID codec_id, int width, int height, enum AVPixelFormat pix_fmt, int bit_rate, int frame_rate, AVRational time_base, int sws_flags, int thread_count, int thread_type)
 {
-  stream_t * stream = new_stream(av, codec_id);
+  stream_t * stream = new_stream(av, codec_id, thread_count, thread_type);
   if( ! stream) return NULL;
 
+  stream->sws_flags = sws_flags;
+
   AVCodecContext * enc_ctx = stream->codec_context;
 
   enc_ctx->bit_rate = bit_rate;
@@ -1218,9 +2464,12 @@ static stream_t * new_video_stream(av_t *av, enum AVCodecID codec_id, int width,
   return stream;
 }
 
-CAMLprim value ocaml_av_new_video_stream(value _av, value _video_codec_id, value _width, value _height, value _pix_fmt, value _bit_rate, value _frame_rate, value _time_base)
+CAMLprim value ocaml_av_new_video_stream(value _av, value _video_codec_id, value _width, value _height, value _pix_fmt, value _bit_rate, value _frame_rate, value _time_base, value _scaler_flags, value _thread_count, value _thread_type)
 {
-  CAMLparam4(_av, _video_codec_id, _pix_fmt, _time_base);
+  CAMLparam5(_av, _video_codec_id, _pix_fmt, _time_base, _scaler_flags);
+  CAMLxparam1(_thread_type);
+  int sws_flags = SwsFlags_val(_scaler_flags);
+  int thread_type = ThreadType_val(_thread_type);
 
   caml_release_runtime_system();
   stream_t * stream = new_video_stream(
@@ -1231,7 +2480,10 @@ CAMLprim value ocaml_av_new_video_stream(value _av, value _video_codec_id, value
                                        PixelFormat_val(_pix_fmt),
                                        Int_val(_bit_rate),
                                        Int_val(_frame_rate),
-                                       rational_of_value(_time_base));
+                                       rational_of_value(_time_base),
+                                       sws_flags,
+                                       Int_val(_thread_count),
+                                       thread_type);
   caml_acquire_runtime_system();
 
   if( ! stream) Raise(EXN_FAILURE, "%s", ocaml_av_error_msg);
@@ -1241,13 +2493,13 @@ CAMLprim value ocaml_av_new_video_stream(value _av, value _video_codec_id, value
 
 CAMLprim value ocaml_av_new_video_stream_byte(value *argv, int argn)
 {
-  return ocaml_av_new_video_stream(argv[0], argv[1], argv[2], argv[3], argv[4], argv[5], argv[6], argv[7]);
+  return ocaml_av_new_video_stream(argv[0], argv[1], argv[2], argv[3], argv[4], argv[5], argv[6], argv[7], argv[8], argv[9], argv[10]);
 }
 
 
-static stream_t * new_subtitle_stream(av_t *av, enum AVCodecID codec_id, AVRational time_base)
+static stream_t * new_subtitle_stream(av_t *av, enum AVCodecID codec_id, AVRational time_base, int thread_count, int thread_type)
 {
-  stream_t * stream = new_stream(av, codec_id);
+  stream_t * stream = new_stream(av, codec_id, thread_count, thread_type);
   if( ! stream) return NULL;
 
   int ret = subtitle_header_default(stream->codec_context);
@@ -1259,14 +2511,17 @@ static stream_t * new_subtitle_stream(av_t *av, enum AVCodecID codec_id, AVRatio
   return stream;
 }
 
-CAMLprim value ocaml_av_new_subtitle_stream(value _av, value _subtitle_codec_id, value _time_base)
+CAMLprim value ocaml_av_new_subtitle_stream(value _av, value _subtitle_codec_id, value _time_base, value _thread_count, value _thread_type)
 {
-  CAMLparam3(_av, _subtitle_codec_id, _time_base);
+  CAMLparam4(_av, _subtitle_codec_id, _time_base, _thread_type);
+  int thread_type = ThreadType_val(_thread_type);
 
   caml_release_runtime_system();
   stream_t * stream = new_subtitle_stream(Av_val(_av),
                                           SubtitleCodecID_val(_subtitle_codec_id),
-                                          rational_of_value(_time_base));
+                                          rational_of_value(_time_base),
+                                          Int_val(_thread_count),
+                                          thread_type);
   caml_acquire_runtime_system();
 
   if( ! stream) Raise(EXN_FAILURE, "%s", ocaml_av_error_msg);
@@ -1429,7 +2684,7 @@ static stream_t * write_audio_frame(av_t * av, int stream_index, AVFrame * frame
 
     stream_t * stream = new_audio_stream(av, codec_id, frame->channel_layout,
                                          sample_format, 192000, frame->sample_rate,
-                                         (AVRational){1, frame->sample_rate});
+                                         (AVRational){1, frame->sample_rate}, -1, 0);
     if( ! stream) return NULL;
   }
 
@@ -1466,14 +2721,22 @@ static stream_t * write_audio_frame(av_t * av, int stream_index, AVFrame * frame
     int fifo_size = av_audio_fifo_size(fifo);
     int frame_size = fifo_size;
 
+    // A frame of the encoder frame size is written as is when no sample is pending
+    if(frame && fifo_size == 0 && frame->nb_samples == enc_ctx->frame_size) {
+      frame->pts = stream->pts;
+      stream->pts += frame->nb_samples;
+
+      ret = write_frame(av, stream_index, enc_ctx, frame);
+      if (ret < 0 && ret != AVERROR(EAGAIN) && ret != AVERROR_EOF) return NULL;
+
+      return stream;
+    }
+
     if(frame != NULL) {
       frame_size = enc_ctx->frame_size;
       fifo_size += frame->nb_samples;
 
-      ret = av_audio_fifo_realloc(fifo, fifo_size);
-      if (ret < 0) Fail("Failed to reallocate audio FIFO");
-
-      // Store the new samples in the FIFO buffer.
+      // Store the new samples in the FIFO buffer, which only grows for frames larger than planned
       ret = av_audio_fifo_write(fifo, (void **)(const uint8_t**)frame->extended_data, frame->nb_samples);
       if (ret < frame->nb_samples) Fail("Failed to write data to audio FIFO");
     }
@@ -1504,19 +2767,51 @@ static stream_t * write_audio_frame(av_t * av, int stream_index, AVFrame * frame
   return stream;
 }
 
-static AVFrame * scale_video_frame(stream_t * stream, AVFrame * frame)
+// Provide the scale context of the frame format, replacing the least recently used one if needed
+static struct SwsContext * provide_scaler(stream_t * stream, AVFrame * frame)
 {
   AVCodecContext * enc_ctx = stream->codec_context;
+  scaler_t * scaler = &stream->scalers[0];
+  int i;
 
-  if( ! stream->sws_ctx) {
-    // create scale context
-    stream->sws_ctx = sws_getContext(frame->width, frame->height,
+  for(i = 0; i < SCALER_CACHE_SIZE; i++) {
+    scaler_t * s = &stream->scalers[i];
+
+    if(s->sws_ctx && s->width == frame->width && s->height == frame->height
+       && s->format == (enum AVPixelFormat)frame->format) {
+      scaler = s;
+      break;
+    }
+    if( ! s->sws_ctx || (scaler->sws_ctx && s->last_use < scaler->last_use)) scaler = s;
+  }
+
+  if(i == SCALER_CACHE_SIZE) {
+    if(scaler->sws_ctx) sws_freeContext(scaler->sws_ctx);
+
+    scaler->sws_ctx = sws_getContext(frame->width, frame->height,
                                      (enum AVPixelFormat)frame->format,
                                      enc_ctx->width, enc_ctx->height,
                                      enc_ctx->pix_fmt,
-                                     SWS_BICUBIC, NULL, NULL, NULL);
-    if ( ! stream->sws_ctx) Fail("Failed to allocate scale context");
+                                     stream->sws_flags, NULL, NULL, NULL);
+    if ( ! scaler->sws_ctx) Fail("Failed to allocate scale context");
+
+    scaler->width = frame->width;
+    scaler->height = frame->height;
+    scaler->format = (enum AVPixelFormat)frame->format;
+  }
 
+  scaler->last_use = ++stream->nb_scaled_frames;
+  return scaler->sws_ctx;
+}
+
+static AVFrame * scale_video_frame(stream_t * stream, AVFrame * frame)
+{
+  AVCodecContext * enc_ctx = stream->codec_context;
+
+  struct SwsContext * sws_ctx = provide_scaler(stream, frame);
+  if( ! sws_ctx) return NULL;
+
+  if( ! stream->sw_frame) {
     // Allocate the scale frame
     stream->sw_frame = av_frame_alloc();
     if( ! stream->sw_frame) Fail("Failed to allocate scale frame");
@@ -1533,7 +2828,7 @@ static AVFrame * scale_video_frame(stream_t * stream, AVFrame * frame)
   if (ret < 0) Fail("Failed to make scale frame writable : %s", av_err2str(ret));
 
   // convert to destination format
-  sws_scale(stream->sws_ctx,
+  sws_scale(sws_ctx,
             (const uint8_t * const *)frame->data, frame->linesize,
             0, frame->height,
             stream->sw_frame->data, stream->sw_frame->linesize);
@@ -1557,7 +2852,7 @@ static stream_t * write_video_frame(av_t * av, int stream_index, AVFrame * frame
     stream_t * stream = new_video_stream(av, av->format_context->oformat->video_codec,
                                          frame->width, frame->height, pix_format,
                                          frame->width * frame->height * 4, 25,
-                                         (AVRational){1, 25});
+                                         (AVRational){1, 25}, SWS_BICUBIC, -1, 0);
     if( ! stream) return NULL;
   }
 
@@ -1684,6 +2979,14 @@ CAMLprim value ocaml_av_close(value _av)
   av_t * av = Av_val(_av);
   stream_t no_stream;
   stream_t * stream = &no_stream;
+  // The custom I/O holds OCaml values and, like the frame pool shared with
+  // the frame finalizers, is freed with the runtime lock
+  input_io_t * io = av->io;
+  output_io_t * out_io = av->out_io;
+  frame_pool_t * frame_pool = av->frame_pool;
+  av->io = NULL;
+  av->out_io = NULL;
+  av->frame_pool = NULL;
 
   caml_release_runtime_system();
 
@@ -1711,6 +3014,10 @@ CAMLprim value ocaml_av_close(value _av)
 
   caml_acquire_runtime_system();
 
+  if(io) free_input_io(io);
+  if(out_io) ocaml_av_free_output_io(out_io);
+  frame_pool_close(frame_pool);
+
   if( ! stream) Raise(EXN_FAILURE, "%s", ocaml_av_error_msg);
 
   CAMLreturn(Val_unit);
@@ -22,6 +22,19 @@ void value_of_inputFormat(AVInputFormat *inputFormat, value * p_value);
 void value_of_outputFormat(AVOutputFormat *outputFormat, value * p_value);
 
 
+/***** Custom output *****/
+
+typedef struct output_io_t output_io_t;
+
+// Allocate the I/O context writing to an Av.output_sink, with an optional seek function
+output_io_t * ocaml_av_alloc_output_io(value _sink, value _seek, int buffer_size);
+
+AVIOContext * ocaml_av_output_io_context(output_io_t * io);
+
+// Must be called with the runtime lock held
+void ocaml_av_free_output_io(output_io_t * io);
+
+
 /***** Control message *****/
 value * ocaml_av_get_control_message_callback(struct AVFormatContext *ctx);
 
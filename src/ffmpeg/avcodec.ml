@@ -23,6 +23,15 @@ module Packet = struct
 
   external to_bytes : 'a t -> bytes = "ocaml_avcodec_packet_to_bytes"
 
+  external to_data : 'a t -> data * 'a t = "ocaml_avcodec_packet_to_data"
+  let to_data packet =
+    let data, buffer_ref = to_data packet in
+    (* the data aliases the buffer held by buffer_ref, kept as long as it *)
+    Gc.finalise (fun _ -> ignore (Sys.opaque_identity buffer_ref)) data;
+    data
+
+  external of_data : data -> int -> 'a t = "ocaml_avcodec_packet_of_data"
+
 
   type parser_t
   type 'a parser = {mutable buf:data; mutable remainder:data; parser:parser_t}
@@ -32,13 +41,12 @@ module Packet = struct
   let create_parser id = {buf = empty_data; remainder = empty_data;
                           parser = create_parser id}
 
-  external parse_packet : parser_t -> data -> int -> int -> ('m t * int)option = "ocaml_avcodec_parse_packet"
+  external parse_packets : parser_t -> data -> int -> int -> ('m t * int) array = "ocaml_avcodec_parse_packets"
 
-  let rec buf_loop ctx f buf ofs len =
-      match parse_packet ctx.parser buf ofs len with
-      | Some(pkt, l) -> f pkt;
-        buf_loop ctx f buf (ofs + l) (len - l)
-      | None -> ofs
+  let parse_slice ctx data ofs len =
+    if ofs < 0 || len < 0 || ofs + len > Ba.dim data then
+      invalid_arg "Avcodec.Packet.parse_slice" ;
+    parse_packets ctx.parser data ofs len
 
   let parse_data ctx f data =
 
@@ -59,7 +67,8 @@ module Packet = struct
     if needed_len <> buf_len then
       Ba.fill(Ba.sub buf actual_len input_buffer_padding_size) 0;
 
-    let parsed_len = buf_loop ctx f buf 0 actual_len in
+    let parsed_len = Array.fold_left (fun _ (pkt, ofs) -> f pkt; ofs) 0
+        (parse_packets ctx.parser buf 0 actual_len) in
 
     ctx.buf <- buf;
     ctx.remainder <- Ba.sub buf parsed_len (actual_len - parsed_len)
@@ -74,8 +83,21 @@ module Packet = struct
     parse_data ctx f data
 end
 
-external create_decoder : int -> bool -> int option -> int option -> _ decoder = "ocaml_avcodec_create_context"
-external create_encoder : int -> bool -> int option -> int option -> _ encoder = "ocaml_avcodec_create_context"
+type thread_type = Frame_thread | Slice_thread
+
+type discard = Discard_none | Discard_default | Discard_nonref | Discard_bidir | Discard_nonintra | Discard_nonkey | Discard_all
+
+type decode_hint =
+  | Skip_frame of discard
+  | Skip_loop_filter of discard
+  | Skip_idct of discard
+  | Lowres of int
+
+external create_decoder : int -> bool -> int option -> int option -> int option -> thread_type array -> decode_hint array -> _ decoder = "ocaml_avcodec_create_context_byte" "ocaml_avcodec_create_context"
+external create_encoder : int -> bool -> int option -> int option -> int option -> thread_type array -> decode_hint array -> _ encoder = "ocaml_avcodec_create_context_byte" "ocaml_avcodec_create_context"
+
+external get_decoder_thread_count : _ decoder -> int = "ocaml_avcodec_get_thread_count"
+external get_encoder_thread_count : _ encoder -> int = "ocaml_avcodec_get_thread_count"
 
 
 (** Audio codecs. *)
@@ -133,9 +155,9 @@ module Audio = struct
 
   let create_parser id = Packet.create_parser(id_to_int id)
 
-  let create_decoder id = create_decoder (id_to_int id) true None None
+  let create_decoder ?thread_count ?(thread_type=[]) id = create_decoder (id_to_int id) true None None thread_count (Array.of_list thread_type) [||]
 
-  let create_encoder ?bit_rate id = create_encoder (id_to_int id) false bit_rate None
+  let create_encoder ?bit_rate ?thread_count ?(thread_type=[]) id = create_encoder (id_to_int id) false bit_rate None thread_count (Array.of_list thread_type) [||]
 end
 
 
@@ -181,9 +203,9 @@ module Video = struct
 
   let create_parser id = Packet.create_parser(id_to_int id)
 
-  let create_decoder id = create_decoder (id_to_int id) true None None
+  let create_decoder ?thread_count ?(thread_type=[]) ?(decode_hints=[]) id = create_decoder (id_to_int id) true None None thread_count (Array.of_list thread_type) (Array.of_list decode_hints)
 
-  let create_encoder ?bit_rate ?(frame_rate=25) id = create_encoder (id_to_int id) false bit_rate (Some frame_rate)
+  let create_encoder ?bit_rate ?(frame_rate=25) ?thread_count ?(thread_type=[]) id = create_encoder (id_to_int id) false bit_rate (Some frame_rate) thread_count (Array.of_list thread_type) [||]
 end
 
 (** Subtitle codecs. *)
@@ -225,6 +247,9 @@ let flush_decoder decoder f =
   receive_frame decoder f
 
 
+external decode_batch : 'media decoder -> 'media Packet.t array -> 'media frame array = "ocaml_avcodec_decode_batch"
+
+
 external _send_frame : 'media encoder -> 'media frame -> send_result = "ocaml_avcodec_send_frame"
 external _receive_packet : 'media encoder -> 'media Packet.t option = "ocaml_avcodec_receive_packet"
 external _flush_encoder : 'media encoder -> unit = "ocaml_avcodec_flush_encoder"
@@ -244,3 +269,6 @@ let rec encode encoder f frame =
 let flush_encoder encoder f =
   _flush_encoder encoder;
   receive_packet encoder f
+
+
+external encode_batch : 'media encoder -> 'media frame array -> 'media Packet.t array = "ocaml_avcodec_encode_batch"
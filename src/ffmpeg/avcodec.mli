@@ -6,6 +6,21 @@ type 'a t
 type 'media decoder
 type 'media encoder
 
+(** Number of zeroed bytes required by the decoders after the packet data. *)
+val input_buffer_padding_size : int
+
+(** Codec threading methods: decoding several frames at once, or several parts of a frame. *)
+type thread_type = Frame_thread | Slice_thread
+
+(** Frames, from none to all, for which a decoding step is skipped. *)
+type discard = Discard_none | Discard_default | Discard_nonref | Discard_bidir | Discard_nonintra | Discard_nonkey | Discard_all
+
+(** Decoding speed hints: skip the decoding, the loop filter or the IDCT of the frames given by the discard level, or decode the pictures at [1/2^n] of their size with [Lowres n]. [[Skip_frame Discard_nonkey; Skip_loop_filter Discard_all; Skip_idct Discard_all]] only decodes the keyframes, coarsely. *)
+type decode_hint =
+  | Skip_frame of discard
+  | Skip_loop_filter of discard
+  | Skip_idct of discard
+  | Lowres of int
 
 (** Packet. *)
 module Packet : sig
@@ -27,6 +42,14 @@ module Packet : sig
   (** Return a fresh bytes array containing a copy of packet datas. *)
   val to_bytes : 'a t -> bytes
 
+  val to_data : 'a t -> data
+  (** [Avcodec.Packet.to_data pkt] return a bigarray sharing the data of the [pkt] packet without copying it. The data stays valid as long as the returned bigarray, but not its sub-arrays, is reachable, even if the packet is reused. It must not be modified.
+    @raise Failure if the referencing failed. *)
+
+  val of_data : data -> int -> 'a t
+  (** [Avcodec.Packet.of_data data len] return a packet of the first [len] bytes of [data] without copying them. [data] must hold {!Avcodec.input_buffer_padding_size} zeroed bytes after them, and must not be modified while the packet or a packet or frame referencing it is in use.
+    @raise Failure if [data] is too short. *)
+
   val parse_data : 'a parser -> ('a t -> unit) -> data -> unit
   (** [Avcodec.Packet.parse_data parser f data] applies function [f] to the parsed packets frome the [data] array according to the [parser] configuration.
     @raise Failure if the parsing failed. *)
@@ -34,6 +57,11 @@ module Packet : sig
   val parse_bytes : 'a parser -> ('a t -> unit) -> bytes -> int -> unit
   (** Same as {!Avcodec.Packet.parse_data} with bytes array. *)
 
+  val parse_slice : 'a parser -> data -> int -> int -> ('a t * int) array
+  (** [Avcodec.Packet.parse_slice parser data ofs len] parses the [len] bytes of the [data] array from [ofs] in a single call and returns the parsed packets, each one with the offset in [data] after its end. The bytes after the last offset are not part of a packet yet and must be given again with the following data. [data] must hold {!Avcodec.input_buffer_padding_size} zeroed bytes after the slice. The packets share a single buffer.
+    @raise Invalid_argument if the slice is out of [data].
+    @raise Failure if the parsing failed. *)
+
 end
 
 
@@ -89,12 +117,12 @@ module Audio : sig
   (** [Avcodec.Audio.create_parser id] create an audio packet parser.
       @raise Failure if the parser creation failed. *)
 
-  val create_decoder : id -> audio decoder
-  (** [Avcodec.Audio.create_decoder id] create an audio decoder.
+  val create_decoder : ?thread_count:int -> ?thread_type:thread_type list -> id -> audio decoder
+  (** [Avcodec.Audio.create_decoder ~thread_count:n ~thread_type:tt id] create an audio decoder using [n] threads ([0] for an automatic count) with the allowed [tt] threading methods. The codec defaults are kept if not given.
       @raise Failure if the decoder creation failed. *)
 
-  val create_encoder : ?bit_rate:int -> id -> audio encoder
-  (** [Avcodec.Audio.create_encoder ~bit_rate:bit_rate id] create an audio encoder.
+  val create_encoder : ?bit_rate:int -> ?thread_count:int -> ?thread_type:thread_type list -> id -> audio encoder
+  (** [Avcodec.Audio.create_encoder ~bit_rate:bit_rate ~thread_count:n ~thread_type:tt id] create an audio encoder, threaded as with {!Avcodec.Audio.create_decoder}.
       @raise Failure if the encoder creation failed. *)
 end
 
@@ -146,12 +174,12 @@ module Video : sig
   (** [Avcodec.Video.create_parser id] create an video packet parser.
       @raise Failure if the parser creation failed. *)
 
-  val create_decoder : id -> video decoder
-  (** [Avcodec.Video.create_decoder id] create a video decoder.
+  val create_decoder : ?thread_count:int -> ?thread_type:thread_type list -> ?decode_hints:decode_hint list -> id -> video decoder
+  (** [Avcodec.Video.create_decoder ~thread_count:n ~thread_type:tt ~decode_hints:dh id] create a video decoder, threaded as with {!Avcodec.Audio.create_decoder}, and trading quality for speed according to the [dh] hints. A [Lowres] level is limited to the maximum supported by the decoder.
       @raise Failure if the decoder creation failed. *)
 
-  val create_encoder : ?bit_rate:int -> ?frame_rate:int -> id -> video encoder
-  (** [Avcodec.Video.create_encoder ~bit_rate:bit_rate id] create a video encoder.
+  val create_encoder : ?bit_rate:int -> ?frame_rate:int -> ?thread_count:int -> ?thread_type:thread_type list -> id -> video encoder
+  (** [Avcodec.Video.create_encoder ~bit_rate:bit_rate ~thread_count:n ~thread_type:tt id] create a video encoder, threaded as with {!Avcodec.Audio.create_decoder}.
       @raise Failure if the encoder creation failed. *)
 end
 
@@ -172,6 +200,13 @@ module Subtitle : sig
 end
 
 
+val get_decoder_thread_count : _ decoder -> int
+(** [Avcodec.get_decoder_thread_count decoder] return the number of threads used by the [decoder], [1] if it is not threaded. *)
+
+val get_encoder_thread_count : _ encoder -> int
+(** [Avcodec.get_encoder_thread_count encoder] return the number of threads used by the [encoder], [1] if it is not threaded.
+    @raise Failure if the encoder is not opened by a first frame yet. *)
+
 val decode : 'media decoder -> ('media frame -> unit) -> 'media Packet.t -> unit
 (** [Avcodec.decode decoder f packet] applies function [f] to the decoded frames frome the [packet] according to the [decoder] configuration.
     @raise Failure if the decoding failed. *)
@@ -180,6 +215,10 @@ val flush_decoder : 'media decoder -> ('media frame -> unit) -> unit
 (** [Avcodec.flush_decoder decoder f] applies function [f] to the decoded frames frome the buffered packets in the [decoder].
     @raise Failure if the decoding failed. *)
 
+val decode_batch : 'media decoder -> 'media Packet.t array -> 'media frame array
+(** [Avcodec.decode_batch decoder packets] returns the frames decoded from the [packets] according to the [decoder] configuration, in a single call.
+    @raise Failure if the decoding failed. *)
+
 val encode : 'media encoder -> ('media Packet.t -> unit) -> 'media frame -> unit
 (** [Avcodec.encode encoder f frame] applies function [f] to the encoded packets from the [frame] according to the [encoder] configuration.
     @raise Failure if the encoding failed. *)
@@ -187,3 +226,7 @@ val encode : 'media encoder -> ('media Packet.t -> unit) -> 'media frame -> unit
 val flush_encoder : 'media encoder -> ('media Packet.t -> unit) -> unit
 (** [Avcodec.flush_encoder encoder] applies function [f] to the encoded packets from the buffered frames in the [encoder].
     @raise Failure if the encoding failed. *)
+
+val encode_batch : 'media encoder -> 'media frame array -> 'media Packet.t array
+(** [Avcodec.encode_batch encoder frames] returns the packets encoded from the [frames] according to the [encoder] configuration, in a single call.
+    @raise Failure if the encoding failed. *)
@@ -7,6 +7,8 @@
 #include <caml/bigarray.h>
 #include <caml/threads.h>
 
+#include <pthread.h>
+
 #include <libavformat/avformat.h>
 #include <libavutil/audio_fifo.h>
 #include "avutil_stubs.h"
@@ -36,9 +38,64 @@ CAMLprim value ocaml_avcodec_subtitle_codec_id_to_AVCodecID(value _codec_id) {
 }
 
 
+/***** Threading *****/
+
+static const int THREAD_TYPES[] = {FF_THREAD_FRAME, FF_THREAD_SLICE};
+
+int ThreadType_val(value thread_types)
+{
+  int i, ans = 0;
+
+  for (i = 0; i < Wosize_val(thread_types); i++)
+    ans |= THREAD_TYPES[Int_val(Field(thread_types, i))];
+
+  return ans;
+}
+
+void set_codec_context_threads(AVCodecContext *codec_context, int thread_count, int thread_type)
+{
+  if(thread_count >= 0) codec_context->thread_count = thread_count;
+  if(thread_type) codec_context->thread_type = thread_type;
+}
+
+
+/***** Decoding hints *****/
+
+static const enum AVDiscard DISCARDS[] = {AVDISCARD_NONE, AVDISCARD_DEFAULT, AVDISCARD_NONREF, AVDISCARD_BIDIR, AVDISCARD_NONINTRA, AVDISCARD_NONKEY, AVDISCARD_ALL};
+
+void DecodeHints_val(value _hints, decode_hints_t *hints)
+{
+  int i;
+
+  hints->skip_frame = AVDISCARD_DEFAULT;
+  hints->skip_loop_filter = AVDISCARD_DEFAULT;
+  hints->skip_idct = AVDISCARD_DEFAULT;
+  hints->lowres = -1;
+
+  for (i = 0; i < Wosize_val(_hints); i++) {
+    value hint = Field(_hints, i);
+
+    switch (Tag_val(hint)) {
+    case 0: hints->skip_frame = DISCARDS[Int_val(Field(hint, 0))]; break;
+    case 1: hints->skip_loop_filter = DISCARDS[Int_val(Field(hint, 0))]; break;
+    case 2: hints->skip_idct = DISCARDS[Int_val(Field(hint, 0))]; break;
+    case 3: hints->lowres = Int_val(Field(hint, 0)); break;
+    }
+  }
+}
+
+void set_codec_context_hints(AVCodecContext *codec_context, const decode_hints_t *hints)
+{
+  codec_context->skip_frame = hints->skip_frame;
+  codec_context->skip_loop_filter = hints->skip_loop_filter;
+  codec_context->skip_idct = hints->skip_idct;
+  if(hints->lowres >= 0) codec_context->lowres = hints->lowres;
+}
+
+
 /***** AVCodecContext *****/
 
-static AVCodecContext * avcodec_create_AVCodecContext(AVCodec *codec)
+static AVCodecContext * avcodec_create_AVCodecContext(AVCodec *codec, int thread_count, int thread_type, const decode_hints_t *hints)
 {
   AVCodecContext *codec_context = NULL;
 
@@ -48,6 +105,9 @@ static AVCodecContext * avcodec_create_AVCodecContext(AVCodec *codec)
     Fail("Failed to allocate codec context");
   }
 
+  set_codec_context_threads(codec_context, thread_count, thread_type);
+  if(hints) set_codec_context_hints(codec_context, hints);
+
   // Open the codec
   int ret = avcodec_open2(codec_context, codec, NULL);
   if(ret < 0) {
@@ -94,10 +154,63 @@ void value_of_codec_parameters_copy(AVCodecParameters *src, value * pvalue)
 
 /***** AVPacket *****/
 
+typedef struct {
+  AVPacket * packet;  // first, so that Packet_val applies
+  size_t size;        // data size reported to the GC
+} packet_value_t;
+
+#define PacketValue_val(v) ((packet_value_t*)Data_custom_val(v))
+
+void account_packet_value(value v)
+{
+  AVPacket *packet = Packet_val(v);
+
+  // Packets may share a buffer, each one only accounting for its own data
+  account_media_bytes(MEDIA_PACKET, &PacketValue_val(v)->size, packet->size);
+}
+
+// Bigarray wrapped in a packet buffer, kept alive until the buffer is freed
+typedef struct packet_data_t {
+  value data;
+  struct packet_data_t * next;
+} packet_data_t;
+
+static pthread_mutex_t released_packet_data_lock = PTHREAD_MUTEX_INITIALIZER;
+static packet_data_t * released_packet_data = NULL;
+
+// Called by the last unref of the buffer, possibly from a codec or muxing thread without the runtime lock
+static void release_packet_data(void *opaque, uint8_t *data)
+{
+  packet_data_t * packet_data = (packet_data_t*)opaque;
+
+  pthread_mutex_lock(&released_packet_data_lock);
+  packet_data->next = released_packet_data;
+  released_packet_data = packet_data;
+  pthread_mutex_unlock(&released_packet_data_lock);
+}
+
+// Forget the bigarrays of the freed buffers, with the runtime lock held
+static void free_released_packet_data()
+{
+  pthread_mutex_lock(&released_packet_data_lock);
+  packet_data_t * packet_data = released_packet_data;
+  released_packet_data = NULL;
+  pthread_mutex_unlock(&released_packet_data_lock);
+
+  while(packet_data) {
+    packet_data_t * next = packet_data->next;
+    caml_remove_generational_global_root(&packet_data->data);
+    free(packet_data);
+    packet_data = next;
+  }
+}
+
 static void finalize_packet(value v)
 {
   struct AVPacket *packet = Packet_val(v);
+  account_media_bytes(MEDIA_PACKET, &PacketValue_val(v)->size, 0);
   av_packet_free(&packet);
+  free_released_packet_data();
 }
 
 static struct custom_operations packet_ops =
@@ -114,8 +227,10 @@ void value_of_ffmpeg_packet(AVPacket *packet, value * pvalue)
 {
   if( ! packet) Raise(EXN_FAILURE, "Empty packet");
 
-  *pvalue = caml_alloc_custom(&packet_ops, sizeof(AVPacket*), 0, 1);
-  Packet_val((*pvalue)) = packet;
+  *pvalue = caml_alloc_custom(&packet_ops, sizeof(packet_value_t), 0, 1);
+  PacketValue_val(*pvalue)->packet = packet;
+  PacketValue_val(*pvalue)->size = 0;
+  account_packet_value(*pvalue);
 }
 
 AVPacket * alloc_packet_value(value * pvalue)
@@ -161,12 +276,87 @@ CAMLprim value ocaml_avcodec_packet_to_bytes(value _packet)
   CAMLreturn(ans);
 }
 
+CAMLprim value ocaml_avcodec_packet_to_data(value _packet)
+{
+  CAMLparam1(_packet);
+  CAMLlocal2(ans, _buffer_ref);
+  struct AVPacket *packet = Packet_val(_packet);
+  intnat size = packet->size;
+
+  // The bigarray aliases the data of a new reference to the packet buffer
+  AVPacket *buffer_ref = alloc_packet_value(&_buffer_ref);
+  if( ! buffer_ref) Raise(EXN_FAILURE, "%s", ocaml_av_error_msg);
+
+  int ret = av_packet_ref(buffer_ref, packet);
+  if(ret < 0) Raise(EXN_FAILURE, "Failed to reference packet data : %s", av_err2str(ret));
+
+  account_packet_value(_buffer_ref);
+
+  ans = caml_alloc_tuple(2);
+  Store_field(ans, 0, caml_ba_alloc(CAML_BA_C_LAYOUT | CAML_BA_UINT8, 1, buffer_ref->data, &size));
+  Store_field(ans, 1, _buffer_ref);
+
+  CAMLreturn(ans);
+}
+
+CAMLprim value ocaml_avcodec_packet_of_data(value _data, value _len)
+{
+  CAMLparam1(_data);
+  CAMLlocal1(ans);
+  int len = Int_val(_len);
+
+  if(len < 0 || len + AV_INPUT_BUFFER_PADDING_SIZE > Caml_ba_array_val(_data)->dim[0])
+    Raise(EXN_FAILURE, "Packet data of %d bytes must be followed by %d padding bytes", len, AV_INPUT_BUFFER_PADDING_SIZE);
+
+  free_released_packet_data();
+
+  AVPacket *packet = alloc_packet_value(&ans);
+  if( ! packet) Raise(EXN_FAILURE, "%s", ocaml_av_error_msg);
+
+  packet_data_t * packet_data = (packet_data_t*)malloc(sizeof(packet_data_t));
+  if( ! packet_data) Raise(EXN_FAILURE, "Failed to allocate packet data");
+
+  packet_data->data = _data;
+  caml_register_generational_global_root(&packet_data->data);
+
+  // The bigarray is read in place, and stays alive as long as the buffer
+  packet->buf = av_buffer_create((uint8_t*)Caml_ba_data_val(_data), len + AV_INPUT_BUFFER_PADDING_SIZE,
+                                 release_packet_data, packet_data, AV_BUFFER_FLAG_READONLY);
+
+  if( ! packet->buf) {
+    caml_remove_generational_global_root(&packet_data->data);
+    free(packet_data);
+    Raise(EXN_FAILURE, "Failed to allocate packet buffer");
+  }
+
+  packet->data = packet->buf->data;
+  packet->size = len;
+  account_packet_value(ans);
+
+  CAMLreturn(ans);
+}
+
 
 /***** AVCodecParserContext *****/
 
+// Packet parsed by a whole slice parsing, stored in the parser staging buffer
+typedef struct {
+  size_t ofs;  // of the data in the staging buffer
+  int size;
+  int end;     // offset in the parsed slice after the packet
+} parsed_packet_t;
+
 typedef struct {
   AVCodecParserContext *context;
   AVCodecContext *codec_context;
+
+  // the staging buffer is handed over to the packets of a whole slice
+  // parsing, the next one being allocated with the same size
+  uint8_t *staging;
+  size_t staging_size;
+  // reused by the whole slice parsings
+  parsed_packet_t *parsed;
+  int parsed_size;
 } parser_t;
 
 #define Parser_val(v) (*(parser_t**)Data_custom_val(v))
@@ -179,6 +369,9 @@ static void free_parser(parser_t *parser)
 
   if(parser->codec_context) avcodec_free_context(&parser->codec_context);
 
+  av_free(parser->staging);
+  av_free(parser->parsed);
+
   free(parser);
 }
 
@@ -211,7 +404,7 @@ static parser_t * avcodec_create_parser(enum AVCodecID codec_id)
     Fail("Failed to init parser context");
   }
 
-  parser->codec_context = avcodec_create_AVCodecContext(codec);
+  parser->codec_context = avcodec_create_AVCodecContext(codec, -1, 0, NULL);
 
   if( ! parser->codec_context) {
     free_parser(parser);
@@ -237,55 +430,118 @@ CAMLprim value ocaml_avcodec_create_parser(value _codec_id) {
   CAMLreturn(ans);
 }
 
-CAMLprim value ocaml_avcodec_parse_packet(value _parser, value _data, value _ofs, value _len)
+// Copy a parsed packet and its padding in the staging buffer
+static int stage_parsed_packet(parser_t *parser, int nb_parsed, size_t staged, uint8_t *data, int size, int end)
+{
+  size_t needed = staged + size + AV_INPUT_BUFFER_PADDING_SIZE;
+
+  if( ! parser->staging || needed > parser->staging_size) {
+    size_t staging_size = FFMAX(needed, parser->staging ? 2 * parser->staging_size : parser->staging_size);
+    uint8_t *staging = av_realloc(parser->staging, staging_size);
+    if( ! staging) return AVERROR(ENOMEM);
+
+    parser->staging = staging;
+    parser->staging_size = staging_size;
+  }
+
+  if(nb_parsed == parser->parsed_size) {
+    int parsed_size = FFMAX(16, 2 * parser->parsed_size);
+    parsed_packet_t *parsed = av_realloc_array(parser->parsed, parsed_size, sizeof(parsed_packet_t));
+    if( ! parsed) return AVERROR(ENOMEM);
+
+    parser->parsed = parsed;
+    parser->parsed_size = parsed_size;
+  }
+
+  memcpy(parser->staging + staged, data, size);
+  memset(parser->staging + staged + size, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+
+  parser->parsed[nb_parsed].ofs = staged;
+  parser->parsed[nb_parsed].size = size;
+  parser->parsed[nb_parsed].end = end;
+
+  return 0;
+}
+
+CAMLprim value ocaml_avcodec_parse_packets(value _parser, value _data, value _ofs, value _len)
 {
   CAMLparam2(_parser, _data);
   CAMLlocal3(val_packet, tuple, ans);
   parser_t *parser = Parser_val(_parser);
-  uint8_t *data = Caml_ba_data_val(_data) + Int_val(_ofs);
-  size_t init_len = Int_val(_len);
-  size_t len = init_len;
-  int ret = 0;
+  int ofs = Int_val(_ofs);
+  uint8_t *init_data = Caml_ba_data_val(_data) + ofs;
+  uint8_t *data = init_data;
+  size_t len = Int_val(_len);
+  size_t staged = 0;
+  int i, ret = 0, nb_parsed = 0;
+  uint8_t *out_data;
+  int out_size;
+
+  // Parse the whole slice with the runtime lock released, stopping when no more packet is output
+  caml_release_runtime_system();
+  for(;;) {
+    out_size = 0;
+
+    do {
+      ret = av_parser_parse2(parser->context, parser->codec_context,
+                             &out_data, &out_size,
+                             data, len, AV_NOPTS_VALUE, AV_NOPTS_VALUE, 0);
+      if(ret < 0) break;
+      data += ret;
+      len -= ret;
+    } while(out_size == 0 && ret > 0);
+
+    if(ret < 0 || out_size == 0) break;
+
+    // The parser output is only valid until the next parsing
+    ret = stage_parsed_packet(parser, nb_parsed, staged, out_data, out_size, ofs + (data - init_data));
+    if(ret < 0) break;
+
+    staged += out_size + AV_INPUT_BUFFER_PADDING_SIZE;
+    nb_parsed++;
+  }
+  caml_acquire_runtime_system();
 
-  AVPacket *packet = av_packet_alloc();
-  if( ! packet) Raise(EXN_FAILURE, "Failed to allocate packet");
+  if(ret < 0) Raise(EXN_FAILURE, "Failed to parse data : %s", av_err2str(ret));
 
-  caml_release_runtime_system();
-  do {
-    ret = av_parser_parse2(parser->context, parser->codec_context,
-                           &packet->data, &packet->size,
-                           data, len, AV_NOPTS_VALUE, AV_NOPTS_VALUE, 0);
-    data += ret;
-    len -= ret;
-  } while(packet->size == 0 && ret > 0);
+  // All the packets share the staging buffer
+  AVBufferRef *buffer = NULL;
 
-  caml_acquire_runtime_system();
+  if(nb_parsed > 0) {
+    buffer = av_buffer_create(parser->staging, parser->staging_size, av_buffer_default_free, NULL, 0);
+    if( ! buffer) Raise(EXN_FAILURE, "Failed to allocate parsed packets buffer");
 
-  if (ret < 0) {
-    av_packet_free(&packet);
-    Raise(EXN_FAILURE, "Failed to parse data : %s", av_err2str(ret));
+    parser->staging = NULL;
   }
 
-  if(packet->size) {
+  ans = caml_alloc_tuple(nb_parsed);
+
+  for(i = 0; i < nb_parsed; i++) {
+    AVPacket *packet = av_packet_alloc();
+    if(packet) packet->buf = av_buffer_ref(buffer);
+
+    if( ! packet || ! packet->buf) {
+      av_packet_free(&packet);
+      av_buffer_unref(&buffer);
+      Raise(EXN_FAILURE, "Failed to allocate packet");
+    }
+
+    packet->data = buffer->data + parser->parsed[i].ofs;
+    packet->size = parser->parsed[i].size;
+
     value_of_ffmpeg_packet(packet, &val_packet);
 
     tuple = caml_alloc_tuple(2);
-
     Store_field(tuple, 0, val_packet);
-    Store_field(tuple, 1, Val_int(init_len - len));
-
-    ans = caml_alloc(1, 0);
-    Store_field(ans, 0, tuple);
-  }
-  else {
-    av_packet_free(&packet);
-    ans = Val_int(0);
+    Store_field(tuple, 1, Val_int(parser->parsed[i].end));
+    Store_field(ans, i, tuple);
   }
 
+  av_buffer_unref(&buffer);
+
   CAMLreturn(ans);
 }
 
-
 /***** codec_context_t *****/
 
 typedef struct {
@@ -298,6 +554,9 @@ typedef struct {
   AVFrame *enc_frame;
   int64_t pts;
   int flushed;
+  // threading, applied when the encoder is opened
+  int thread_count;
+  int thread_type;
 } codec_context_t;
 
 #define CodecContext_val(v) (*(codec_context_t**)Data_custom_val(v))
@@ -334,15 +593,18 @@ static struct custom_operations codec_context_ops =
     custom_deserialize_default
   };
 
-static codec_context_t * avcodec_create_codec_context(enum AVCodecID codec_id, int decoder)
+static codec_context_t * avcodec_create_codec_context(enum AVCodecID codec_id, int decoder, int thread_count, int thread_type, const decode_hints_t *hints)
 {
   codec_context_t * ctx = (codec_context_t*)calloc(1, sizeof(codec_context_t));
   if ( ! ctx) Fail("Failed to allocate codec context");
 
+  ctx->thread_count = thread_count;
+  ctx->thread_type = thread_type;
+
   if(decoder) {
     ctx->codec = avcodec_find_decoder(codec_id);
 
-    ctx->codec_context = avcodec_create_AVCodecContext(ctx->codec);
+    ctx->codec_context = avcodec_create_AVCodecContext(ctx->codec, thread_count, thread_type, hints);
 
     if( ! ctx->codec_context) {
       free_codec_context(ctx);
@@ -362,12 +624,17 @@ static codec_context_t * avcodec_create_codec_context(enum AVCodecID codec_id, i
   return ctx;
 }
 
-CAMLprim value ocaml_avcodec_create_context(value _codec_id, value _decoder, value _bit_rate, value _frame_rate) {
-  CAMLparam3(_codec_id, _bit_rate, _frame_rate);
+CAMLprim value ocaml_avcodec_create_context(value _codec_id, value _decoder, value _bit_rate, value _frame_rate, value _thread_count, value _thread_type, value _hints) {
+  CAMLparam5(_codec_id, _bit_rate, _frame_rate, _thread_count, _thread_type);
+  CAMLxparam1(_hints);
   CAMLlocal1(ans);
+  int thread_count = Is_block(_thread_count) ? Int_val(Field(_thread_count, 0)) : -1;
+  int thread_type = ThreadType_val(_thread_type);
+  decode_hints_t hints;
+  DecodeHints_val(_hints, &hints);
 
   caml_release_runtime_system();
-  codec_context_t * ctx = avcodec_create_codec_context((enum AVCodecID)Int_val(_codec_id), Int_val(_decoder));
+  codec_context_t * ctx = avcodec_create_codec_context((enum AVCodecID)Int_val(_codec_id), Int_val(_decoder), thread_count, thread_type, &hints);
   caml_acquire_runtime_system();
 
   if( ! ctx) Raise(EXN_FAILURE, "%s", ocaml_av_error_msg);
@@ -381,6 +648,21 @@ CAMLprim value ocaml_avcodec_create_context(value _codec_id, value _decoder, val
   CAMLreturn(ans);
 }
 
+CAMLprim value ocaml_avcodec_create_context_byte(value *argv, int argn)
+{
+  return ocaml_avcodec_create_context(argv[0], argv[1], argv[2], argv[3], argv[4], argv[5], argv[6]);
+}
+
+CAMLprim value ocaml_avcodec_get_thread_count(value _ctx)
+{
+  CAMLparam1(_ctx);
+  codec_context_t *ctx = CodecContext_val(_ctx);
+
+  if( ! ctx->codec_context) Raise(EXN_FAILURE, "Failed to get thread count of encoder not opened yet");
+
+  CAMLreturn(Val_int(ctx->codec_context->thread_count));
+}
+
 
 static AVCodecContext * avcodec_open_codec(codec_context_t *ctx, AVFrame *frame)
 {
@@ -409,6 +691,7 @@ static AVCodecContext * avcodec_open_codec(codec_context_t *ctx, AVFrame *frame)
   }
 
   ctx->codec_context->bit_rate = ctx->bit_rate;
+  set_codec_context_threads(ctx->codec_context, ctx->thread_count, ctx->thread_type);
 
   // Open the codec
   int ret = avcodec_open2(ctx->codec_context, NULL, NULL);
@@ -430,7 +713,8 @@ static AVCodecContext * avcodec_open_codec(codec_context_t *ctx, AVFrame *frame)
     if (ret < 0) Fail("Failed to allocate encoder frame samples : %s)", av_err2str(ret));
 
     // Create the FIFO buffer based on the specified output sample format.
-    ctx->audio_fifo = av_audio_fifo_alloc(ctx->codec_context->sample_fmt, ctx->codec_context->channels, 1);
+    ctx->audio_fifo = av_audio_fifo_alloc(ctx->codec_context->sample_fmt, ctx->codec_context->channels,
+                                          ctx->codec_context->frame_size + AUDIO_FIFO_MAX_INPUT);
     if( ! ctx->audio_fifo) Fail("Failed to allocate audio FIFO");
   }
 
@@ -550,17 +834,20 @@ static int send_frame(codec_context_t *ctx, AVFrame *frame)
 
     ret = avcodec_send_frame(ctx->codec_context, frame);
   }
+  else if(frame && av_audio_fifo_size(ctx->audio_fifo) == 0
+          && frame->nb_samples == enc_ctx->frame_size) {
+
+    // A frame of the encoder frame size is sent as is when no sample is pending
+    frame->pts = ctx->pts;
+    ctx->pts += frame->nb_samples;
+
+    ret = avcodec_send_frame(ctx->codec_context, frame);
+  }
   else {
     if(frame != NULL) {
       AVAudioFifo *fifo = ctx->audio_fifo;
-      int fifo_size = av_audio_fifo_size(fifo);
-
-      fifo_size += frame->nb_samples;
 
-      ret = av_audio_fifo_realloc(fifo, fifo_size);
-      if (ret < 0) return ret;
-
-      // Store the new samples in the FIFO buffer.
+      // Store the new samples in the FIFO buffer, which only grows for frames larger than planned
       ret = av_audio_fifo_write(fifo, (void **)(const uint8_t**)frame->extended_data, frame->nb_samples);
       if (ret < frame->nb_samples) {
         Log("Failed to write data to audio FIFO");
@@ -572,6 +859,22 @@ static int send_frame(codec_context_t *ctx, AVFrame *frame)
   return ret;
 }
 
+// Receive a packet, feeding the encoder with the samples left in the audio FIFO if needed
+static int receive_packet(codec_context_t *ctx, AVPacket *packet)
+{
+  int ret = 0;
+
+  while (ret >= 0) {
+    ret = avcodec_receive_packet(ctx->codec_context, packet);
+
+    if(ret == AVERROR(EAGAIN) && ctx->audio_fifo) {
+      ret = send_audio_fifo_frame(ctx);
+    }
+    else break;
+  }
+  return ret;
+}
+
 CAMLprim value ocaml_avcodec_send_frame(value _ctx, value _frame)
 {
   CAMLparam2(_ctx, _frame);
@@ -604,15 +907,8 @@ CAMLprim value ocaml_avcodec_receive_packet(value _ctx)
   caml_release_runtime_system();
 
   AVPacket *packet = av_packet_alloc();
+  if (packet) ret = receive_packet(ctx, packet);
 
-  for (; packet && ret >= 0;) {
-    ret = avcodec_receive_packet(ctx->codec_context, packet);
-
-    if(ret == AVERROR(EAGAIN) && ctx->audio_fifo) {
-      ret = send_audio_fifo_frame(ctx);
-    }
-    else break;
-  }
   caml_acquire_runtime_system();
 
   if( ! packet) Raise(EXN_FAILURE, "Failed to allocate packet");
@@ -635,6 +931,148 @@ CAMLprim value ocaml_avcodec_flush_encoder(value _ctx) {
 }
 
 
+/**** Batches ****/
+
+// Receive all the frames available from the decoder
+static int receive_frames(codec_context_t *ctx, AVFrame ***frames, int *nb_frames)
+{
+  int ret;
+
+  for(;;) {
+    AVFrame *frame = av_frame_alloc();
+    if( ! frame) return AVERROR(ENOMEM);
+
+    ret = avcodec_receive_frame(ctx->codec_context, frame);
+
+    if(ret >= 0) ret = av_dynarray_add_nofree(frames, nb_frames, frame);
+
+    if(ret < 0) {
+      av_frame_free(&frame);
+      return ret == AVERROR(EAGAIN) || ret == AVERROR_EOF ? 0 : ret;
+    }
+  }
+}
+
+// Receive all the packets available from the encoder
+static int receive_packets(codec_context_t *ctx, AVPacket ***packets, int *nb_packets)
+{
+  int ret;
+
+  for(;;) {
+    AVPacket *packet = av_packet_alloc();
+    if( ! packet) return AVERROR(ENOMEM);
+
+    ret = receive_packet(ctx, packet);
+
+    if(ret >= 0) ret = av_dynarray_add_nofree(packets, nb_packets, packet);
+
+    if(ret < 0) {
+      av_packet_free(&packet);
+      return ret == AVERROR(EAGAIN) || ret == AVERROR_EOF ? 0 : ret;
+    }
+  }
+}
+
+CAMLprim value ocaml_avcodec_decode_batch(value _ctx, value _packets)
+{
+  CAMLparam2(_ctx, _packets);
+  CAMLlocal2(val_frame, ans);
+  codec_context_t *ctx = CodecContext_val(_ctx);
+  int i, ret = 0, nb_packets = Wosize_val(_packets), nb_frames = 0;
+  AVFrame **frames = NULL;
+
+  // The packets are taken before releasing the runtime lock
+  AVPacket **packets = (AVPacket**)av_malloc_array(nb_packets + 1, sizeof(AVPacket*));
+  if( ! packets) Raise(EXN_FAILURE, "Failed to allocate packets");
+
+  for(i = 0; i < nb_packets; i++) packets[i] = Packet_val(Field(_packets, i));
+
+  caml_release_runtime_system();
+
+  for(i = 0; i < nb_packets && ret >= 0; i++) {
+
+    while((ret = avcodec_send_packet(ctx->codec_context, packets[i])) == AVERROR(EAGAIN)) {
+      // the decoder output must be read before sending the packet again
+      ret = receive_frames(ctx, &frames, &nb_frames);
+      if(ret < 0) break;
+    }
+
+    if(ret == AVERROR_EOF) ret = 0;
+    if(ret >= 0) ret = receive_frames(ctx, &frames, &nb_frames);
+  }
+
+  caml_acquire_runtime_system();
+
+  av_free(packets);
+
+  if(ret < 0) {
+    for(i = 0; i < nb_frames; i++) av_frame_free(&frames[i]);
+    av_free(frames);
+    Raise(EXN_FAILURE, "Failed to decode data : %s", av_err2str(ret));
+  }
+
+  ans = caml_alloc_tuple(nb_frames);
+
+  for(i = 0; i < nb_frames; i++) {
+    value_of_frame(frames[i], &val_frame);
+    Store_field(ans, i, val_frame);
+  }
+  av_free(frames);
+
+  CAMLreturn(ans);
+}
+
+CAMLprim value ocaml_avcodec_encode_batch(value _ctx, value _frames)
+{
+  CAMLparam2(_ctx, _frames);
+  CAMLlocal2(val_packet, ans);
+  codec_context_t *ctx = CodecContext_val(_ctx);
+  int i, ret = 0, nb_frames = Wosize_val(_frames), nb_packets = 0;
+  AVPacket **packets = NULL;
+
+  // The frames are taken before releasing the runtime lock
+  AVFrame **frames = (AVFrame**)av_malloc_array(nb_frames + 1, sizeof(AVFrame*));
+  if( ! frames) Raise(EXN_FAILURE, "Failed to allocate frames");
+
+  for(i = 0; i < nb_frames; i++) frames[i] = Frame_val(Field(_frames, i));
+
+  caml_release_runtime_system();
+
+  for(i = 0; i < nb_frames && ret >= 0; i++) {
+
+    while((ret = send_frame(ctx, frames[i])) == AVERROR(EAGAIN)) {
+      // the encoder output must be read before sending the frame again
+      ret = receive_packets(ctx, &packets, &nb_packets);
+      if(ret < 0) break;
+    }
+
+    if(ret == AVERROR_EOF) ret = 0;
+    if(ret >= 0) ret = receive_packets(ctx, &packets, &nb_packets);
+  }
+
+  caml_acquire_runtime_system();
+
+  av_free(frames);
+
+  if(ret < 0) {
+    for(i = 0; i < nb_packets; i++) av_packet_free(&packets[i]);
+    av_free(packets);
+
+    if(ret == AVERROR_EXTERNAL) Raise(EXN_FAILURE, "%s", ocaml_av_error_msg);
+    Raise(EXN_FAILURE, "Failed to encode frame : %s", av_err2str(ret));
+  }
+
+  ans = caml_alloc_tuple(nb_packets);
+
+  for(i = 0; i < nb_packets; i++) {
+    value_of_ffmpeg_packet(packets[i], &val_packet);
+    Store_field(ans, i, val_packet);
+  }
+  av_free(packets);
+
+  CAMLreturn(ans);
+}
+
 /**** codec ****/
 
 static enum AVCodecID find_codec_id(const char *name)
@@ -19,6 +19,41 @@ void value_of_packet(AVPacket *packet, value * pvalue);
 
 AVPacket * alloc_packet_value(value * pvalue);
 
+// Report the data size of a packet value, once filled
+void account_packet_value(value v);
+
+
+/***** Threading *****/
+
+// Thread type flags of an Avcodec.thread_type array
+int ThreadType_val(value thread_types);
+
+// Set the codec threading before opening it, a negative count or no type keeping the defaults
+void set_codec_context_threads(AVCodecContext *codec_context, int thread_count, int thread_type);
+
+
+/***** Decoding hints *****/
+
+typedef struct {
+  enum AVDiscard skip_frame;
+  enum AVDiscard skip_loop_filter;
+  enum AVDiscard skip_idct;
+  int lowres;  // negative if not given
+} decode_hints_t;
+
+// Read an Avcodec.decode_hint array, the hints not given keeping the codec defaults
+void DecodeHints_val(value _hints, decode_hints_t *hints);
+
+// Set the decoder hints, before opening it for lowres
+void set_codec_context_hints(AVCodecContext *codec_context, const decode_hints_t *hints);
+
+
+/***** Audio FIFO *****/
+
+/* Initial capacity of an encoder audio FIFO beyond the encoder frame size,
+ * enough for the largest frames of the usual decoders */
+#define AUDIO_FIFO_MAX_INPUT 8192
+
 
 /**** Audio codec ID ****/
 
@@ -17,7 +17,7 @@ CAMLprim value filter_in_out_name(value _filter_in_out)
   AVFilterInOut *filter_in_out =
     FilterInOut_val(_filter_in_out);
 
-  ans = caml_copy_string(filter_in_out->name);
+  ans = caml_copy_string(filter_in_out->name ? filter_in_out->name : "");
 
   CAMLreturn(ans);
 }
@@ -197,6 +197,7 @@ CAMLprim value buffersink_get_frame(value _output_filter)
 
   switch (ret) {
     case 0:
+      account_frame_value(_next_frame);
       ans = caml_alloc(1, 0);
       Store_field(ans, 0, _next_frame);
       break;
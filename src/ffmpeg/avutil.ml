@@ -17,6 +17,12 @@ type ('line, 'media) format
 (* Frame *)
 type 'media frame
 
+external frame_get_pts : _ frame -> Int64.t option = "ocaml_avutil_frame_get_pts"
+
+type live_bytes = {frames : int; packets : int; subtitles : int}
+
+external live_bytes : unit -> live_bytes = "ocaml_avutil_live_bytes"
+
 exception Failure of string
 
 let () =
@@ -27,6 +27,18 @@ type ('line, 'media) format
 
 type 'media frame
 
+val frame_get_pts : _ frame -> Int64.t option
+(** [Avutil.frame_get_pts frm] return the presentation timestamp of the [frm] frame, in the time base of its stream for audio and video frames and in [AV_TIME_BASE] units for subtitles, if any. *)
+
+
+(** {1 Memory} *)
+
+(** Bytes of media data held by the frame, packet and subtitle values alive, as reported to the GC. *)
+type live_bytes = {frames : int; packets : int; subtitles : int}
+
+val live_bytes : unit -> live_bytes
+(** Return the bytes of media data currently held by OCaml values, per kind. *)
+
 
 (** {1 Exception} *)
 
@@ -247,12 +247,68 @@ CAMLprim value ocaml_avutil_pixelformat_of_string(value name)
 }
 
 
+/***** GC accounting *****/
+
+// Only updated with the runtime lock held
+static int64_t live_bytes[MEDIA_KINDS];
+
+void account_media_bytes(enum media_kind kind, size_t * accounted, size_t size)
+{
+  if(size > *accounted) caml_adjust_gc_speed(size - *accounted, GC_MAX_MEDIA_BYTES);
+
+  live_bytes[kind] += (int64_t)size - (int64_t)*accounted;
+  *accounted = size;
+}
+
+CAMLprim value ocaml_avutil_live_bytes(value unit)
+{
+  CAMLparam1(unit);
+  CAMLlocal1(ans);
+
+  ans = caml_alloc_tuple(MEDIA_KINDS);
+  Store_field(ans, MEDIA_FRAME, Val_long(live_bytes[MEDIA_FRAME]));
+  Store_field(ans, MEDIA_PACKET, Val_long(live_bytes[MEDIA_PACKET]));
+  Store_field(ans, MEDIA_SUBTITLE, Val_long(live_bytes[MEDIA_SUBTITLE]));
+
+  CAMLreturn(ans);
+}
+
+
 /***** AVFrame *****/
 
+typedef struct {
+  AVFrame * frame;  // first, so that Frame_val applies
+  frame_pool_t * pool;
+  size_t size;      // data size reported to the GC
+} frame_value_t;
+
+#define FrameValue_val(v) ((frame_value_t*)Data_custom_val(v))
+
+static size_t frame_data_size(AVFrame * frame)
+{
+  size_t size = 0;
+  int i;
+
+#ifdef HAS_FRAME
+  for(i = 0; i < AV_NUM_DATA_POINTERS; i++)
+    if(frame->buf[i]) size += frame->buf[i]->size;
+
+  for(i = 0; i < frame->nb_extended_buf; i++)
+    size += frame->extended_buf[i]->size;
+#endif
+  return size;
+}
+
+void account_frame_value(value v)
+{
+  account_media_bytes(MEDIA_FRAME, &FrameValue_val(v)->size, frame_data_size(Frame_val(v)));
+}
+
 static void finalize_frame(value v)
 {
 #ifdef HAS_FRAME
   AVFrame *frame = Frame_val(v);
+  account_media_bytes(MEDIA_FRAME, &FrameValue_val(v)->size, 0);
   if(frame) av_frame_free(&frame);
 #endif
 }
@@ -271,8 +327,11 @@ void value_of_frame(AVFrame *frame, value * pvalue)
 {
   if( ! frame) Raise(EXN_FAILURE, "Empty frame");
 
-  *pvalue = caml_alloc_custom(&frame_ops, sizeof(AVFrame*), 0, 1);
-  Frame_val((*pvalue)) = frame;
+  *pvalue = caml_alloc_custom(&frame_ops, sizeof(frame_value_t), 0, 1);
+  FrameValue_val(*pvalue)->frame = frame;
+  FrameValue_val(*pvalue)->pool = NULL;
+  FrameValue_val(*pvalue)->size = 0;
+  account_frame_value(*pvalue);
 }
 
 AVFrame * alloc_frame_value(value * pvalue)
@@ -285,6 +344,115 @@ AVFrame * alloc_frame_value(value * pvalue)
 }
 
 
+/***** AVFrame pool *****/
+
+// Only used with the runtime lock held
+struct frame_pool_t {
+  int size;
+  int nb_free;
+  AVFrame ** free;  // unreferenced frames ready for reuse
+  int nb_out;       // frame values allocated by the pool and not collected
+  int closed;
+};
+
+static void free_frame_pool(frame_pool_t * pool)
+{
+  while(pool->nb_free > 0) av_frame_free(&pool->free[--pool->nb_free]);
+  free(pool->free);
+  free(pool);
+}
+
+// Give a frame back to its pool, or free it if the pool is full or closed
+static void frame_pool_put(frame_pool_t * pool, AVFrame * frame)
+{
+  if( ! pool->closed && pool->nb_free < pool->size) {
+    av_frame_unref(frame);
+    pool->free[pool->nb_free++] = frame;
+  }
+  else {
+    av_frame_free(&frame);
+  }
+}
+
+static void finalize_pooled_frame(value v)
+{
+  frame_pool_t * pool = FrameValue_val(v)->pool;
+  AVFrame * frame = Frame_val(v);
+
+  account_media_bytes(MEDIA_FRAME, &FrameValue_val(v)->size, 0);
+
+  // A released frame value has already given its frame back
+  if(frame) frame_pool_put(pool, frame);
+
+  pool->nb_out--;
+  if(pool->closed && pool->nb_out == 0) free_frame_pool(pool);
+}
+
+static struct custom_operations pooled_frame_ops =
+  {
+    "ocaml_avframe_pooled",
+    finalize_pooled_frame,
+    custom_compare_default,
+    custom_hash_default,
+    custom_serialize_default,
+    custom_deserialize_default
+  };
+
+frame_pool_t * frame_pool_create(int size)
+{
+  frame_pool_t * pool = (frame_pool_t*)calloc(1, sizeof(frame_pool_t));
+  if( ! pool) Fail("Failed to allocate frame pool");
+
+  pool->size = size;
+  pool->free = (AVFrame**)calloc(size, sizeof(AVFrame*));
+  if( ! pool->free) {
+    free(pool);
+    Fail("Failed to allocate frame pool");
+  }
+  return pool;
+}
+
+void frame_pool_close(frame_pool_t * pool)
+{
+  if( ! pool) return;
+
+  pool->closed = 1;
+
+  // The frame values still alive free the pool with the last one collected
+  if(pool->nb_out == 0) free_frame_pool(pool);
+  else {
+    while(pool->nb_free > 0) av_frame_free(&pool->free[--pool->nb_free]);
+  }
+}
+
+AVFrame * alloc_pooled_frame_value(frame_pool_t * pool, value * pvalue)
+{
+  AVFrame * frame = pool->nb_free > 0 ? pool->free[--pool->nb_free] : av_frame_alloc();
+  if( ! frame) Fail("Failed to allocate frame");
+
+  // A new value each time, so that the values held by OCaml never change
+  pool->nb_out++;
+  *pvalue = caml_alloc_custom(&pooled_frame_ops, sizeof(frame_value_t), 0, 1);
+  FrameValue_val(*pvalue)->frame = frame;
+  FrameValue_val(*pvalue)->pool = pool;
+  FrameValue_val(*pvalue)->size = 0;
+  return frame;
+}
+
+void frame_pool_release_value(value v)
+{
+  AVFrame * frame;
+
+  if(Custom_ops_val(v) != &pooled_frame_ops || ! (frame = Frame_val(v))) return;
+
+  // The data goes back to the decoder and the frame to the pool now, the
+  // value being left empty
+  account_media_bytes(MEDIA_FRAME, &FrameValue_val(v)->size, 0);
+  Frame_val(v) = NULL;
+  frame_pool_put(FrameValue_val(v)->pool, frame);
+}
+
+
 CAMLprim value ocaml_avutil_video_create_frame(value _w, value _h, value _format)
 {
   CAMLparam1(_format);
@@ -358,10 +526,38 @@ CAMLprim value ocaml_avutil_video_get_frame_bigarray_planes(value _frame, value
 
 /***** AVSubtitle *****/
 
+typedef struct {
+  AVSubtitle * subtitle;  // first, so that Subtitle_val applies
+  size_t size;            // data size reported to the GC
+} subtitle_value_t;
+
+#define SubtitleValue_val(v) ((subtitle_value_t*)Data_custom_val(v))
+
+static size_t subtitle_data_size(AVSubtitle * subtitle)
+{
+  size_t size = 0;
+  unsigned i;
+
+  for(i = 0; i < subtitle->num_rects; i++) {
+    AVSubtitleRect * rect = subtitle->rects[i];
+    if( ! rect) continue;
+    if(rect->data[0]) size += rect->linesize[0] * rect->h + AVPALETTE_SIZE;
+    if(rect->text) size += strlen(rect->text);
+    if(rect->ass) size += strlen(rect->ass);
+  }
+  return size;
+}
+
+void account_subtitle_value(value v)
+{
+  account_media_bytes(MEDIA_SUBTITLE, &SubtitleValue_val(v)->size, subtitle_data_size(Subtitle_val(v)));
+}
+
 static void finalize_subtitle(value v)
 {
   struct AVSubtitle *subtitle = Subtitle_val(v);
 
+  account_media_bytes(MEDIA_SUBTITLE, &SubtitleValue_val(v)->size, 0);
   avsubtitle_free(subtitle);
   free(subtitle);
 }
@@ -380,8 +576,10 @@ void value_of_subtitle(AVSubtitle *subtitle, value * pvalue)
 {
   if( ! subtitle) Raise(EXN_FAILURE, "Empty subtitle");
 
-  *pvalue = caml_alloc_custom(&subtitle_ops, sizeof(AVSubtitle*), 0, 1);
-  Subtitle_val((*pvalue)) = subtitle;
+  *pvalue = caml_alloc_custom(&subtitle_ops, sizeof(subtitle_value_t), 0, 1);
+  SubtitleValue_val(*pvalue)->subtitle = subtitle;
+  SubtitleValue_val(*pvalue)->size = 0;
+  account_subtitle_value(*pvalue);
 }
 
 AVSubtitle * alloc_subtitle_value(value * pvalue)
@@ -436,6 +634,8 @@ CAMLprim value ocaml_avutil_subtitle_create_frame(value _start_time, value _end_
     //    if( ! subtitle->rects[i]->ass) Raise(EXN_FAILURE, "Failed to allocate subtitle frame");
   }
 
+  account_subtitle_value(ans);
+
   CAMLreturn(ans);
 }
 
@@ -461,3 +661,27 @@ CAMLprim value ocaml_avutil_subtitle_to_lines(value _subtitle)
   CAMLreturn(ans);
 }
 
+// The pts of an audio or video frame, or of a subtitle
+CAMLprim value ocaml_avutil_frame_get_pts(value _frame)
+{
+  CAMLparam1(_frame);
+  CAMLlocal1(ans);
+  int64_t pts = AV_NOPTS_VALUE;
+
+  if(Custom_ops_val(_frame) == &subtitle_ops) {
+    pts = Subtitle_val(_frame)->pts;
+  }
+#ifdef HAS_FRAME
+  else if(Frame_val(_frame)) {
+    pts = Frame_val(_frame)->pts;
+  }
+#endif
+
+  if(pts == AV_NOPTS_VALUE) CAMLreturn(Val_int(0));
+
+  ans = caml_alloc(1, 0);
+  Store_field(ans, 0, caml_copy_int64(pts));
+
+  CAMLreturn(ans);
+}
+
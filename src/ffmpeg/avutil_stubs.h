@@ -90,18 +90,59 @@ int PixelFormat_val(value);
 value Val_PixelFormat(enum AVPixelFormat pf);
 
 
+/***** GC accounting *****/
+
+/* The data of the media values is reported to the GC, a major cycle being
+ * completed for about this many bytes allocated */
+#define GC_MAX_MEDIA_BYTES (256 * 1024 * 1024)
+
+enum media_kind {
+  MEDIA_FRAME,
+  MEDIA_PACKET,
+  MEDIA_SUBTITLE,
+  MEDIA_KINDS
+};
+
+// Report the new data size of a value, given the size already reported
+void account_media_bytes(enum media_kind kind, size_t * accounted, size_t size);
+
+
 /***** AVFrame *****/
 
 #define Frame_val(v) (*(struct AVFrame**)Data_custom_val(v))
 
+// Report the data size of a frame value, once filled
+void account_frame_value(value v);
+
 void value_of_frame(AVFrame *frame, value * pvalue);
 
 AVFrame * alloc_frame_value(value * pvalue);
 
 
+/***** AVFrame pool *****/
+
+typedef struct frame_pool_t frame_pool_t;
+
+frame_pool_t * frame_pool_create(int size);
+
+// The pool is freed once the frames it provided are collected; must be
+// called with the runtime lock held, like the other pool functions
+void frame_pool_close(frame_pool_t * pool);
+
+// Wrap a frame of the pool if any, or a new one, in a new frame value
+AVFrame * alloc_pooled_frame_value(frame_pool_t * pool, value * pvalue);
+
+// Give the frame of a pooled frame value back to the pool, leaving the
+// value empty, other frames are left as is
+void frame_pool_release_value(value v);
+
+
 /***** AVSubtitle *****/
 #define Subtitle_val(v) (*(struct AVSubtitle**)Data_custom_val(v))
 
+// Report the data size of a subtitle value, once filled
+void account_subtitle_value(value v);
+
 void value_of_subtitle(AVSubtitle *subtitle, value * pvalue);
 
 AVSubtitle * alloc_subtitle_value(value * pvalue);
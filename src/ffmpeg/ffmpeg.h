@@ -25,3 +25,5 @@ void set_codec_option(AVDictionary **ptr_codec_opts, const char *key, const char
 void set_format_option(AVDictionary **ptr_format_opts, const char *key, const char *value, int is_output);
 
 extern const AVIOInterruptCB int_cb;
+
+AVFormatContext * open_video_stream(const char *filename, int video_index, AVStream **pst);
@@ -1,13 +1,68 @@
+module Route : sig
+
+  type t = {
+    input      : string ;
+    pane       : int ;
+    start_time : float ;
+    end_time   : float ;
+    origin     : float ;
+    slope      : float ;
+  }
+
+  val make : string -> int -> float * float -> float * float -> t
+
+end = struct
+
+  (* the frames of the input stream (such as "0:v:0") whose pts fall in
+   * [start_time,end_time[ are sent to the pad, with their pts mapped to
+   * origin + (pts - start_time) * slope (all in seconds); the routes of a
+   * pane must not overlap *)
+  type t = {
+    input      : string ;
+    pane       : int ;
+    start_time : float ;
+    end_time   : float ;
+    origin     : float ;
+    slope      : float ;
+  }
+
+  (* the route mapping [x0,x1[ to [y0,y1[ *)
+  let make input pane (x0,y0) (x1,y1) =
+    {
+      input ;
+      pane ;
+      start_time = x0 ;
+      end_time = x1 ;
+      origin = y0 ;
+      slope =
+        if x1 = infinity then 1.
+        else (y1 -. y0) /. (x1 -. x0) ;
+    }
+
+end
+
 module File : sig
 
   type payload
   type 'a t = {
-    payload      : payload ;
-    eof          : bool ;
-    streams      : 'a array
+    payload           : payload ;
+    eof               : bool ;
+    threaded_decoding : bool ;
+    streams           : 'a array
+  }
+
+  type queue_stats = {
+    queued_packets       : int ;
+    queued_bytes         : int ;
+    queued_duration      : float ;
+    peak_queued_packets  : int ;
+    peak_queued_bytes    : int ;
+    peak_queued_duration : float ;
   }
 
-  val make : ?format_options:(string * string) array -> string -> 'a option t
+  val make : ?format_options:(string * string) array -> ?max_queued_packets:int -> ?max_queued_bytes:int -> ?max_queued_duration:float -> ?threaded_decoding:bool -> ?start_time:float -> string -> 'a option t
+
+  val seek : 'a t -> float -> unit
 
   val init_thread : 'a t -> unit
 
@@ -21,40 +76,74 @@ module File : sig
 
   val name : 'a t -> string
 
+  val blocked_times : 'a t -> int64 * int64 * int64
+
+  val queue_stats : 'a t -> queue_stats
+
 end = struct
 
   type payload
   type 'a t = {
-    payload      : payload ;
+    payload           : payload ;
   (*
     context      : avformat_context ;
    *)
-    eof          : bool ;
+    eof               : bool ;
     (* true if eof reached *)
+    threaded_decoding : bool ;
+    (* true if each stream is decoded in its own thread *)
   (*
     thread_queue : avthread_message_queue ;
     thread       : pthread_t ;
     (* thread reading from this file *)
-    non_blocking : bool ;
-    (* reading packets from the thread should not block *)
    *)
-    streams      : 'a array
+    streams           : 'a array
   }
 
-  external make_input_file : (string * string) array -> string -> payload * int = "make_input_file"
-  let make ?(format_options=[||]) filename =
+  type queue_stats = {
+    queued_packets       : int ;
+    queued_bytes         : int ;
+    queued_duration      : float ;
+    (* in seconds, summed over the packets of all streams *)
+    peak_queued_packets  : int ;
+    peak_queued_bytes    : int ;
+    peak_queued_duration : float ;
+  }
+
+  (* the packets read ahead by the thread are bounded in number, and
+   * optionally in combined size (in bytes) and summed duration (in
+   * seconds), 0 meaning unlimited for the latter two; the defaults keep
+   * the former fixed queue of 8 packets *)
+  external make_input_file : (string * string) array -> int -> int -> float -> string -> payload * int = "make_input_file"
+  external seek_input_file : payload -> float -> unit = "seek_input_file"
+  let make ?(format_options=[||]) ?(max_queued_packets=8) ?(max_queued_bytes=0) ?(max_queued_duration=0.) ?(threaded_decoding=false) ?start_time filename =
+    if max_queued_packets <= 0 then
+      invalid_arg "Input.File.make: max_queued_packets" ;
     let payload,nb_streams =
-      make_input_file format_options filename
+      make_input_file
+        format_options
+        max_queued_packets max_queued_bytes max_queued_duration
+        filename
     in
+    (* start reading at the keyframe before start_time (in seconds) *)
+    begin match start_time with
+      | Some start_time -> seek_input_file payload start_time
+      | None -> ()
+    end ;
     {
       payload ;
       eof = false ;
+      threaded_decoding ;
       streams = Array.make nb_streams None ;
     }
 
-  external init_input_thread : payload -> unit = "init_input_thread"
+  (* before the reading thread is started *)
+  let seek file start_time =
+    seek_input_file file.payload start_time
+
+  external init_input_thread : payload -> bool -> unit = "init_input_thread"
   let init_thread file =
-    init_input_thread file.payload
+    init_input_thread file.payload file.threaded_decoding
 
   external make_packet_from_file : payload -> Avutil.video Avcodec.Packet.t option = "make_packet_from_file"
   let get_packet file =
@@ -76,6 +165,16 @@ end = struct
   external input_file_name : payload -> string = "input_file_name"
   let name file = input_file_name file.payload
 
+  (* microseconds spent blocked by the reading thread waiting for a
+   * demuxer with no data,
+   * by the reading thread on a full queue, and by the main thread on an
+   * empty queue *)
+  external input_file_blocked_times : payload -> int64 * int64 * int64 = "input_file_blocked_times"
+  let blocked_times file = input_file_blocked_times file.payload
+
+  external input_file_queue_stats : payload -> queue_stats = "input_file_queue_stats"
+  let queue_stats file = input_file_queue_stats file.payload
+
 end
 
 let print_data_line header index name (nb_packets,data_size,nb_frames) =
@@ -89,18 +188,20 @@ module Stream : sig
   type payload
   type t = {
     payload    : payload ;
-    filter     : Avfilter.Input.t ;
-    pad        : Avfilter.Pad.t ;
+    filters    : (Avfilter.Input.t * Avfilter.Pad.t) list ;
+    start_time : float ;
     nb_packets : int64 ;
     data_size  : int64 ;
     nb_frames  : int64 ;
   }
 
-  val open_source_streams : Avfilter.Graph.t -> t option File.t -> Avfilter.Graph.t * t option File.t
+  val open_source_streams : ?routes:(string * Route.t) list -> Avfilter.Graph.t -> t option File.t array -> Avfilter.Graph.t * t option File.t array
 
-  val dump_mappings : t option File.t -> unit
+  val dump_mappings : int -> t option File.t -> unit
 
-  val seed_filters : t option File.t -> t option File.t
+  val init_decode_threads : ?max_queued_frames:int -> t option File.t -> unit
+
+  val seed_filters : t option File.t array -> t option File.t array
 
   val iteri : (int -> t -> unit) -> t option File.t -> unit
 
@@ -117,9 +218,12 @@ end = struct
   type payload
   type t = {
     payload    : payload ;
-    filter     : Avfilter.Input.t ;
-    pad        : Avfilter.Pad.t ;
-    (* filter input pad *)
+    filters    : (Avfilter.Input.t * Avfilter.Pad.t) list ;
+    (* buffer sources fed by the stream, and the filter input pads they
+     * are linked to *)
+    start_time : float ;
+    (* earliest time (in seconds) needed by the routes, neg_infinity if
+     * the stream feeds a pad directly *)
     nb_packets : int64 ;
     (* number of packets successfully read for this stream *)
     data_size  : int64 ;
@@ -150,64 +254,94 @@ end = struct
       file seed
 
   external make_input_stream : File.payload -> int -> (string * string) array -> payload = "make_input_stream"
-  external init_input_filter : File.payload -> int -> Avfilter.Graph.filters -> Avfilter.Pad.t -> Avfilter.Input.t = "init_input_filter"
-  let make file index ?(codec_options=[||]) filters pad =
+  external init_input_filter : File.payload -> int -> int -> Avfilter.Graph.filters -> Avfilter.Pad.t -> Route.t option -> Avfilter.Input.t = "init_input_filter_byte" "init_input_filter"
+  let make file file_index index ?(codec_options=[||]) () =
     let payload =
       make_input_stream
         file.File.payload
         index
         codec_options
     in
-    let filter =
-      init_input_filter
-        file.File.payload
-        index
-        filters pad
-    in
     {
       payload ;
-      filter ;
-      pad ;
+      filters = [] ;
+      start_time = infinity ;
       nb_packets = 0L ;
       data_size = 0L ;
       nb_frames = 0L ;
     }
 
-  external get_input_stream_index_from_filter : File.payload -> Avfilter.Pad.t -> int = "get_input_stream_index_from_filter"
-  let apply_on_stream f file pad =
-    let streams =
-      file.File.streams
-    and stream_index =
-      get_input_stream_index_from_filter
+  (* feed a filter input pad with the stream, through a route if any *)
+  let add_filter file file_index index filters pad route stream =
+    let filter =
+      init_input_filter
         file.File.payload
-        pad
+        file_index index
+        filters pad route
     in
-    streams.(stream_index) <-
-      f stream_index streams.(stream_index)
+    { stream with
+      filters = stream.filters @ [filter,pad] ;
+      start_time =
+        min stream.start_time
+          (match route with
+           | Some route -> route.Route.start_time
+           | None -> neg_infinity) ;
+    }
 
-  let open_source_stream file filters _i pad =
-    let aux index = function
-      | Some _ -> failwith "Input stream used twice"
-      | None ->
-        let stream =
+  external get_input_stream_index_from_filter : File.payload array -> Avfilter.Pad.t -> string -> int * int = "get_input_stream_index_from_filter"
+  let apply_on_stream f files pad name =
+    let file_index,stream_index =
+      get_input_stream_index_from_filter
+        (Array.map (fun file -> file.File.payload) files)
+        pad name
+    in
+    let streams =
+      files.(file_index).File.streams
+    in
+    streams.(stream_index) <-
+      f file_index stream_index streams.(stream_index)
+
+  (* a pad labelled after a route is fed through it, and the other pads
+   * are labelled after the stream feeding them directly; a stream may
+   * only feed several pads through routes *)
+  let open_source_stream routes files filters _i pad =
+    let route =
+      try Some (List.assoc (Avfilter.Pad.name pad) routes)
+      with Not_found -> None
+    in
+    let aux file_index index stream =
+      let stream =
+        match stream,route with
+        | Some stream,Some _
+          when List.for_all (fun (_filter,pad) ->
+              List.mem_assoc (Avfilter.Pad.name pad) routes) stream.filters ->
+          stream
+        | Some _,_ -> failwith "Input stream used twice"
+        | None,_ ->
           make
-            file index
+            files.(file_index) file_index index
             ~codec_options:[|
               (* AVOptions *)
               "threads", "auto" ;
             |]
-            filters pad
-        in
-        Some stream
+            ()
+      in
+      Some
+        (add_filter
+           files.(file_index) file_index index
+           filters pad route stream)
     in
     apply_on_stream
       aux
-      file pad
+      files pad
+      (match route with
+       | Some route -> route.Route.input
+       | None -> Avfilter.Pad.name pad)
 
-  let open_source_streams filter_graph file =
+  let open_source_streams ?(routes=[]) filter_graph files =
     Avfilter.Graph.iteri_inputs
-      (open_source_stream file) filter_graph ;
-    filter_graph,file
+      (open_source_stream routes files) filter_graph ;
+    filter_graph,files
 
   external media_type_of_input_stream : payload -> string = "media_type_of_input_stream"
   let media_type stream =
@@ -218,27 +352,38 @@ end = struct
     name_of_input_stream stream.payload
 
   (* print detailed information about the stream mapping *)
-  let dump_mappings file =
+  let dump_mappings file_index file =
     Printf.printf "Input stream mapping:\n" ;
     let aux i stream =
-      Printf.printf "  Stream #%d[%s] (%s) -> %s\n"
-        i
-        (Avfilter.Pad.name stream.pad)
-        (name stream)
-        (Avfilter.Input.name stream.filter)
+      List.iter
+        (fun (filter,pad) ->
+           Printf.printf "  Stream #%d:%d[%s] (%s) -> %s\n"
+             file_index i
+             (Avfilter.Pad.name pad)
+             (name stream)
+             (Avfilter.Input.name filter))
+        stream.filters
     in
     iteri aux file
 
+  (* the most starved buffer source fed by the stream *)
   let get_nb_failed_requests file stream =
     if file.File.eof then None
     else
-      let filter = stream.filter in
-      Some (Avfilter.Input.get_nb_failed_requests filter, filter)
+      let aux best_choice (filter,_pad) =
+        let nb_requests =
+          Avfilter.Input.get_nb_failed_requests filter
+        in
+        match best_choice with
+        | Some (nb_requests_max,_) when nb_requests_max>=nb_requests -> best_choice
+        | _ -> Some (nb_requests,filter)
+      in
+      List.fold_left aux None stream.filters
 
   external send_packet : payload -> Avutil.video Avcodec.Packet.t option -> [`Again|`Ok|`End_of_file] = "send_packet"
 
   external receive_frame : payload -> (Avutil.video Avutil.frame,[`Again|`End_of_file]) result = "receive_frame"
-  external filter_frame : File.payload -> int -> payload -> Avfilter.Input.t -> Avutil.video Avutil.frame -> unit = "filter_frame"
+  external filter_frame : File.payload -> int -> payload -> Avutil.video Avutil.frame -> unit = "filter_frame"
   let receive_and_filter_frame file i stream =
     match receive_frame stream.payload with
     | Ok frame ->
@@ -249,7 +394,7 @@ end = struct
       in
       filter_frame
         file.File.payload i
-        stream.payload stream.filter
+        stream.payload
         frame ;
       `Ok,stream
     | Error `Again -> `Again,stream
@@ -330,7 +475,7 @@ end = struct
                    Int64.succ stream.nb_packets ;
                }
 
-  external flush_input_stream : File.payload -> int -> payload -> Avfilter.Input.t -> unit = "flush_input_stream"
+  external flush_input_stream : File.payload -> int -> payload -> unit = "flush_input_stream"
   let flush_input_stream file i stream =
     match send_packet stream.payload None with
     | `Ok ->
@@ -340,8 +485,7 @@ end = struct
         | `End_of_file,stream ->
           flush_input_stream
             file.File.payload i
-            stream.payload
-            stream.filter ;
+            stream.payload ;
           stream
       end
     | _ -> assert false
@@ -363,29 +507,73 @@ end = struct
     | None ->
       flush_input_file file
 
-  (* receive and process a packet, or flush the input if EOF *)
-  let seed_filters file =
+  (* start one decoding thread per opened stream, before the reading
+   * thread dispatches packets to them; each thread queues at most
+   * max_queued_frames decoded frames *)
+  external init_decode_thread : payload -> int -> unit = "init_decode_thread"
+  let init_decode_threads ?(max_queued_frames=8) file =
+    if max_queued_frames <= 0 then
+      invalid_arg "Input.Stream.init_decode_threads: max_queued_frames" ;
+    iteri (fun _i stream -> init_decode_thread stream.payload max_queued_frames) file
+
+  external input_stream_stats : payload -> int64 * int64 * int64 = "input_stream_stats"
+  let update_stream_stats stream =
+    let nb_packets,data_size,nb_frames =
+      input_stream_stats stream.payload
+    in
+    { stream with
+      nb_packets ;
+      data_size ;
+      nb_frames ;
+    }
+
+  (* send the frames decoded so far by the threads of the file to the
+   * filter graph, waiting for some if none is ready, or mark the file as
+   * EOF once all its decoders have been flushed *)
+  external seed_filters_from_decoders : File.payload -> bool = "seed_filters_from_decoders"
+  let seed_filters_from_decoders file =
+    let eof =
+      seed_filters_from_decoders file.File.payload
+    in
+    let file =
+      mapi (fun _i stream -> update_stream_stats stream) file
+    in
+    { file with
+      File.eof ;
+    }
+
+  (* receive and process a packet from the file feeding the most
+   * starved source buffer, or flush that file if EOF *)
+  let seed_filters files =
     match
-      let aux stream best_choice =
-        match
-          get_nb_failed_requests file stream
-        with
-        | None -> best_choice
-        | Some (nb_requests,filter) ->
-          match best_choice with
-          | Some (nb_requests_max,_)
-            when nb_requests_max>=nb_requests -> best_choice
-          | _ -> Some (nb_requests,filter)
+      let aux (file_index,best_choice) file =
+        let aux stream best_choice =
+          match
+            get_nb_failed_requests file stream
+          with
+          | None -> best_choice
+          | Some (nb_requests,_filter) ->
+            match best_choice with
+            | Some (nb_requests_max,_)
+              when nb_requests_max>=nb_requests -> best_choice
+            | _ -> Some (nb_requests,file_index)
+        in
+        succ file_index,fold aux file best_choice
       in
-      fold aux file None
+      snd @@ Array.fold_left aux (0,None) files
     with
     | None ->
       Printf.eprintf
         "Unexpected AVERROR_EOF an all inputs while the graph still requires data.\n" ;
       exit 1
-    | Some (_nb_requests_max,_most_needed_filter) ->
-      (* XXX pick the right file *)
-      seed_filters_from_file file
+    | Some (_nb_requests_max,file_index) ->
+      let files = Array.copy files in
+      let file = files.(file_index) in
+      files.(file_index) <-
+        if file.File.threaded_decoding
+        then seed_filters_from_decoders file
+        else seed_filters_from_file file ;
+      files
 
   let print_stream_stats index stream =
     print_data_line
@@ -398,20 +586,71 @@ end = struct
 
 end
 
-let load_path filter_graph path =
-  File.make path
-  |> Stream.open_source_streams filter_graph
-
-let init file =
-  File.init_thread file ;
-  Stream.dump_mappings file
-
-let print_file_stats file =
-  (0L,0L,0L) |> Stream.fold
-    (fun stream (accum_nb_packets,accum_data_size,accum_nb_frames) ->
-       Int64.add accum_nb_packets stream.Stream.nb_packets,
-       Int64.add accum_data_size stream.Stream.data_size,
-       Int64.add accum_nb_frames stream.Stream.nb_frames)
-    file
-  |> (print_data_line "Input file" (-1) (File.name file)) ;
-  Stream.iteri Stream.print_stream_stats file
+(* start reading a file at the keyframe before the earliest time its
+ * routes need, unless start_time was given and is later *)
+let seek_to_routes ?start_time file =
+  let earliest_time =
+    Stream.fold
+      (fun stream earliest_time -> min stream.Stream.start_time earliest_time)
+      file infinity
+  in
+  match start_time with
+  | Some start_time when start_time >= earliest_time -> ()
+  | _ ->
+    if earliest_time > 0. && earliest_time < infinity then
+      File.seek file earliest_time
+
+(* the filter input pads labelled after a route are fed through it *)
+let load_paths ?max_queued_packets ?max_queued_bytes ?max_queued_duration ?threaded_decoding ?start_time ?routes filter_graph paths =
+  let filter_graph,files =
+    Array.of_list paths
+    |> Array.map
+      (fun path ->
+         File.make
+           ?max_queued_packets ?max_queued_bytes ?max_queued_duration
+           ?threaded_decoding ?start_time
+           path)
+    |> Stream.open_source_streams ?routes filter_graph
+  in
+  Array.iter (seek_to_routes ?start_time) files ;
+  filter_graph,files
+
+(* start one reader thread per input file, and with threaded decoding,
+ * one decoding thread per opened stream *)
+let init ?max_queued_frames files =
+  Array.iter
+    (fun file ->
+       if file.File.threaded_decoding then
+         Stream.init_decode_threads ?max_queued_frames file ;
+       File.init_thread file)
+    files ;
+  Array.iteri Stream.dump_mappings files
+
+let print_file_stats files =
+  let aux file_index file =
+    (0L,0L,0L) |> Stream.fold
+      (fun stream (accum_nb_packets,accum_data_size,accum_nb_frames) ->
+         Int64.add accum_nb_packets stream.Stream.nb_packets,
+         Int64.add accum_data_size stream.Stream.data_size,
+         Int64.add accum_nb_frames stream.Stream.nb_frames)
+      file
+    |> (print_data_line "Input file" file_index (File.name file)) ;
+    let read_time,send_time,recv_time = File.blocked_times file in
+    Format.printf
+      "  Reader thread blocked %Ldus waiting for the demuxer, %Ldus on a full queue; \
+       main thread blocked %Ldus on an empty queue; \n"
+      read_time send_time recv_time ;
+    let queue_stats = File.queue_stats file in
+    Format.printf
+      "  Reader queue peaked at %d packets, %d bytes, %.3fs; \n"
+      queue_stats.File.peak_queued_packets
+      queue_stats.File.peak_queued_bytes
+      queue_stats.File.peak_queued_duration ;
+    Stream.iteri Stream.print_stream_stats file
+  in
+  Array.iteri aux files
+
+(* pts of the keyframes of the n-th video stream of a file where it can
+ * be cut cleanly (leaving out the keyframes starting open GOPs), and its
+ * duration (in seconds) *)
+external probe_keyframes : string -> int -> float array * float = "probe_keyframes"
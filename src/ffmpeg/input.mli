@@ -1,3 +1,18 @@
+module Route : sig
+
+  type t = {
+    input      : string ;
+    pane       : int ;
+    start_time : float ;
+    end_time   : float ;
+    origin     : float ;
+    slope      : float ;
+  }
+
+  val make : string -> int -> float * float -> float * float -> t
+
+end
+
 module File : sig
 
   type 'a t
@@ -8,12 +23,14 @@ module Stream : sig
 
   type t
 
-  val seed_filters : t option File.t -> t option File.t
+  val seed_filters : t option File.t array -> t option File.t array
 
 end
 
-val load_path : Avfilter.Graph.t -> string -> Avfilter.Graph.t * Stream.t option File.t
+val load_paths : ?max_queued_packets:int -> ?max_queued_bytes:int -> ?max_queued_duration:float -> ?threaded_decoding:bool -> ?start_time:float -> ?routes:(string * Route.t) list -> Avfilter.Graph.t -> string list -> Avfilter.Graph.t * Stream.t option File.t array
+
+val init : ?max_queued_frames:int -> Stream.t option File.t array -> unit
 
-val init : Stream.t option File.t -> unit
+val print_file_stats : Stream.t option File.t array -> unit
 
-val print_file_stats : Stream.t option File.t -> unit
+val probe_keyframes : string -> int -> float array * float
@@ -11,6 +11,8 @@
 
 #include <libavutil/time.h>
 
+#include <caml/threads.h>
+
 
 /***** Input file *****/
 
@@ -31,6 +33,12 @@ static void free_input_thread(InputFile *input_file)
 
   if (!input_file || !input_file->in_thread_queue)
     return;
+  /* cause a blocking read, or a wait for the read-ahead budget, to be
+   * interrupted */
+  atomic_store(&input_file->interrupted, 1);
+  pthread_mutex_lock(&input_file->queue_lock);
+  pthread_cond_broadcast(&input_file->queue_cond);
+  pthread_mutex_unlock(&input_file->queue_lock);
   /* cause the input thread to stop and to set AVERROR_EOF to be
    * received */
   av_thread_message_queue_set_err_send(input_file->in_thread_queue, AVERROR_EOF);
@@ -44,8 +52,15 @@ static void free_input_thread(InputFile *input_file)
 void free_input_file(InputFile *input_file)
 {
   free_input_thread(input_file);
+  account_media_bytes(MEDIA_PACKET, &input_file->gc_queued_bytes, 0);
   avformat_close_input(&input_file->ctx);
 
+  pthread_cond_destroy(&input_file->frame_cond);
+  pthread_mutex_destroy(&input_file->frame_lock);
+  pthread_mutex_destroy(&input_file->streams_lock);
+  av_freep(&input_file->streams);
+  pthread_cond_destroy(&input_file->queue_cond);
+  pthread_mutex_destroy(&input_file->queue_lock);
   av_freep(&input_file);
 }
 
@@ -80,12 +95,29 @@ static InputFile * alloc_input_file(value *pvalue)
 
   if (!(input_file = av_mallocz(sizeof(*input_file))))
     Raise (EXN_FAILURE, "failed to allocate input_file");
+  pthread_mutex_init(&input_file->queue_lock, NULL);
+  pthread_cond_init(&input_file->queue_cond, NULL);
+  pthread_mutex_init(&input_file->streams_lock, NULL);
+  pthread_mutex_init(&input_file->frame_lock, NULL);
+  pthread_cond_init(&input_file->frame_cond, NULL);
 
   alloc_input_file_value(input_file, pvalue);
   return input_file;
 }
 
-AVFormatContext * setup_input_context(AVDictionary *format_options,
+/* abort blocking I/O once the thread reading the file is asked to stop */
+static int input_interrupt_cb(void *ctx)
+{
+  InputFile *input_file = ctx;
+
+  return atomic_load(&input_file->interrupted);
+}
+
+/* the demuxer is left in blocking mode: packets are read from a
+ * dedicated thread, which should sleep in the protocol layer until data
+ * is available rather than poll it */
+AVFormatContext * setup_input_context(InputFile *input_file,
+    AVDictionary *format_options,
     const char *ifilename)
 {
   int ret;
@@ -97,8 +129,8 @@ AVFormatContext * setup_input_context(AVDictionary *format_options,
     exit(1);
   }
   ctx->video_codec_id     = AV_CODEC_ID_NONE;
-  ctx->flags             |= AVFMT_FLAG_NONBLOCK;
-  ctx->interrupt_callback = int_cb;
+  ctx->interrupt_callback =
+    (AVIOInterruptCB){ input_interrupt_cb, input_file };
 
   /* open the input file with generic avformat function,
    * get back unused format options */
@@ -125,9 +157,13 @@ AVFormatContext * setup_input_context(AVDictionary *format_options,
 }
 
 CAMLprim value make_input_file(value _format_options,
+    value _max_queued_packets,
+    value _max_queued_bytes,
+    value _max_queued_duration,
     value _ifilename)
 {
-  CAMLparam2(_format_options, _ifilename);
+  CAMLparam5(_format_options, _max_queued_packets,
+      _max_queued_bytes, _max_queued_duration, _ifilename);
   CAMLlocal3(ans, pair, _input_file);
 
   int i;
@@ -144,8 +180,19 @@ CAMLprim value make_input_file(value _format_options,
         String_val(Field(pair, 1)), 0);
   }
 
+  input_file->max_queued_packets = Int_val(_max_queued_packets);
+  input_file->max_queued_bytes = Int_val(_max_queued_bytes);
+  input_file->max_queued_duration =
+    (int64_t)(Double_val(_max_queued_duration) * AV_TIME_BASE);
+
   input_file->ctx =
-    setup_input_context(format_options, ifilename);
+    setup_input_context(input_file, format_options, ifilename);
+
+  input_file->nb_streams = input_file->ctx->nb_streams;
+  if (!(input_file->streams =
+        av_mallocz_array(input_file->nb_streams,
+          sizeof(*input_file->streams))))
+    Raise (EXN_FAILURE, "failed to allocate input streams");
 
   /* fail if there are format options left */
   assert_empty_avoptions(format_options);
@@ -158,34 +205,223 @@ CAMLprim value make_input_file(value _format_options,
   CAMLreturn(ans);
 }
 
-/* read packets and send them in the thread queue, until an error
- * (including AVERROR_EOF but not AVERROR(EAGAIN)) is raised and set to
- * be received on the thread queue */
+/* duration of a packet in AV_TIME_BASE units, as accounted for in the
+ * read-ahead budget */
+static int64_t queued_packet_duration(InputFile *input_file, AVPacket *pkt)
+{
+  AVStream *st;
+
+  if (pkt->duration <= 0 ||
+      pkt->stream_index >= input_file->ctx->nb_streams)
+    return 0;
+  st = input_file->ctx->streams[pkt->stream_index];
+
+  return av_rescale_q(pkt->duration, st->time_base, AV_TIME_BASE_Q);
+}
+
+static int queue_is_over_budget(InputFile *input_file, AVPacket *pkt)
+{
+  /* always let a packet through an empty queue, however large */
+  if (!input_file->nb_queued_packets)
+    return 0;
+
+  return input_file->nb_queued_packets >= input_file->max_queued_packets ||
+    (input_file->max_queued_bytes &&
+     input_file->queued_bytes + pkt->size > input_file->max_queued_bytes) ||
+    (input_file->max_queued_duration &&
+     input_file->queued_duration >= input_file->max_queued_duration);
+}
+
+/* wait until a packet fits in the read-ahead budget, and account for it;
+ * return 0 if the thread was asked to stop instead */
+static int reserve_queued_packet(InputFile *input_file, AVPacket *pkt)
+{
+  int64_t start = 0;
+  int ret;
+
+  pthread_mutex_lock(&input_file->queue_lock);
+  while (!atomic_load(&input_file->interrupted) &&
+      queue_is_over_budget(input_file, pkt)) {
+    if (!start)
+      start = av_gettime_relative();
+    pthread_cond_wait(&input_file->queue_cond, &input_file->queue_lock);
+  }
+
+  if ((ret = !atomic_load(&input_file->interrupted))) {
+    input_file->nb_queued_packets++;
+    input_file->queued_bytes += pkt->size;
+    input_file->queued_duration +=
+      queued_packet_duration(input_file, pkt);
+
+    input_file->peak_queued_packets =
+      FFMAX(input_file->peak_queued_packets, input_file->nb_queued_packets);
+    input_file->peak_queued_bytes =
+      FFMAX(input_file->peak_queued_bytes, input_file->queued_bytes);
+    input_file->peak_queued_duration =
+      FFMAX(input_file->peak_queued_duration, input_file->queued_duration);
+  }
+  pthread_mutex_unlock(&input_file->queue_lock);
+
+  /* only count the time the queue was full */
+  if (start)
+    atomic_fetch_add(&input_file->send_blocked_time,
+        av_gettime_relative() - start);
+
+  return ret;
+}
+
+/* account for a packet leaving the queue, and wake the reading thread */
+static void release_queued_packet(InputFile *input_file, AVPacket *pkt)
+{
+  pthread_mutex_lock(&input_file->queue_lock);
+  input_file->nb_queued_packets--;
+  input_file->queued_bytes -= pkt->size;
+  input_file->queued_duration -=
+    queued_packet_duration(input_file, pkt);
+  pthread_cond_signal(&input_file->queue_cond);
+  pthread_mutex_unlock(&input_file->queue_lock);
+}
+
+/* report the packets read ahead to the GC as they are queued and
+ * released; must be called with the runtime lock held */
+static void account_queued_packets(InputFile *input_file)
+{
+  int64_t bytes;
+
+  pthread_mutex_lock(&input_file->queue_lock);
+  bytes = input_file->queued_bytes;
+  pthread_mutex_unlock(&input_file->queue_lock);
+
+  account_media_bytes(MEDIA_PACKET, &input_file->gc_queued_bytes, bytes);
+}
+
+/* the opened stream a packet belongs to, if it is decoded in its own
+ * thread; must be called with streams_lock held */
+static InputStream * get_decoding_stream(InputFile *input_file,
+    AVPacket *pkt)
+{
+  InputStream *ist;
+
+  if (pkt->stream_index >= input_file->nb_streams)
+    return NULL;
+  ist = input_file->streams[pkt->stream_index];
+
+  return ist && ist->packet_queue ? ist : NULL;
+}
+
+/* set an error to be received by every decoding thread */
+static void set_decoding_streams_err(InputFile *input_file, int err)
+{
+  int i;
+
+  pthread_mutex_lock(&input_file->streams_lock);
+  for (i = 0; i < input_file->nb_streams; i++)
+    if (input_file->streams[i] && input_file->streams[i]->packet_queue)
+      av_thread_message_queue_set_err_recv(input_file->streams[i]->packet_queue, err);
+  pthread_mutex_unlock(&input_file->streams_lock);
+}
+
+/* send a packet to the decoding thread of its stream, dropping it if the
+ * stream is not opened (anymore); the packet queues are as deep as the
+ * read-ahead budget, which the packet was reserved in, so the send never
+ * has to wait, and streams_lock is never held for long */
+static void dispatch_packet(InputFile *input_file, AVPacket *pkt)
+{
+  InputStream *ist;
+  int ret = AVERROR_EOF;
+
+  pthread_mutex_lock(&input_file->streams_lock);
+  if ((ist = get_decoding_stream(input_file, pkt)))
+    ret = av_thread_message_queue_send(ist->packet_queue, pkt,
+        AV_THREAD_MESSAGE_NONBLOCK);
+  pthread_mutex_unlock(&input_file->streams_lock);
+
+  if (ret < 0) {
+    release_queued_packet(input_file, pkt);
+    av_packet_unref(pkt);
+  }
+}
+
+/* longest wait (in microseconds) before a demuxer unable to block is
+ * asked again for a packet */
+#define MAX_DEMUXER_RETRY_DELAY 10000
+
+/* wait for a demuxer that answered EAGAIN: it has no descriptor to wait
+ * on, so sleep on the queue condition, which free_input_thread signals,
+ * for at most delay microseconds */
+static void wait_for_demuxer(InputFile *input_file, int64_t delay)
+{
+  int64_t deadline = av_gettime() + delay;
+  struct timespec ts = {
+    .tv_sec = deadline / 1000000,
+    .tv_nsec = (deadline % 1000000) * 1000
+  };
+
+  pthread_mutex_lock(&input_file->queue_lock);
+  if (!atomic_load(&input_file->interrupted))
+    pthread_cond_timedwait(&input_file->queue_cond,
+        &input_file->queue_lock, &ts);
+  pthread_mutex_unlock(&input_file->queue_lock);
+}
+
+/* read packets and send them in the thread queue (or to the decoding
+ * threads), until an error (including AVERROR_EOF but not
+ * AVERROR(EAGAIN)) is raised and set to be received on the thread queue */
 static void *input_thread(void *arg)
 {
     InputFile *input_file = arg;
     int ret;
     AVPacket pkt;
+    int64_t start, delay;
+    int is_decoded;
 
     while (1) {
         /* wait for a packet to be read, or an error to be raised */
-        while ((ret = av_read_frame(input_file->ctx, &pkt)) == AVERROR(EAGAIN)) {
-            av_usleep(10000);
+        delay = 1000;
+        while ((ret = av_read_frame(input_file->ctx, &pkt)) == AVERROR(EAGAIN) &&
+            !atomic_load(&input_file->interrupted)) {
+            /* only demuxers unable to block get there */
+            start = av_gettime_relative();
+            wait_for_demuxer(input_file, delay);
+            delay = FFMIN(2 * delay, MAX_DEMUXER_RETRY_DELAY);
+            atomic_fetch_add(&input_file->read_blocked_time,
+                av_gettime_relative() - start);
         }
         /* set any error (but AVERROR(EAGAIN)) to be received */
         if (ret < 0) {
+            ret = ret == AVERROR(EAGAIN) ? AVERROR_EOF : ret;
             av_thread_message_queue_set_err_recv(input_file->in_thread_queue, ret);
+            set_decoding_streams_err(input_file, ret);
             break;
         }
 
-        /* wait for a packet to be sent, or an error to be raised */
-        if (input_file->non_blocking) {
-            while ((ret = av_thread_message_queue_send(input_file->in_thread_queue, &pkt, AV_THREAD_MESSAGE_NONBLOCK)) == AVERROR(EAGAIN)) {
-                av_usleep(10000);
+        if (input_file->threaded_decoding) {
+            /* don't hold the budget with packets nobody decodes */
+            pthread_mutex_lock(&input_file->streams_lock);
+            is_decoded = get_decoding_stream(input_file, &pkt) != NULL;
+            pthread_mutex_unlock(&input_file->streams_lock);
+            if (!is_decoded) {
+                av_packet_unref(&pkt);
+                continue;
             }
-        } else {
-            ret = av_thread_message_queue_send(input_file->in_thread_queue, &pkt, 0);
         }
+
+        /* wait for the packet to fit in the read-ahead budget */
+        if (!reserve_queued_packet(input_file, &pkt)) {
+            av_packet_unref(&pkt);
+            av_thread_message_queue_set_err_recv(input_file->in_thread_queue, AVERROR_EOF);
+            set_decoding_streams_err(input_file, AVERROR_EOF);
+            break;
+        }
+
+        if (input_file->threaded_decoding) {
+            dispatch_packet(input_file, &pkt);
+            continue;
+        }
+
+        /* send the packet, or wait for an error to be raised (the budget
+         * never lets more packets in than the queue can hold) */
+        ret = av_thread_message_queue_send(input_file->in_thread_queue, &pkt, 0);
         /* set any error (but AVERROR(EAGAIN)) to be received */
         if (ret < 0) {
             if (ret != AVERROR_EOF)
@@ -201,17 +437,20 @@ static void *input_thread(void *arg)
     return NULL;
 }
 
-/* allocate a new message queue and create a thread */
-CAMLprim value init_input_thread(value _input_file)
+/* allocate a new message queue and create a thread; with threaded
+ * decoding, the decoding threads must have been created beforehand */
+CAMLprim value init_input_thread(value _input_file,
+    value _threaded_decoding)
 {
-  CAMLparam1(_input_file);
+  CAMLparam2(_input_file, _threaded_decoding);
 
   int ret;
   InputFile *input_file = InputFile_val(_input_file);
 
-  if (!input_file->ctx->pb->seekable)
-    input_file->non_blocking = 1;
-  if ((ret = av_thread_message_queue_alloc(&input_file->in_thread_queue, 8, sizeof(AVPacket))) < 0) {
+  input_file->threaded_decoding = Bool_val(_threaded_decoding);
+
+  if ((ret = av_thread_message_queue_alloc(&input_file->in_thread_queue,
+          input_file->max_queued_packets, sizeof(AVPacket))) < 0) {
     av_log(NULL, AV_LOG_FATAL,
         "Unexpected error while allocate a new message queue: %s\n",
         av_err2str(ret));
@@ -234,6 +473,188 @@ CAMLprim value init_input_thread(value _input_file)
   CAMLreturn(Val_unit);
 }
 
+/* current occupancy of the thread queue, and its high-water marks */
+CAMLprim value input_file_queue_stats(value _input_file)
+{
+  CAMLparam1(_input_file);
+  CAMLlocal1(ans);
+
+  InputFile *input_file = InputFile_val(_input_file);
+  int nb_packets, peak_nb_packets;
+  int64_t bytes, peak_bytes, duration, peak_duration;
+
+  pthread_mutex_lock(&input_file->queue_lock);
+  nb_packets = input_file->nb_queued_packets;
+  peak_nb_packets = input_file->peak_queued_packets;
+  bytes = input_file->queued_bytes;
+  peak_bytes = input_file->peak_queued_bytes;
+  duration = input_file->queued_duration;
+  peak_duration = input_file->peak_queued_duration;
+  pthread_mutex_unlock(&input_file->queue_lock);
+
+  ans = caml_alloc_tuple(6);
+  Store_field(ans, 0, Val_int(nb_packets));
+  Store_field(ans, 1, Val_int(bytes));
+  Store_field(ans, 2, caml_copy_double((double)duration / AV_TIME_BASE));
+  Store_field(ans, 3, Val_int(peak_nb_packets));
+  Store_field(ans, 4, Val_int(peak_bytes));
+  Store_field(ans, 5, caml_copy_double((double)peak_duration / AV_TIME_BASE));
+
+  CAMLreturn(ans);
+}
+
+/* start reading at the last keyframe before start_time (in seconds, in
+ * the timeline of the file); must be called before the thread is created */
+CAMLprim value seek_input_file(value _input_file,
+    value _start_time)
+{
+  CAMLparam2(_input_file, _start_time);
+
+  int ret;
+  InputFile *input_file = InputFile_val(_input_file);
+  AVFormatContext *ctx = input_file->ctx;
+  int64_t timestamp =
+    (int64_t)(Double_val(_start_time) * AV_TIME_BASE);
+
+  if ((ret = avformat_seek_file(ctx, -1, INT64_MIN,
+          timestamp, timestamp, 0)) < 0) {
+    av_log(NULL, AV_LOG_FATAL,
+        "Could not seek %s to %f: %s\n",
+        ctx->url, Double_val(_start_time), av_err2str(ret));
+    exit(1);
+  }
+
+  CAMLreturn(Val_unit);
+}
+
+/* whether a keyframe starts an open GOP, the packet that follows it in
+ * decoding order being displayed before it: the pictures before the
+ * keyframe then depend on the previous GOP */
+static int is_open_gop(int64_t keyframe_pts, AVPacket *next_pkt)
+{
+  return next_pkt->pts != AV_NOPTS_VALUE && next_pkt->pts < keyframe_pts;
+}
+
+/* pts (in seconds, in the timeline of the file) of the keyframes of a
+ * video stream of a file where it can be cut cleanly, and the duration of
+ * the file. Keyframes starting an open GOP are left out: the pictures
+ * decoded after them and displayed before them would be lost on both
+ * sides of a cut.
+ * The index of the demuxer is used to find the keyframes if there is one,
+ * the packets are read otherwise. Index timestamps may be dts (as in
+ * MOV/MP4), which differ from the pts when B-frames are reordered, so the
+ * pts of each indexed keyframe is read from its packet, seeking to it
+ * through the index. */
+CAMLprim value probe_keyframes(value _ifilename,
+    value _video_index)
+{
+  CAMLparam2(_ifilename, _video_index);
+  CAMLlocal2(ans, _keyframes);
+
+  int ret, i, nb_keyframes = 0, nb_clean_keyframes, is_open, is_next = 0;
+  int64_t *keyframes = NULL;
+  AVStream *st;
+  AVPacket pkt;
+  AVFormatContext *ctx =
+    open_video_stream(String_val(_ifilename), Int_val(_video_index), &st);
+
+  if (!(keyframes = av_malloc_array(FFMAX(st->nb_index_entries, 1),
+          sizeof(*keyframes))))
+    Raise (EXN_FAILURE, "failed to allocate keyframes");
+
+  if (st->nb_index_entries) {
+    /* reading packets may add index entries */
+    for (i = 0; i < st->nb_index_entries; i++)
+      if (st->index_entries[i].flags & AVINDEX_KEYFRAME)
+        keyframes[nb_keyframes++] = st->index_entries[i].timestamp;
+
+    for (i = 0, nb_clean_keyframes = 0; i < nb_keyframes; i++) {
+      if (av_seek_frame(ctx, st->index, keyframes[i],
+            AVSEEK_FLAG_BACKWARD) < 0)
+        continue;
+      /* the other streams are discarded; make sure the packet is the
+       * indexed keyframe, whichever of its timestamps the index holds */
+      if ((ret = av_read_frame(ctx, &pkt)) < 0)
+        continue;
+      if (!(pkt.flags & AV_PKT_FLAG_KEY) || pkt.pts == AV_NOPTS_VALUE ||
+          (pkt.dts != keyframes[i] && pkt.pts != keyframes[i])) {
+        av_packet_unref(&pkt);
+        continue;
+      }
+      keyframes[nb_clean_keyframes] = pkt.pts;
+      av_packet_unref(&pkt);
+
+      if ((ret = av_read_frame(ctx, &pkt)) >= 0) {
+        is_open = is_open_gop(keyframes[nb_clean_keyframes], &pkt);
+        av_packet_unref(&pkt);
+        if (is_open)
+          continue;
+      }
+      nb_clean_keyframes++;
+    }
+    nb_keyframes = nb_clean_keyframes;
+  } else {
+    while (av_read_frame(ctx, &pkt) >= 0) {
+      if (pkt.stream_index != st->index) {
+        av_packet_unref(&pkt);
+        continue;
+      }
+
+      /* check the packet following the last keyframe */
+      if (is_next && is_open_gop(keyframes[nb_keyframes-1], &pkt))
+        nb_keyframes--;
+      is_next = 0;
+
+      if (pkt.flags & AV_PKT_FLAG_KEY &&
+          pkt.pts != AV_NOPTS_VALUE) {
+        if ((ret = av_reallocp_array(&keyframes, nb_keyframes + 1,
+                sizeof(*keyframes))) < 0)
+          Raise (EXN_FAILURE, "failed to allocate keyframes");
+        keyframes[nb_keyframes++] = pkt.pts;
+        is_next = 1;
+      }
+      av_packet_unref(&pkt);
+    }
+  }
+
+  _keyframes = caml_alloc(nb_keyframes * Double_wosize, Double_array_tag);
+  for (i = 0; i < nb_keyframes; i++)
+    Store_double_field(_keyframes, i,
+        keyframes[i] * av_q2d(st->time_base));
+
+  ans = caml_alloc_tuple(2);
+  Store_field(ans, 0, _keyframes);
+  Store_field(ans, 1, caml_copy_double(ctx->duration != AV_NOPTS_VALUE ?
+        (double)ctx->duration / AV_TIME_BASE : 0.));
+
+  av_freep(&keyframes);
+  avformat_close_input(&ctx);
+
+  CAMLreturn(ans);
+}
+
+/* time spent blocked by the reading thread (waiting for a demuxer with
+ * no data, and on a full queue), and by the main thread (on an empty
+ * queue) */
+CAMLprim value input_file_blocked_times(value _input_file)
+{
+  CAMLparam1(_input_file);
+  CAMLlocal4(ans, _read, _send, _recv);
+
+  InputFile *input_file = InputFile_val(_input_file);
+
+  _read = caml_copy_int64(atomic_load(&input_file->read_blocked_time));
+  _send = caml_copy_int64(atomic_load(&input_file->send_blocked_time));
+  _recv = caml_copy_int64(input_file->recv_blocked_time);
+
+  ans = caml_alloc_tuple(3);
+  Store_field(ans, 0, _read);
+  Store_field(ans, 1, _send);
+  Store_field(ans, 2, _recv);
+
+  CAMLreturn(ans);
+}
+
 
 /***** Input stream *****/
 
@@ -257,9 +678,54 @@ CAMLprim value name_of_input_stream(value _input_stream)
   CAMLreturn(caml_copy_string(input_stream->dec_ctx->codec ? input_stream->dec_ctx->codec->name : "?"));
 }
 
+/* cause the decoding thread to stop */
+static void free_decode_thread(InputStream *input_stream)
+{
+  AVPacket pkt;
+  AVFrame *frame;
+
+  if (!input_stream->packet_queue)
+    return;
+  /* cause the reading thread to drop packets for this stream, and the
+   * decoding thread to stop once it has no packet or can't queue a frame */
+  av_thread_message_queue_set_err_send(input_stream->packet_queue, AVERROR_EOF);
+  av_thread_message_queue_set_err_recv(input_stream->packet_queue, AVERROR_EOF);
+  av_thread_message_queue_set_err_send(input_stream->frame_queue, AVERROR_EOF);
+  while (av_thread_message_queue_recv(input_stream->frame_queue, &frame, AV_THREAD_MESSAGE_NONBLOCK) >= 0)
+    av_frame_free(&frame);
+
+  pthread_join(input_stream->thread, NULL);
+
+  while (av_thread_message_queue_recv(input_stream->packet_queue, &pkt, AV_THREAD_MESSAGE_NONBLOCK) >= 0)
+    av_packet_unref(&pkt);
+  while (av_thread_message_queue_recv(input_stream->frame_queue, &frame, AV_THREAD_MESSAGE_NONBLOCK) >= 0)
+    av_frame_free(&frame);
+  av_thread_message_queue_free(&input_stream->packet_queue);
+  av_thread_message_queue_free(&input_stream->frame_queue);
+}
+
 static void finalise_input_stream(value v)
 {
   InputStream *input_stream = InputStream_val(v);
+  InputFile *input_file = input_stream->input_file;
+
+  /* the reading thread holds the lock while it uses the stream, so it
+   * is done with its queues once the stream is unregistered */
+  if (input_file) {
+    pthread_mutex_lock(&input_file->streams_lock);
+    input_file->streams[input_stream->st->index] = NULL;
+    pthread_mutex_unlock(&input_file->streams_lock);
+  }
+
+  free_decode_thread(input_stream);
+
+  if (input_file)
+    caml_remove_generational_global_root(&input_stream->file_root);
+
+  /* the buffer sources belong to the filter graph */
+  av_freep(&input_stream->routes);
+  av_freep(&input_stream->pane_offsets);
+  av_freep(&input_stream->first_open);
 
   /* close decoders */
   avcodec_close(input_stream->dec_ctx);
@@ -410,6 +876,15 @@ CAMLprim value make_input_stream(value _input_file,
 
   input_stream->dec_ctx =
     setup_codec_context(codec_options, st);
+  input_stream->st = st;
+
+  /* register the stream, the file outliving it */
+  input_stream->input_file = input_file;
+  input_stream->file_root = _input_file;
+  caml_register_generational_global_root(&input_stream->file_root);
+  pthread_mutex_lock(&input_file->streams_lock);
+  input_file->streams[index] = input_stream;
+  pthread_mutex_unlock(&input_file->streams_lock);
 
   /* express the decoding offset in terms of AV_TIME_BASE_Q,
    * in case the first packets don't have valid dts fields */
@@ -422,23 +897,80 @@ CAMLprim value make_input_stream(value _input_file,
   CAMLreturn(_input_stream);
 }
 
-/* set up the Filter */
+/* convert a time in seconds to the time base, saturating at infinity */
+static int64_t seconds_to_ts(double seconds, AVRational time_base)
+{
+  if (seconds == INFINITY)
+    return INT64_MAX;
+  if (seconds == -INFINITY)
+    return INT64_MIN;
+  return llrint(seconds / av_q2d(time_base));
+}
+
+/* insert a route, keeping the routes sorted by pane then start, and
+ * recompute the pane offsets */
+static void add_input_route(InputStream *ist, InputRoute *route)
+{
+  int i, pane = 0;
+
+  if (!(ist->routes =
+        av_realloc_array(ist->routes, ist->nb_routes + 1, sizeof(*ist->routes))) ||
+      !(ist->pane_offsets =
+        av_realloc_array(ist->pane_offsets, ist->nb_routes + 2, sizeof(*ist->pane_offsets))) ||
+      !(ist->first_open =
+        av_realloc_array(ist->first_open, ist->nb_routes + 1, sizeof(*ist->first_open)))) {
+    av_log(NULL, AV_LOG_FATAL,
+        "Error allocating input routes.\n");
+    exit(1);
+  }
+
+  for (i = ist->nb_routes;
+      i > 0 && (ist->routes[i-1].pane > route->pane ||
+        (ist->routes[i-1].pane == route->pane && ist->routes[i-1].start > route->start));
+      i--)
+    ist->routes[i] = ist->routes[i-1];
+  ist->routes[i] = *route;
+  ist->nb_routes++;
+
+  for (i = 0, ist->nb_panes = 0; i < ist->nb_routes; i++) {
+    if (!i || ist->routes[i].pane != pane) {
+      ist->first_open[ist->nb_panes] = i;
+      ist->pane_offsets[ist->nb_panes++] = i;
+    }
+    pane = ist->routes[i].pane;
+  }
+  ist->pane_offsets[ist->nb_panes] = ist->nb_routes;
+
+  if (ist->nb_routes == 1 || route->start < ist->start)
+    ist->start = route->start;
+  if (ist->nb_routes == 1 || route->end > ist->end)
+    ist->end = route->end;
+}
+
+/* set up the Filter, fed through a route if one is given, and directly
+ * otherwise */
 CAMLprim value init_input_filter(value _input_file,
+    value _file_index,
     value _index,
     value _filter_graph,
-    value _in_filter)
+    value _in_filter,
+    value _route)
 {
-  CAMLparam4(_input_file, _index,
+  CAMLparam5(_input_file, _file_index, _index,
       _filter_graph, _in_filter);
+  CAMLxparam1(_route);
   CAMLlocal1(_input_filter);
 
   int ret;
   char name[255];
   Filter *ifilter;
   AVBufferSrcParameters *par;
+  InputRoute route;
   InputFile *input_file = InputFile_val(_input_file);
+  int file_index = Int_val(_file_index);
   int index = Int_val(_index);
   AVStream *st = input_file->ctx->streams[index];
+  InputStream *ist = input_file->streams[index];
   AVFilterGraph *filter_graph =
     FilterGraph_val(_filter_graph);
   AVFilterInOut *in =
@@ -447,14 +979,21 @@ CAMLprim value init_input_filter(value _input_file,
     in->filter_ctx, *out_filter_ctx;
   int pad_idx = in->pad_idx;
 
+  if (!ist) {
+    av_log(NULL, AV_LOG_FATAL,
+        "Input stream %d:%d not opened.\n",
+        file_index, index);
+    exit(1);
+  }
+
   ifilter = alloc_filter(&_input_filter);
 
   ifilter->name =
     describe_filter_link(in_filter_ctx, pad_idx, 1);
 
   {
-    snprintf(name, sizeof(name), "input stream %d:%d",
-        0, st->index);
+    snprintf(name, sizeof(name), "input stream %d:%d route %d",
+        file_index, st->index, ist->nb_routes);
 
     if (!(out_filter_ctx =
           avfilter_graph_alloc_filter(filter_graph,
@@ -503,9 +1042,40 @@ CAMLprim value init_input_filter(value _input_file,
     ifilter->filter_ctx = out_filter_ctx;
   }
 
+  /* a direct input gets a pane of its own, that all the frames go to */
+  route.filter_ctx = ifilter->filter_ctx;
+  if (Is_block(_route)) {
+    _route = Field(_route, 0);
+    route.pane   = Int_val(Field(_route, 1));
+    route.start  = seconds_to_ts(Double_val(Field(_route, 2)), st->time_base);
+    route.end    = seconds_to_ts(Double_val(Field(_route, 3)), st->time_base);
+    route.origin = seconds_to_ts(Double_val(Field(_route, 4)), st->time_base);
+    route.slope  = Double_val(Field(_route, 5));
+    if (route.start == INT64_MIN || route.start >= route.end) {
+      av_log(NULL, AV_LOG_FATAL,
+          "Invalid route for input stream %d:%d.\n",
+          file_index, st->index);
+      exit(1);
+    }
+  } else {
+    route.pane   = INT_MIN + ist->nb_routes;
+    route.start  = INT64_MIN;
+    route.end    = INT64_MAX;
+    route.origin = 0;
+    route.slope  = 1.;
+  }
+  route.closed = 0;
+  add_input_route(ist, &route);
+
   CAMLreturn(_input_filter);
 }
 
+CAMLprim value init_input_filter_byte(value *argv, int argn)
+{
+  return init_input_filter(argv[0], argv[1], argv[2],
+      argv[3], argv[4], argv[5]);
+}
+
 
 /***** Print *****/
 
@@ -518,13 +1088,23 @@ CAMLprim value make_packet_from_file(value _input_file)
   CAMLlocal2(ans, _pkt);
 
   int ret;
+  int64_t start;
   InputFile *input_file = InputFile_val(_input_file);
   AVPacket *pkt = alloc_packet_value(&_pkt);
+  AVThreadMessageQueue *queue = input_file->in_thread_queue;
+
+  /* sleep until the reading thread signals a packet or an error */
+  start = av_gettime_relative();
+  caml_release_runtime_system();
+  ret = av_thread_message_queue_recv(queue, pkt, 0);
+  caml_acquire_runtime_system();
+  input_file->recv_blocked_time +=
+    av_gettime_relative() - start;
 
-  switch (ret = av_thread_message_queue_recv(input_file->in_thread_queue, pkt,
-        input_file->non_blocking ?
-        AV_THREAD_MESSAGE_NONBLOCK : 0)) {
+  switch (ret) {
     case 0:
+      release_queued_packet(input_file, pkt);
+      account_packet_value(_pkt);
       ans = caml_alloc(1, 0);
       Store_field(ans, 0, _pkt);
 
@@ -543,12 +1123,24 @@ CAMLprim value make_packet_from_file(value _input_file)
       exit(1);
   }
 
+  account_queued_packets(input_file);
+
   CAMLreturn(ans);
 }
 
 
 /***** Input *****/
 
+/* don't decode the non-reference frames of packets that no route covers,
+ * as the frames that may depend on them will be dropped too */
+static void set_packet_skip_frame(InputStream *ist, AVPacket *pkt)
+{
+  ist->dec_ctx->skip_frame =
+    pkt && pkt->pts != AV_NOPTS_VALUE &&
+    (pkt->pts < ist->start || pkt->pts >= ist->end) ?
+    AVDISCARD_NONREF : AVDISCARD_DEFAULT;
+}
+
 /* send a packet to a decoder */
 CAMLprim value send_packet(value _input_stream,
     value _pkt)
@@ -561,6 +1153,8 @@ CAMLprim value send_packet(value _input_stream,
   AVPacket *pkt =
     Is_block(_pkt) ? Packet_val(Field(_pkt, 0)) : NULL;
 
+  set_packet_skip_frame(input_stream, pkt);
+
   switch (ret = avcodec_send_packet(input_stream->dec_ctx,
         pkt)) {
     case 0:
@@ -603,6 +1197,7 @@ CAMLprim value receive_frame(value _input_stream)
   switch (ret = avcodec_receive_frame(input_stream->dec_ctx,
         frame)) {
     case 0:
+      account_frame_value(_frame);
       ans = caml_alloc(1, 0);
       Store_field(ans, 0, _frame);
       break;
@@ -627,48 +1222,89 @@ CAMLprim value receive_frame(value _input_stream)
   CAMLreturn(ans);
 }
 
-/* add a frame to the buffer source */
-static void send_frame_to_filter(Filter *ifilter, AVFrame *frame)
+/* map a pts of the stream through a route */
+static int64_t route_pts(InputRoute *route, int64_t pts)
 {
-    int ret;
-
-    switch (ret = av_buffersrc_add_frame_flags(ifilter->filter_ctx, frame, AV_BUFFERSRC_FLAG_PUSH)) {
-    case 0:
-        break;
-
-    default:
-        av_log(NULL, AV_LOG_FATAL,
-            "Unexpected error while injecting frame into filter network: %s\n",
-            av_err2str(ret));
-        exit(1);
-    }
+  if (route->start == INT64_MIN)
+    return pts;
+  return route->origin + llrint((pts - route->start) * route->slope);
 }
 
-/* send a decoded_frame in the input filter
- * attached to the stream */
-static void send_frame_to_filters(InputStream *ist,
-    value _input_filter, AVFrame *frame)
+/* mark the buffer source of a route as finished, at pts clamped to the
+ * interval of the route */
+static void close_route(InputRoute *route, int64_t pts)
 {
-  Filter *input_filter;
-  input_filter = Filter_val(_input_filter);
-  send_frame_to_filter(input_filter, frame);
+  int ret;
+
+  switch (ret = av_buffersrc_close(route->filter_ctx,
+        route_pts(route, av_clip64(pts, route->start, route->end)),
+        AV_BUFFERSRC_FLAG_PUSH)) {
+  case 0:
+    break;
+
+  default:
+    av_log(NULL, AV_LOG_FATAL,
+        "Unexpected error while marking filters as finished %s\n",
+        av_err2str(ret));
+    exit(1);
+  }
+  route->closed = 1;
 }
 
-CAMLprim value filter_frame(value _input_file,
-    value _index,
-    value _input_stream,
-    value _input_filter, value _frame)
+/* send a decoded frame to the route covering its pts in each pane, if any,
+ * by binary search in the routes of the pane; the frame is left untouched.
+ * The routes the frame is past are closed, so that the graph doesn't wait
+ * for the end of the stream to finish them. Return the number of buffer
+ * sources fed. */
+static int route_frame(InputStream *ist, AVFrame *frame)
 {
-  CAMLparam5 (_input_file, _index,
-    _input_stream, _input_filter, _frame);
+  int i, lo, hi, mid, ret, nb_routed = 0;
+  int64_t pts = frame->pts;
+  InputRoute *route;
+
+  for (i = 0; i < ist->nb_panes; i++) {
+    /* the routes of a pane are disjoint, and thus sorted by end too */
+    hi = ist->pane_offsets[i+1];
+    while (ist->first_open[i] < hi &&
+        ist->routes[ist->first_open[i]].end <= pts) {
+      if (!ist->routes[ist->first_open[i]].closed)
+        close_route(&ist->routes[ist->first_open[i]], pts);
+      ist->first_open[i]++;
+    }
 
-  InputFile *input_file = InputFile_val(_input_file);
-  int index = Int_val(_index);
-  AVStream *st = input_file->ctx->streams[index];
-  InputStream *ist =
-    InputStream_val(_input_stream);
-  AVFrame *frame = Frame_val(_frame);
+    /* find the last route starting at or before pts */
+    lo = ist->pane_offsets[i];
+    while (hi - lo > 1) {
+      mid = lo + (hi - lo) / 2;
+      if (ist->routes[mid].start <= pts)
+        lo = mid;
+      else
+        hi = mid;
+    }
+    route = &ist->routes[lo];
+    if (route->closed || pts < route->start || pts >= route->end)
+      continue;
+
+    frame->pts = route_pts(route, pts);
+    ret = av_buffersrc_add_frame_flags(route->filter_ctx, frame,
+        AV_BUFFERSRC_FLAG_KEEP_REF | AV_BUFFERSRC_FLAG_PUSH);
+    frame->pts = pts;
+    if (ret < 0) {
+      av_log(NULL, AV_LOG_FATAL,
+          "Unexpected error while injecting frame into filter network: %s\n",
+          av_err2str(ret));
+      exit(1);
+    }
+    nb_routed++;
+  }
 
+  return nb_routed;
+}
+
+/* set the pts of a decoded frame, and refine next_pts */
+static void set_decoded_frame_pts(AVStream *st, InputStream *ist,
+    AVFrame *frame)
+{
   frame->pts =
     frame->best_effort_timestamp;
   // refine next_pts with what the decoder came up with
@@ -698,37 +1334,51 @@ CAMLprim value filter_frame(value _input_file,
   if (st->sample_aspect_ratio.num)
     frame->sample_aspect_ratio =
       st->sample_aspect_ratio;
+}
 
-  send_frame_to_filters(ist,
-      _input_filter,
-      frame);
+CAMLprim value filter_frame(value _input_file,
+    value _index,
+    value _input_stream,
+    value _frame)
+{
+  CAMLparam4 (_input_file, _index,
+    _input_stream, _frame);
+
+  InputFile *input_file = InputFile_val(_input_file);
+  int index = Int_val(_index);
+  AVStream *st = input_file->ctx->streams[index];
+  InputStream *ist =
+    InputStream_val(_input_stream);
+  AVFrame *frame = Frame_val(_frame);
+
+  set_decoded_frame_pts(st, ist, frame);
+
+  route_frame(ist, frame);
 
   av_frame_unref(frame);
+  account_frame_value(_frame);
 
   CAMLreturn(Val_unit);
 }
 
-/* flush the buffer source filter */
-static void flush_input_filter(Filter *ifilter, int64_t pts)
+/* flush the buffer sources of the routes still open, each closed at the
+ * end pts of the stream clamped to its interval */
+static void flush_input_routes(InputStream *ist, int64_t pts)
 {
-    int ret;
-
-    switch (ret = av_buffersrc_close(ifilter->filter_ctx, pts, AV_BUFFERSRC_FLAG_PUSH)) {
-    case 0:
-        break;
+  int i;
 
-    default:
-        av_log(NULL, AV_LOG_FATAL,
-            "Unexpected error while marking filters as finished %s\n",
-            av_err2str(ret));
-        exit(1);
-    }
+  for (i = 0; i < ist->nb_routes; i++)
+    if (!ist->routes[i].closed)
+      close_route(&ist->routes[i], pts);
 }
 
-CAMLprim value get_input_stream_index_from_filter(value _input_file,
-    value _in_filter)
+/* find the (file index, stream index) pair designated by a stream label,
+ * such as "1:v:0", for an input pad */
+CAMLprim value get_input_stream_index_from_filter(value _input_files,
+    value _in_filter, value _name)
 {
-  CAMLparam2(_input_file, _in_filter);
+  CAMLparam3(_input_files, _in_filter, _name);
+  CAMLlocal1(ans);
 
   int i;
   InputFile *input_file;
@@ -736,34 +1386,31 @@ CAMLprim value get_input_stream_index_from_filter(value _input_file,
     FilterInOut_val(_in_filter);
   AVFilterContext *in_filter_ctx =
     in_filter->filter_ctx;
-  char *in_filter_name = in_filter->name;
+  const char *in_filter_name = String_val(_name);
   int in_filter_pad_idx = in_filter->pad_idx;
-  int input_stream_index;
+  int nb_input_files = Wosize_val(_input_files);
+  int file_idx;
   char *p;
   AVStream *st;
 
-  // XXX pick the right input_file
-  //int file_idx;
-  //if ((file_idx = strtol(in_filter_name, &p, 0)) < 0 ||
-  //    file_idx >= nb_input_files) {
-  //    av_log(NULL, AV_LOG_FATAL,
-  //        "Invalid file index %d in filtergraph description.\n",
-  //        file_idx);
-  //    exit(1);
-  //}
-  //input_file = input_files[file_idx];
-  strtol(in_filter_name, &p, 0);
-  input_file = InputFile_val(_input_file);
-
   if (avfilter_pad_get_type(in_filter_ctx->input_pads, in_filter_pad_idx) != AVMEDIA_TYPE_VIDEO) {
     av_log(NULL, AV_LOG_FATAL, "Only video filters supported.\n");
     exit(1);
   }
-  if (!in_filter_name) {
+  if (!*in_filter_name) {
     av_log(NULL, AV_LOG_FATAL, "Only named inputs supported.\n");
     exit(1);
   }
 
+  if ((file_idx = strtol(in_filter_name, &p, 0)) < 0 ||
+      file_idx >= nb_input_files) {
+    av_log(NULL, AV_LOG_FATAL,
+        "Invalid file index %d in filtergraph description.\n",
+        file_idx);
+    exit(1);
+  }
+  input_file = InputFile_val(Field(_input_files, file_idx));
+
   for (i = 0, st = NULL; i < input_file->ctx->nb_streams; i++) {
     if (avformat_match_stream_specifier(input_file->ctx, input_file->ctx->streams[i], *p == ':' ? p + 1 : p) == 1) {
       st = input_file->ctx->streams[i];
@@ -776,27 +1423,18 @@ CAMLprim value get_input_stream_index_from_filter(value _input_file,
         p);
     exit(1);
   }
-  input_stream_index = st->index;
 
-  CAMLreturn(Val_int(input_stream_index));
+  ans = caml_alloc_tuple(2);
+  Store_field(ans, 0, Val_int(file_idx));
+  Store_field(ans, 1, Val_int(st->index));
+
+  CAMLreturn(ans);
 }
 
-CAMLprim value rescale_input_packet_dts(value _input_file,
-    value _index,
-    value _input_stream,
-    value _pkt)
+/* set the dts of a packet read from the file, and refine next_dts */
+static void rescale_packet_dts(AVStream *st, InputStream *ist,
+    AVPacket *pkt)
 {
-  CAMLparam4(_input_file, _index,
-    _input_stream, _pkt);
-  CAMLlocal1(ans);
-
-  InputFile *input_file = InputFile_val(_input_file);
-  int index = Int_val(_index);
-  AVStream *st = input_file->ctx->streams[index];
-  InputStream *ist =
-    InputStream_val(_input_stream);
-  AVPacket *pkt = Packet_val(_pkt);
-
   // refine next_dts with what the packet contains
   if (pkt->dts == AV_NOPTS_VALUE) {
     pkt->dts =
@@ -813,6 +1451,24 @@ CAMLprim value rescale_input_packet_dts(value _input_file,
     av_rescale_q(pkt->duration, st->time_base, AV_TIME_BASE_Q) :
     // use an aproximation based on the average framerate
     av_rescale_q(1, av_inv_q(ist->dec_ctx->framerate), AV_TIME_BASE_Q);
+}
+
+CAMLprim value rescale_input_packet_dts(value _input_file,
+    value _index,
+    value _input_stream,
+    value _pkt)
+{
+  CAMLparam4(_input_file, _index,
+    _input_stream, _pkt);
+
+  InputFile *input_file = InputFile_val(_input_file);
+  int index = Int_val(_index);
+  AVStream *st = input_file->ctx->streams[index];
+  InputStream *ist =
+    InputStream_val(_input_stream);
+  AVPacket *pkt = Packet_val(_pkt);
+
+  rescale_packet_dts(st, ist, pkt);
 
   CAMLreturn(Val_unit);
 }
@@ -820,18 +1476,16 @@ CAMLprim value rescale_input_packet_dts(value _input_file,
 /* flush the decoder and the filter inputs */
 CAMLprim value flush_input_stream(value _input_file,
     value _index,
-    value _input_stream,
-    value _input_filter)
+    value _input_stream)
 {
-  CAMLparam4(_input_file, _index,
-      _input_stream, _input_filter);
+  CAMLparam3(_input_file, _index,
+      _input_stream);
 
   int64_t next_pts;
   InputFile *input_file = InputFile_val(_input_file);
   int index = Int_val(_index);
   AVStream *st = input_file->ctx->streams[index];
   InputStream *ist = InputStream_val(_input_stream);
-  Filter *input_filter = Filter_val(_input_filter);
 
   av_log(NULL, AV_LOG_VERBOSE,
     "flush_input_stream\n");
@@ -840,7 +1494,240 @@ CAMLprim value flush_input_stream(value _input_file,
   next_pts =
     av_rescale_q(ist->next_pts,
         AV_TIME_BASE_Q, st->time_base);
-  flush_input_filter(input_filter, next_pts);
+  flush_input_routes(ist, next_pts);
 
   CAMLreturn(Val_unit);
 }
+
+
+/***** Threaded decoding *****/
+
+/* wake the main thread up if it waits for decoded frames */
+static void signal_decoded_frame(InputFile *input_file)
+{
+  pthread_mutex_lock(&input_file->frame_lock);
+  input_file->frame_generation++;
+  pthread_cond_signal(&input_file->frame_cond);
+  pthread_mutex_unlock(&input_file->frame_lock);
+}
+
+/* send a packet (or NULL to flush) to the decoder, and send all the
+ * frames it outputs to the frame queue; return an error if the frame
+ * queue no longer accepts frames */
+static int decode_packet(InputStream *ist, AVPacket *pkt)
+{
+  int ret, sent;
+  AVFrame *frame;
+
+  set_packet_skip_frame(ist, pkt);
+
+  do {
+    switch (ret = avcodec_send_packet(ist->dec_ctx, pkt)) {
+      case 0:
+      case AVERROR_EOF:
+        sent = 1;
+        break;
+
+      case AVERROR(EAGAIN):
+        /* drain the decoder, then send the packet again */
+        sent = 0;
+        break;
+
+      default:
+        av_log(NULL, AV_LOG_FATAL,
+            "Unexpected error while sending packet: %s.\n",
+            av_err2str(ret));
+        exit(1);
+    }
+
+    while (1) {
+      if (!(frame = av_frame_alloc())) {
+        av_log(NULL, AV_LOG_FATAL,
+            "Error allocating a decoded frame.\n");
+        exit(1);
+      }
+
+      ret = avcodec_receive_frame(ist->dec_ctx, frame);
+      if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
+        av_frame_free(&frame);
+        break;
+      } else if (ret < 0) {
+        av_log(NULL, AV_LOG_FATAL,
+            "Unexpected error while receiving frame: %s.\n",
+            av_err2str(ret));
+        exit(1);
+      }
+
+      set_decoded_frame_pts(ist->st, ist, frame);
+
+      if ((ret = av_thread_message_queue_send(ist->frame_queue, &frame, 0)) < 0) {
+        av_frame_free(&frame);
+        return ret;
+      }
+      signal_decoded_frame(ist->input_file);
+    }
+  } while (!sent);
+
+  return 0;
+}
+
+/* decode the packets dispatched by the reading thread until an error
+ * (including AVERROR_EOF) is received, then flush the decoder and set
+ * AVERROR_EOF to be received on the frame queue */
+static void *decode_thread(void *arg)
+{
+  InputStream *ist = arg;
+  AVPacket pkt;
+  int ret = 0;
+
+  while (av_thread_message_queue_recv(ist->packet_queue, &pkt, 0) >= 0) {
+    release_queued_packet(ist->input_file, &pkt);
+    atomic_fetch_add(&ist->nb_packets, 1);
+    atomic_fetch_add(&ist->data_size, pkt.size);
+
+    rescale_packet_dts(ist->st, ist, &pkt);
+    ret = decode_packet(ist, &pkt);
+    av_packet_unref(&pkt);
+    if (ret < 0)
+      break;
+  }
+
+  if (ret >= 0)
+    decode_packet(ist, NULL);
+
+  av_thread_message_queue_set_err_recv(ist->frame_queue, AVERROR_EOF);
+  signal_decoded_frame(ist->input_file);
+
+  return NULL;
+}
+
+/* allocate the packet queue and a queue of max_queued_frames decoded
+ * frames, and create a decoding thread */
+CAMLprim value init_decode_thread(value _input_stream,
+    value _max_queued_frames)
+{
+  CAMLparam2(_input_stream, _max_queued_frames);
+
+  int ret;
+  InputStream *ist = InputStream_val(_input_stream);
+  InputFile *input_file = ist->input_file;
+
+  /* the read-ahead budget of the file bounds the packets queued for all
+   * its streams */
+  if ((ret = av_thread_message_queue_alloc(&ist->packet_queue,
+          input_file->max_queued_packets, sizeof(AVPacket))) < 0 ||
+      (ret = av_thread_message_queue_alloc(&ist->frame_queue,
+          Int_val(_max_queued_frames), sizeof(AVFrame *))) < 0) {
+    av_log(NULL, AV_LOG_FATAL,
+        "Unexpected error while allocate a new message queue: %s\n",
+        av_err2str(ret));
+    exit(1);
+  }
+
+  switch (ret = pthread_create(&ist->thread,
+        NULL, decode_thread, ist)) {
+    case 0:
+      break;
+
+    default:
+      av_log(NULL, AV_LOG_FATAL,
+          "Unexpected error while creating thread: %s. Try to increase `ulimit -v` or decrease `ulimit -s`.\n",
+          strerror(ret));
+      exit(1);
+  }
+
+  CAMLreturn(Val_unit);
+}
+
+/* move decoded frames of every stream of the file into their buffer
+ * sources, until a frame of each stream has been routed, waiting for at
+ * least one frame (or EOF) if none is ready; the frames left wait in the
+ * frame queues, so that the buffer sources don't grow ahead of the graph.
+ * Return true once all the decoders reached EOF. */
+CAMLprim value seed_filters_from_decoders(value _input_file)
+{
+  CAMLparam1(_input_file);
+
+  int i, ret, nb_seeded, nb_running, nb_routed;
+  unsigned generation;
+  InputStream *ist;
+  AVFrame *frame;
+  int64_t start;
+  InputFile *input_file = InputFile_val(_input_file);
+
+  start = av_gettime_relative();
+  caml_release_runtime_system();
+
+  while (1) {
+    pthread_mutex_lock(&input_file->frame_lock);
+    generation = input_file->frame_generation;
+    pthread_mutex_unlock(&input_file->frame_lock);
+
+    /* other OCaml threads may finalise streams while the runtime lock is
+     * released, so the streams are walked under streams_lock, which the
+     * reading thread never holds while waiting */
+    pthread_mutex_lock(&input_file->streams_lock);
+    for (i = 0, nb_seeded = 0, nb_running = 0; i < input_file->nb_streams; i++) {
+      if (!(ist = input_file->streams[i]) || !ist->frame_queue || ist->eof)
+        continue;
+
+      /* frames outside of the routes are dropped on the way */
+      while ((ret = av_thread_message_queue_recv(ist->frame_queue, &frame, AV_THREAD_MESSAGE_NONBLOCK)) >= 0) {
+        nb_routed = route_frame(ist, frame);
+        av_frame_free(&frame);
+        ist->nb_frames++;
+        if (nb_routed) {
+          nb_seeded++;
+          break;
+        }
+      }
+
+      if (ret >= 0 || ret == AVERROR(EAGAIN)) {
+        nb_running++;
+      } else {
+        flush_input_routes(ist,
+            av_rescale_q(ist->next_pts, AV_TIME_BASE_Q, ist->st->time_base));
+        ist->eof = 1;
+        nb_seeded++;
+      }
+    }
+    pthread_mutex_unlock(&input_file->streams_lock);
+
+    if (nb_seeded || !nb_running)
+      break;
+
+    pthread_mutex_lock(&input_file->frame_lock);
+    while (input_file->frame_generation == generation)
+      pthread_cond_wait(&input_file->frame_cond, &input_file->frame_lock);
+    pthread_mutex_unlock(&input_file->frame_lock);
+  }
+
+  caml_acquire_runtime_system();
+  input_file->recv_blocked_time +=
+    av_gettime_relative() - start;
+
+  account_queued_packets(input_file);
+
+  CAMLreturn(Val_bool(!nb_running));
+}
+
+/* packets decoded, bytes decoded and frames sent to the filter graph by a
+ * threaded stream */
+CAMLprim value input_stream_stats(value _input_stream)
+{
+  CAMLparam1(_input_stream);
+  CAMLlocal4(ans, _nb_packets, _data_size, _nb_frames);
+
+  InputStream *ist = InputStream_val(_input_stream);
+
+  _nb_packets = caml_copy_int64(atomic_load(&ist->nb_packets));
+  _data_size = caml_copy_int64(atomic_load(&ist->data_size));
+  _nb_frames = caml_copy_int64(ist->nb_frames);
+
+  ans = caml_alloc_tuple(3);
+  Store_field(ans, 0, _nb_packets);
+  Store_field(ans, 1, _data_size);
+  Store_field(ans, 2, _nb_frames);
+
+  CAMLreturn(ans);
+}
@@ -1,3 +1,8 @@
+#include <pthread.h>
+#include <stdatomic.h>
+
+
+struct InputStream;
 
 
 /***** Input file *****/
@@ -7,7 +12,44 @@ typedef struct InputFile {
 
   AVThreadMessageQueue *in_thread_queue;
   pthread_t thread; /* thread reading from this file */
-  int non_blocking; /* reading packets from the thread should not block */
+  atomic_int interrupted; /* the thread is asked to stop reading */
+
+  /* read-ahead budget of the thread queue, 0 meaning unlimited for the
+   * combined size and the summed duration (in AV_TIME_BASE units) */
+  int max_queued_packets;
+  int64_t max_queued_bytes;
+  int64_t max_queued_duration;
+
+  /* occupancy of the thread queue, and its high-water marks */
+  pthread_mutex_t queue_lock;
+  pthread_cond_t queue_cond; /* signaled when packets leave the queue */
+  int nb_queued_packets, peak_queued_packets;
+  int64_t queued_bytes, peak_queued_bytes;
+  int64_t queued_duration, peak_queued_duration;
+  /* queued bytes last reported to the GC, with the runtime lock held */
+  size_t gc_queued_bytes;
+
+  /* time (in microseconds) spent by the thread waiting for a demuxer
+   * that had no data, and blocked on a full thread queue; reads blocking
+   * in the protocol layer are not told apart from demuxing, and are not
+   * counted */
+  atomic_int_fast64_t read_blocked_time;
+  atomic_int_fast64_t send_blocked_time;
+  /* time (in microseconds) spent by the main thread waiting for a packet */
+  int64_t recv_blocked_time;
+
+  /* opened streams, indexed like the streams of ctx; with threaded
+   * decoding, the thread dispatches packets to their own decoding threads
+   * instead of the thread queue */
+  int threaded_decoding;
+  int nb_streams;
+  struct InputStream **streams;
+  pthread_mutex_t streams_lock;
+
+  /* signaled by the decoding threads whenever a frame is queued */
+  pthread_mutex_t frame_lock;
+  pthread_cond_t frame_cond;
+  unsigned frame_generation;
 } InputFile;
 
 #define InputFile_val(v) (*(InputFile**)Data_custom_val(v))
@@ -15,9 +57,51 @@ typedef struct InputFile {
 
 /***** Input stream *****/
 
+/* a buffer source fed with the frames of a stream whose pts fall in
+ * [start,end[, remapped to origin + (pts - start) * slope (all in the
+ * stream time base); the routes of a pane are disjoint, so that each frame
+ * is sent at most once per pane */
+typedef struct InputRoute {
+  AVFilterContext *filter_ctx;
+  int pane;
+  int64_t start, end; /* INT64_MIN and INT64_MAX when unbounded */
+  int64_t origin;
+  double slope;
+  int closed; /* a frame past the end was decoded, or the stream ended */
+} InputRoute;
+
 typedef struct InputStream {
   AVCodecContext *dec_ctx;
 
+  AVStream *st;
+
+  /* buffer sources fed by this stream, sorted by pane then start, the
+   * index of the first route of each pane (plus one past the last), and of
+   * the first route of each pane not closed yet */
+  int nb_routes;
+  InputRoute *routes;
+  int nb_panes;
+  int *pane_offsets;
+  int *first_open;
+  int64_t start, end; /* span of the routes, in the stream time base */
+
+  /* the file this stream belongs to, kept alive by a global root until the
+   * stream is finalised */
+  InputFile *input_file;
+  value file_root;
+
+  /* with threaded decoding, packets are dispatched to the packet queue,
+   * and decoded frames (AVFrame pointers) are sent back on the frame
+   * queue */
+  AVThreadMessageQueue *packet_queue;
+  AVThreadMessageQueue *frame_queue;
+  pthread_t thread; /* thread decoding this stream */
+  int eof; /* the frame queue was drained up to EOF */
+
+  atomic_int_fast64_t nb_packets;
+  atomic_int_fast64_t data_size;
+  int64_t nb_frames;
+
   /* predicted dts of the next packet read for this stream or (when there are
    * several frames in a packet) of the next frame in current packet (in AV_TIME_BASE units) */
   int64_t next_dts;
@@ -1,64 +1,64 @@
 open FFmpeg
 
-let load_paths filter_graph input_path output_path =
-  let filter_graph,input_file =
-    Input.load_path filter_graph input_path
+let load_paths ?threaded_decoding ?threaded_encoding ?muxer_queue_size ?start_time ?routes filter_graph input_paths output_path =
+  let filter_graph,input_files =
+    Input.load_paths ?threaded_decoding ?start_time ?routes filter_graph input_paths
   in
   let filter_graph,output_file =
-    Output.load_path filter_graph output_path
+    Output.load_path ?threaded_encoding ?muxer_queue_size filter_graph output_path
   in
-  filter_graph,input_file,output_file
+  filter_graph,input_files,output_file
 
 (* assuming the sink buffers are empty, try to populate some,
  * by running frames through the filter graph if necessary *)
 let populate_filters filter_graph =
-  let rec aux input_file =
+  let rec aux input_files =
     (* try to populate the oldest non-EOF sink buffer *)
     match Avfilter.Graph.request_oldest filter_graph with
     | `Again ->
       (* some required source buffers were empty, and their number of
        * failed requests was incremented to guide the next seeding *)
-      let input_file =
-        Input.Stream.seed_filters input_file
+      let input_files =
+        Input.Stream.seed_filters input_files
       in
-      aux input_file
-    | `Ok -> input_file,`Ok
-    | `End_of_file -> input_file,`End_of_file
+      aux input_files
+    | `Ok -> input_files,`Ok
+    | `End_of_file -> input_files,`End_of_file
   in
   aux
 
 (* populate some sink buffers, then perform a step of transcoding *)
-let transcode_step filter_graph input_file output_file =
-  let input_file,ret =
-    populate_filters filter_graph input_file
+let transcode_step filter_graph input_files output_file =
+  let input_files,ret =
+    populate_filters filter_graph input_files
   in
   let output_file =
     Output.Stream.reap_filters output_file
   in
-  ret,input_file,output_file
+  ret,input_files,output_file
 
-let print_final_stats _total_size input_file output_file =
-  Input.print_file_stats input_file ;
+let print_final_stats _total_size input_files output_file =
+  Input.print_file_stats input_files ;
   Output.print_file_stats output_file
 
 let transcode filter_graph =
-  let rec aux input_file output_file =
+  let rec aux input_files output_file =
     match
       transcode_step
         filter_graph
-        input_file
+        input_files
         output_file
     with
-    | `Ok,input_file,output_file ->
+    | `Ok,input_files,output_file ->
       let _ =
         Output.print_report output_file
       in
-      aux input_file output_file
-    | `End_of_file,input_file,output_file ->
+      aux input_files output_file
+    | `End_of_file,input_files,output_file ->
       let total_size =
         Output.print_report ~last:true output_file
       in
-      print_final_stats total_size input_file output_file
+      print_final_stats total_size input_files output_file
   in
   aux
 
@@ -66,226 +66,305 @@ module Segments : sig
 
   type point = float * float
   type stream = int * int
+  type pane = point * point list * point
 
-  val build_description : (stream * (point * point list * point)) list -> Avfilter.Graph.desc * ((int * int * int) * string list) list
+  val partition : (stream -> float array * float) -> (stream * pane) list -> (stream * pane) list * (stream * (point * point)) list
+
+  val build_description : (stream * pane) list -> Avfilter.Graph.desc * (string * Input.Route.t) list
 
 end = struct
 
   type point = float * float
   type stream = int * int
+  type pane = point * point list * point
+
+  (* consecutive pairs of points, each mapping [x0,x1[ to [y0,y1[ *)
+  let segments (a,l,z) =
+    let rec aux point0 = function
+      | [] -> [point0,z]
+      | point1::points -> (point0,point1)::aux point1 points
+    in
+    aux a l
 
-  module Streams = Map.Make(struct type t = stream let compare = compare end)
+  let epsilon = 1e-3
 
-  let build_map =
-    let aux map (stream,points) =
-      let add panes' = Some (NEList.push points panes') in
-      Streams.update stream add map
+  (* a segment can be copied if it is a pure shift between keyframes
+   * (or up to the end of the stream) *)
+  let is_copyable (keyframes,duration) ((x0,y0),(x1,y1)) =
+    let is_keyframe x =
+      Array.exists (fun keyframe -> abs_float (keyframe -. x) < epsilon) keyframes
+    in
+    abs_float ((y1 -. y0) -. (x1 -. x0)) < epsilon &&
+    is_keyframe x0 &&
+    (is_keyframe x1 || x1 >= duration -. epsilon)
+
+  (* set aside the panes whose segments can all be copied, the segments
+   * reaching the end of the stream ending at infinity *)
+  let partition probe_keyframes panes =
+    let aux (stream,pane) (filtered_panes,copied_segments) =
+      let segments = segments pane
+      and (_keyframes,duration as keyframes) = probe_keyframes stream in
+      if List.for_all (is_copyable keyframes) segments
+      then
+        let copied_segment (point0,(x1,y1)) =
+          stream,
+          (point0,((if x1 >= duration -. epsilon then infinity else x1),y1))
+        in
+        filtered_panes,
+        List.map copied_segment segments @ copied_segments
+      else (stream,pane)::filtered_panes,copied_segments
+    in
+    List.fold_right aux panes ([],[])
+
+  (* each segment of each pane gets a route from its input stream, sent
+   * to an output of its own; the frames are dispatched natively by pts,
+   * each once per pane *)
+  let build_description panes =
+    let aux (pane_index,chains,routes) ((file_index,stream_index),pane) =
+      let input_label =
+        Printf.sprintf "%d:v:%d" file_index stream_index
+      in
+      let add_segment n (chains,routes) (point0,point1) =
+        let route_label =
+          Printf.sprintf "route%d_%d_%d_%d"
+            file_index stream_index pane_index n
+        and branch_label =
+          Printf.sprintf "image%d_%d_%d_%d"
+            file_index stream_index pane_index n
+        in
+        [[route_label],("null",[]),[branch_label]]::chains,
+        (route_label,Input.Route.make input_label pane_index point0 point1)::routes
+      in
+      let chains,routes =
+        segments pane
+        |> List.mapi (fun n segment -> n,segment)
+        |> List.fold_left
+          (fun accum (n,segment) -> add_segment n accum segment)
+          (chains,routes)
+      in
+      succ pane_index,chains,routes
     in
-    List.fold_left aux Streams.empty
+    let _,chains,routes =
+      List.fold_left aux (0,[],[]) panes
+    in
+    List.rev chains,List.rev routes
 
-  module Filter : sig
+end
 
-    val split : ?input_label:string -> 'start -> (int -> 'start -> ('start * string,'finish) result) -> Avfilter.Filter.desc * 'finish
+(* the demonstration pane of an input file, remapping its first video
+ * stream, slowed down then sped up or the reverse every other file *)
+let demo_pane file_index =
+  (file_index,0),
+  if file_index mod 2 = 0 then
+    ((0.,0.),[
+        (*
+        (6.,5.) ;
+        (9.,10.) ;
+        (16.,15.) ;
+        (19.,20.) ;
+        (26.,25.) ;
+        (29.,30.) ;
+        (36.,35.) ;
+        (39.,40.) ;
+        (46.,45.) ;
+        (49.,50.) ;
+        (56.,55.) ;
+         *)
+        (3.,2.) ;
+      ],(5.,5.))
+  else
+    ((0.,0.),[
+        (*
+        (4.,5.) ;
+        (11.,10.) ;
+        (14.,15.) ;
+        (21.,20.) ;
+        (24.,25.) ;
+        (31.,30.) ;
+        (34.,35.) ;
+        (41.,40.) ;
+        (44.,45.) ;
+        (51.,50.) ;
+        (54.,55.) ;
+         *)
+        (2.,3.) ;
+      ],(5.,5.))
+
+(* the input files feeding no pane of the filter graph *)
+let unused_inputs input_paths panes =
+  List.filter
+    (fun (file_index,_path) ->
+       not (List.exists (fun ((i,_),_pane) -> i = file_index) panes))
+    (List.mapi (fun file_index path -> file_index,path) input_paths)
+
+(* with -copy-pane, a demonstration pane of the first input file left as
+ * is, from the first to the second keyframe where the stream can be cut
+ * (or the end of the stream), so that it is copied without reencoding *)
+let copy_demo_pane (keyframes,duration) =
+  let x0 = if Array.length keyframes > 0 then keyframes.(0) else 0.
+  and x1 = if Array.length keyframes > 1 then keyframes.(1) else duration in
+  (0,0),((x0,x0),[],(x1,x1))
+
+let segments_graph panes =
+  let chains,routes =
+    Segments.build_description panes
+  in
+  Avfilter.Graph.make chains,routes
+
+(* load the files, and transcode them through the filter graph, whose
+ * inputs may be routed; the copied segments are appended to the output
+ * as extra streams, written after the transcoding rather than
+ * interleaved with it (see Output.Copy) *)
+let run ?threaded_decoding ?threaded_encoding ?muxer_queue_size ?start_time ?routes ?(copied_segments=[]) filter_graph input_paths output_path =
+  let filter_graph,input_files,output_file =
+    load_paths
+      ?threaded_decoding ?threaded_encoding ?muxer_queue_size ?start_time ?routes
+      filter_graph input_paths output_path
+  in
 
-    val select_lt : ?input_label:string -> ?output_label:string -> point -> Avfilter.Filter.desc
+  let copies =
+    let input_paths = Array.of_list input_paths in
+    List.map
+      (fun ((file_index,video_index),((x0,y0),(x1,_y1))) ->
+         Output.Copy.make output_file
+           input_paths.(file_index) video_index
+           (x0,x1) (y0 -. x0))
+      copied_segments
+  in
 
-    val select_gte : ?input_label:string -> ?output_label:string -> point -> Avfilter.Filter.desc
+  let filter_graph =
+    Avfilter.Graph.init filter_graph
+  in
 
-    val setpts : ?input_label:string -> ?output_label:string -> point -> point -> Avfilter.Filter.desc
+  Input.init input_files ;
 
-    val fifo : ?input_label:string -> ?output_label:string -> unit -> Avfilter.Filter.desc
+  Output.init output_file ;
 
-    val interleave : input_labels:(string list) -> ?output_label:string -> unit -> Avfilter.Filter.desc
+  transcode filter_graph input_files output_file ;
 
-  end = struct
+  (* a copied segment holds at least the keyframe it starts with *)
+  List.iter
+    (fun copy ->
+       if Output.Copy.write output_file copy = 0L then
+         failwith "offmpeg: no packet copied for a segment")
+    copies ;
 
-    let split ?input_label seed step =
-      let n,output_labels,result =
-        let rec aux n output_labels accum =
-          match step n accum with
-          | Ok (accum,output_label) ->
-            aux (n+1) (output_label::output_labels) accum
-          | Error result -> n,output_labels,result
-        in
-        aux 0 [] seed
-      in
-      ((match input_label with None -> [] | Some s -> [s]),
-       (Printf.sprintf "split=%d" n,[]),
-       output_labels),
-      result
-
-    let select_lt ?input_label ?output_label (x,_) =
-      (match input_label with None -> [] | Some s -> [s]),
-      (Printf.sprintf "select=lt(pts,%f/TB)" x,[]),
-      (match output_label with None -> [] | Some s -> [s])
-
-    let select_gte ?input_label ?output_label (x,_) =
-      (match input_label with None -> [] | Some s -> [s]),
-      (Printf.sprintf "select=gte(pts,%f/TB)" x,[]),
-      (match output_label with None -> [] | Some s -> [s])
-
-    let setpts ?input_label ?output_label (x0,y0) (x1,y1) =
-      (match input_label with None -> [] | Some s -> [s]),
-      (Printf.sprintf "setpts=(PTS-%f/TB)*%f+%f/TB" x0 ((y1-.y0)/.(x1-.x0)) y0,[]),
-      (match output_label with None -> [] | Some s -> [s])
-
-    let fifo ?input_label ?output_label () =
-      (match input_label with None -> [] | Some s -> [s]),
-      ("fifo",[]),
-      (match output_label with None -> [] | Some s -> [s])
-
-    let interleave ~input_labels ?output_label () =
-      input_labels,
-      ((Printf.sprintf "interleave=n=%d" @@ List.length input_labels),[]),
-      (match output_label with None -> [] | Some s -> [s])
-
-  end
-
-  let build_description =
-    fun l ->
-      (* group filters by input stream *)
-      let map = build_map l in
-      (* build the needed dispatch chains and adapt the pane labels *)
-      let chains,labelled_panes =
-        let aux (file_index,stream_index) panes (input_chains,labelled_panes) =
-          let input_label =
-            Printf.sprintf "%d:v:%d" file_index stream_index
-          in
-          match NEList.pop panes with
-          | pane,None ->
-            (* stream used only once: use it directly *)
-            input_chains,((input_label,[]),((file_index,stream_index,0),pane))::labelled_panes
-          | _ ->
-            (* stream used multiple times: split *)
-            let input_filter,labelled_panes =
-              let make_label pane_index (labelled_panes,panes) =
-                match panes with
-                | pane::panes ->
-                  let label =
-                    Printf.sprintf "input%d_%d_%d"
-                      file_index stream_index pane_index
-                  in
-                  Ok ((((label,[]),((file_index,stream_index,pane_index),pane))::labelled_panes,panes),label)
-                | [] -> Error labelled_panes
-              in
-              Filter.split
-                ~input_label
-                (labelled_panes,NEList.to_list panes)
-                make_label
-            in
-            [input_filter]::input_chains,labelled_panes
-        in
-        Streams.fold aux map ([],[])
-      in
-      (* build one chain per branch *)
-      let chains,accum_label_lists =
-        let add_branch n ((chains,accum_label_lists),accum_labelled_panes) ((input_label,output_labels),((file_index,stream_index,pane_index),pane)) =
-          let branch_label =
-            Printf.sprintf "image%d_%d_%d_%d"
-              file_index stream_index pane_index n
-          in
-          let output_labels =
-            branch_label::output_labels
-          in
-          match pane with
-          | a,[],z ->
-            let pair = a,z in
-            let chain =
-              let make_branch_chain input_label branch_label (point0,point1) =
-                [
-                  (* add a lower limit to the trunk *)
-                  Filter.select_gte ~input_label point0 ;
-                  (* add an upper limit to the trunk *)
-                  Filter.select_lt point1 ;
-                  (* resize the trunk *)
-                  Filter.setpts point0 point1 ;
-                  (* delay the trunk *)
-                  Filter.fifo ~output_label:branch_label () ;
-                ]
-              in
-              make_branch_chain input_label branch_label pair
-            in
-            (chain::chains,((file_index,stream_index,pane_index),output_labels)::accum_label_lists),accum_labelled_panes
-          | a,b::l,z ->
-            let output_label =
-              Printf.sprintf "trunk%d_%d_%d_%d"
-                file_index stream_index pane_index n
-            in
-            let pair = a,b
-            and half_labelled_pane =
-              (file_index,stream_index,pane_index),(b,l,z)
-            in
-            let chain =
-              let make_branch_chain input_label output_label branch_label (point0,point1) =
-                let make_label _ = function
-                  | h::t -> Ok (t,h)
-                  | [] -> Error ()
-                in
-                let split () =
-                  let filter,() =
-                    Filter.split
-                      [
-                        output_label ;
-                        branch_label^"tmp" ;
-                      ] make_label
-                  in
-                  filter
-                in
-                (* create a branch of index n,
-                 * that maps [x0,x1[ to [y0,y1[ *)
-                [
-                  (* add a lower limit to the trunk *)
-                  Filter.select_gte ~input_label point0 ;
-                  (* add a branch to the trunk *)
-                  split () ;
-                  (* add an upper limit to the branch *)
-                  Filter.select_lt ~input_label:(branch_label^"tmp") point1 ;
-                  (* resize the branch *)
-                  Filter.setpts point0 point1 ;
-                  (* delay the branch *)
-                  Filter.fifo ~output_label:branch_label () ;
-                ]
-              in
-              make_branch_chain input_label output_label branch_label pair
-            in
-            (chain::chains,accum_label_lists),((output_label,output_labels),half_labelled_pane)::accum_labelled_panes
-        in
-        let rec add_branches n (chains,accum_label_lists) = function
-          | [] -> chains,accum_label_lists
-          | labelled_panes ->
-            let (chains,accum_label_lists),accum_labelled_panes =
-              List.fold_left (add_branch n) ((chains,accum_label_lists),[]) labelled_panes
-            in
-            add_branches (n+1) (chains,accum_label_lists) accum_labelled_panes
-        in
-        add_branches 0 (chains,[]) labelled_panes
-      in
-      let _ = Filter.interleave in
-      (*
-      let chains,stream_labels =
-        let aux (chains,stream_labels) ((file_index,stream_index,pane_index),output_labels) =
-          let stream_label =
-            Printf.sprintf "stream%d_%d_%d"
-              file_index stream_index pane_index
-          in
-          [
-            Filter.interleave ~input_labels:output_labels () ;
-            Filter.fifo ~output_label:stream_label () ;
-          ]::chains,
-          stream_label::stream_labels
-        in
-        List.fold_left aux (chains,[]) accum_label_lists
+  Output.close output_file
+
+module Chunks : sig
+
+  type chunk = float option * float option
+
+  val split : int -> float array * float -> chunk list
+
+  val graph : chunk -> Avfilter.Graph.t
+
+  val transcode : ?flags:string list -> int -> string -> string -> unit
+
+end = struct
+
+  (* [start,end[ in the timeline of the input file, unbounded if None *)
+  type chunk = float option * float option
+
+  (* cut the timeline at the first keyframes after every duration/n,
+   * so that each chunk can be decoded from its own first packet *)
+  let split nb_chunks (keyframes,duration) =
+    match Array.to_list keyframes with
+    | [] -> [None,None]
+    | first_keyframe::keyframes ->
+      let chunk_duration = duration /. float_of_int nb_chunks in
+      let rec aux start_time cuts = function
+        | [] -> List.rev cuts
+        | keyframe::keyframes ->
+          if keyframe -. start_time >= chunk_duration
+          then aux keyframe (keyframe::cuts) keyframes
+          else aux start_time cuts keyframes
       in
-      let chains =
-        let vstack ins =
-          ins,
-          ((Printf.sprintf "vstack=inputs=%d" @@ List.length ins),[]),
-          []
-        in
-        [vstack stream_labels]::chains
+      let rec make_chunks start_time = function
+        | [] -> [start_time,None]
+        | cut::cuts -> (start_time,Some cut)::make_chunks (Some cut) cuts
       in
-       *)
-      List.rev chains,accum_label_lists
+      aux first_keyframe [] keyframes
+      |> make_chunks None
+
+  (* the first video stream of the input file, limited to the chunk, and
+   * starting at 0 *)
+  let graph (start_time,end_time) =
+    let trim =
+      match start_time,end_time with
+      | None,None -> "trim"
+      | Some start_time,None ->
+        Printf.sprintf "trim=start=%f" start_time
+      | None,Some end_time ->
+        Printf.sprintf "trim=end=%f" end_time
+      | Some start_time,Some end_time ->
+        Printf.sprintf "trim=start=%f:end=%f" start_time end_time
+    in
+    Avfilter.Graph.make [
+      [
+        ["0:v:0"],(trim,[]),[] ;
+        [],("setpts=PTS-STARTPTS",[]),[] ;
+      ] ;
+    ]
+
+  let string_of_time = function
+    | None -> "-"
+    | Some time -> Printf.sprintf "%h" time
+
+  (* transcode each chunk in its own offmpeg process, given the threading
+   * [flags], then append the chunks into the output file; if a chunk
+   * fails, the other processes are stopped and the chunks removed *)
+  let transcode ?(flags=[]) nb_chunks input_path output_path =
+    let chunks =
+      Input.probe_keyframes input_path 0
+      |> split nb_chunks
+      |> Array.of_list
+    in
+    let chunk_paths =
+      Array.mapi
+        (fun i _chunk -> Printf.sprintf "%s.chunk%d.mp4" output_path i)
+        chunks
+    in
+    let pids =
+      Array.mapi
+        (fun i (start_time,end_time) ->
+           Unix.create_process Sys.executable_name
+             (Array.of_list
+                (Sys.executable_name :: flags @ [
+                    "-chunk" ;
+                    string_of_time start_time ;
+                    string_of_time end_time ;
+                    input_path ;
+                    chunk_paths.(i) ;
+                  ]))
+             Unix.stdin Unix.stdout Unix.stderr)
+        chunks
+    in
+    let remove_chunks () =
+      Array.iter
+        (fun chunk_path ->
+           if Sys.file_exists chunk_path then Sys.remove chunk_path)
+        chunk_paths
+    in
+    Array.iteri
+      (fun i pid ->
+         match Unix.waitpid [] pid with
+         | _,Unix.WEXITED 0 -> ()
+         | _ ->
+           Printf.eprintf "Failed to transcode chunk #%d.\n" i ;
+           (* the next processes are still running *)
+           Array.iteri
+             (fun j pid ->
+                if j > i then begin
+                  (try Unix.kill pid Sys.sigterm with Unix.Unix_error _ -> ()) ;
+                  ignore (Unix.waitpid [] pid)
+                end)
+             pids ;
+           remove_chunks () ;
+           exit 1)
+      pids ;
+    Output.concat chunk_paths output_path ;
+    remove_chunks ()
 
 end
 
@@ -295,60 +374,102 @@ let () =
   Avutil.Log.set_level `Info ;
   Avutil.Log.set_level `Warning ;
 
-  let filter_graph =
-    let chains,_accum_label_lists =
-      [
-        (0,0),((0.,0.),[
-            (*
-            (6.,5.) ;
-            (9.,10.) ;
-            (16.,15.) ;
-            (19.,20.) ;
-            (26.,25.) ;
-            (29.,30.) ;
-            (36.,35.) ;
-            (39.,40.) ;
-            (46.,45.) ;
-            (49.,50.) ;
-            (56.,55.) ;
-             *)
-            (3.,2.) ;
-          ],(5.,5.)) ;
-        (0,0),((0.,0.),[
-            (*
-            (4.,5.) ;
-            (11.,10.) ;
-            (14.,15.) ;
-            (21.,20.) ;
-            (24.,25.) ;
-            (31.,30.) ;
-            (34.,35.) ;
-            (41.,40.) ;
-            (44.,45.) ;
-            (51.,50.) ;
-            (54.,55.) ;
-             *)
-            (2.,3.) ;
-          ],(5.,5.)) ;
-      ] |> Segments.build_description
-    in
-    Avfilter.Graph.make chains
+  (* offmpeg [-decode-threads] [-encode-threads] [-mux-thread]
+   *   [-copy-pane] [-chunks N] INPUT... OUTPUT *)
+  let nb_args = Array.length Sys.argv in
+  let threaded_decoding = ref false
+  and threaded_encoding = ref false
+  and muxer_queue_size = ref 0
+  and copy_pane = ref false
+  and nb_chunks = ref 0
+  and chunk = ref None in
+  let time_of_string = function
+    | "-" -> None
+    | s -> Some (float_of_string s)
   in
-
-  let filter_graph,input_file,output_file =
-    let input_path = Sys.argv.(1)
-    and output_path = Sys.argv.(2) in
-    load_paths filter_graph input_path output_path
+  let rec parse_flags first_arg =
+    if first_arg >= nb_args then first_arg
+    else match Sys.argv.(first_arg) with
+      | "-decode-threads" ->
+        threaded_decoding := true ;
+        parse_flags (succ first_arg)
+      | "-encode-threads" ->
+        threaded_encoding := true ;
+        parse_flags (succ first_arg)
+      | "-mux-thread" ->
+        muxer_queue_size := 64 ;
+        parse_flags (succ first_arg)
+      | "-copy-pane" ->
+        copy_pane := true ;
+        parse_flags (succ first_arg)
+      | "-chunks" when first_arg + 1 < nb_args ->
+        nb_chunks := int_of_string Sys.argv.(first_arg+1) ;
+        parse_flags (first_arg + 2)
+      | "-chunk" when first_arg + 2 < nb_args ->
+        (* internal: transcode a single chunk *)
+        chunk :=
+          Some (time_of_string Sys.argv.(first_arg+1),
+                time_of_string Sys.argv.(first_arg+2)) ;
+        parse_flags (first_arg + 3)
+      | _ -> first_arg
   in
-
-  let filter_graph =
-    Avfilter.Graph.init filter_graph
+  let usage () =
+    Printf.eprintf "Usage: %s [-decode-threads] [-encode-threads] [-mux-thread] [-copy-pane] INPUT... OUTPUT\n"
+      Sys.argv.(0) ;
+    Printf.eprintf "       %s [-decode-threads] [-encode-threads] [-mux-thread] -chunks N INPUT OUTPUT\n"
+      Sys.argv.(0) ;
+    exit 1
   in
-
-  Input.init input_file ;
-
-  Output.init output_file ;
-
-  transcode filter_graph input_file output_file ;
-
-  Output.close output_file
+  let first_arg = parse_flags 1 in
+  if nb_args - first_arg < 2 ||
+     (!nb_chunks > 0 || !chunk <> None) && nb_args - first_arg <> 2 then
+    usage () ;
+  let input_paths = Array.(to_list @@ sub Sys.argv first_arg (nb_args-first_arg-1))
+  and output_path = Sys.argv.(nb_args-1) in
+
+  match !chunk with
+  | Some ((start_time,_end_time) as chunk) ->
+    run
+      ~threaded_decoding:!threaded_decoding
+      ~threaded_encoding:!threaded_encoding
+      ~muxer_queue_size:!muxer_queue_size
+      ?start_time (Chunks.graph chunk) input_paths output_path
+  | None when !nb_chunks > 0 ->
+    let flags =
+      (if !threaded_decoding then ["-decode-threads"] else []) @
+      (if !threaded_encoding then ["-encode-threads"] else []) @
+      (if !muxer_queue_size > 0 then ["-mux-thread"] else [])
+    in
+    Chunks.transcode ~flags !nb_chunks (List.hd input_paths) output_path
+  | None ->
+    (* a pane per input file; copy the segments that need no reencoding *)
+    let panes =
+      List.mapi (fun file_index _path -> demo_pane file_index) input_paths
+    in
+    let probe_keyframes (file_index,video_index) =
+      Input.probe_keyframes (List.nth input_paths file_index) video_index
+    in
+    let panes =
+      if !copy_pane then panes @ [copy_demo_pane (probe_keyframes (0,0))]
+      else panes
+    in
+    let filtered_panes,copied_segments =
+      Segments.partition probe_keyframes panes
+    in
+    (* an input file feeding no pad would be read for nothing *)
+    begin match unused_inputs input_paths filtered_panes with
+      | [] -> ()
+      | (file_index,path)::_ ->
+        Printf.eprintf "Input #%d (%s) feeds no pane.\n" file_index path ;
+        usage ()
+    end ;
+    let filter_graph,routes =
+      segments_graph filtered_panes
+    in
+    run
+      ~threaded_decoding:!threaded_decoding
+      ~threaded_encoding:!threaded_encoding
+      ~muxer_queue_size:!muxer_queue_size
+      ~routes
+      ~copied_segments
+      filter_graph input_paths output_path
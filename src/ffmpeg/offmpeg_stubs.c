@@ -83,3 +83,36 @@ void set_format_option(AVDictionary **ptr_format_opts, const char *key, const ch
     av_dict_set(ptr_format_opts, key, value, 0);
   }
 }
+
+
+/***** Streams *****/
+
+/* open a file to read the packets of its video_index-th video stream
+ * only (as the "0:v:video_index" filter labels) */
+AVFormatContext * open_video_stream(const char *filename, int video_index,
+    AVStream **pst)
+{
+  int ret, i;
+  AVFormatContext *ctx = NULL;
+
+  if ((ret = avformat_open_input(&ctx, filename, NULL, NULL)) < 0 ||
+      (ret = avformat_find_stream_info(ctx, NULL)) < 0) {
+    print_error(filename, ret);
+    exit(1);
+  }
+
+  *pst = NULL;
+  for (i = 0; i < ctx->nb_streams; i++) {
+    if (ctx->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO &&
+        !*pst && !video_index--)
+      *pst = ctx->streams[i];
+    else
+      ctx->streams[i]->discard = AVDISCARD_ALL;
+  }
+  if (!*pst) {
+    print_error(filename, AVERROR_STREAM_NOT_FOUND);
+    exit(1);
+  }
+
+  return ctx;
+}
@@ -2,11 +2,17 @@ module File : sig
 
   type payload
   type 'a t = {
-    payload : payload ;
-    streams : 'a array
+    payload           : payload ;
+    threaded_encoding : bool ;
+    muxer_queue_size  : int ;
+    streams           : 'a array
   }
 
-  val make : ?protocol_options:(string * string) array -> string -> 'a t
+  val make : ?protocol_options:(string * string) array -> ?threaded_encoding:bool -> ?muxer_queue_size:int -> string -> 'a t
+
+  val make_stream : ?threaded_encoding:bool -> ?muxer_queue_size:int -> ?buffer_size:int -> ?seek:(int -> Av.seek_command -> int) -> string -> Av.output_sink -> 'a t
+
+  val flush : 'a t -> unit
 
   val write_trailer : 'a t -> unit
 
@@ -20,24 +26,60 @@ module File : sig
 
   val name : 'a t -> string
 
+  val blocked_times : 'a t -> int64 * int64
+
 end = struct
 
   type payload
   type 'a t = {
-    payload : payload ;
-    streams : 'a array
+    payload           : payload ;
+    threaded_encoding : bool ;
+    (* true if each stream is encoded in its own thread *)
+    muxer_queue_size  : int ;
+    (* 0 if the packets are written by the main thread *)
+    streams           : 'a array
   }
 
-  external make_output_file : (string * string) array -> string -> payload = "make_output_file"
-  let make ?(protocol_options=[||]) filename =
+  (* with muxer_queue_size > 0, the packets are written by a thread, the
+   * main thread only blocking when that many packets are queued *)
+  external make_output_file : (string * string) array -> int -> string -> payload = "make_output_file"
+  let make ?(protocol_options=[||]) ?(threaded_encoding=false) ?(muxer_queue_size=0) filename =
+    if muxer_queue_size < 0 then
+      invalid_arg "Output.File.make: muxer_queue_size" ;
+    let payload =
+      make_output_file protocol_options muxer_queue_size filename
+    in
+    {
+      payload ;
+      threaded_encoding ;
+      muxer_queue_size ;
+      streams = [||] ;
+    }
+
+  (* the format_name output is written by blocks of buffer_size bytes to
+   * the sink, from the muxing thread if any *)
+  external make_output_file_stream : string -> Av.output_sink -> (int -> Av.seek_command -> int) option -> int -> int -> payload = "make_output_file_stream"
+  let make_stream ?(threaded_encoding=false) ?(muxer_queue_size=0) ?(buffer_size=1048576) ?seek format_name sink =
+    if muxer_queue_size < 0 then
+      invalid_arg "Output.File.make_stream: muxer_queue_size" ;
+    if buffer_size <= 0 then
+      invalid_arg "Output.File.make_stream: buffer_size" ;
     let payload =
-      make_output_file protocol_options filename
+      make_output_file_stream format_name sink seek buffer_size muxer_queue_size
     in
     {
       payload ;
+      threaded_encoding ;
+      muxer_queue_size ;
       streams = [||] ;
     }
 
+  (* write the interleaved packets out, waiting for the muxing thread *)
+  external flush_output_file : payload -> unit = "flush_output_file"
+  let flush file =
+    flush_output_file file.payload
+
+  (* the packets queued for the muxing thread are written first *)
   external write_trailer : payload -> unit = "write_trailer"
   let write_trailer file =
     write_trailer file.payload
@@ -62,6 +104,11 @@ end = struct
   external output_file_name : payload -> string = "output_file_name"
   let name file = output_file_name file.payload
 
+  (* microseconds spent by the main thread blocked on a full muxer queue,
+   * and waiting for it to drain *)
+  external output_file_blocked_times : payload -> int64 * int64 = "output_file_blocked_times"
+  let blocked_times file = output_file_blocked_times file.payload
+
 end
 
 let print_data_line header index name (nb_frames,nb_packets,data_size) =
@@ -100,7 +147,7 @@ module Stream : sig
 
   val fold : (t -> 'accum -> 'accum) -> t File.t -> 'accum -> 'accum
 
-  val print_stream_stats : int -> t -> unit
+  val print_stream_stats : t File.t -> int -> t -> unit
 
 end = struct
 
@@ -221,6 +268,8 @@ end = struct
   let store_streams file streams =
     {
       File.payload = file.File.payload ;
+      File.threaded_encoding = file.File.threaded_encoding ;
+      File.muxer_queue_size = file.File.muxer_queue_size ;
       File.streams = streams ;
     }
 
@@ -381,8 +430,12 @@ end = struct
   let name stream =
     name_of_output_stream stream.payload
 
-  external open_output_stream : File.payload -> int -> payload -> (string * string) array -> Avfilter.Output.t -> unit = "open_output_stream"
-  let open_stream ?(codec_options=[||]) ?(profile=`Baseline) ?(preset=`Ultrafast) ?(tune=`Film) file stream_index stream =
+  (* with threaded encoding, the encoding thread of the stream is fed by a
+   * queue of max_queued_frames frames *)
+  external open_output_stream : File.payload -> int -> payload -> (string * string) array -> Avfilter.Output.t -> int -> unit = "open_output_stream_byte" "open_output_stream"
+  let open_stream ?(codec_options=[||]) ?(profile=`Baseline) ?(preset=`Ultrafast) ?(tune=`Film) ?(max_queued_frames=8) file stream_index stream =
+    if max_queued_frames <= 0 then
+      invalid_arg "Output.Stream.open_stream: max_queued_frames" ;
     open_output_stream
       file.File.payload stream_index
       stream.payload
@@ -397,6 +450,7 @@ end = struct
           |] ;
         ])
       stream.filter
+      (if file.File.threaded_encoding then max_queued_frames else 0)
 
   external open_muxer : (string * string) array -> File.payload -> payload array -> unit = "open_muxer"
   let open_muxer ?(muxer_options=[|
@@ -424,7 +478,6 @@ end = struct
     let file =
       store_streams file streams
     in
-    File.dump file ;
     filter_graph,file
 
   (* print detailed information about the stream mapping *)
@@ -498,25 +551,92 @@ end = struct
     open_streams file ;
     open_muxer file
 
-  let print_stream_stats index stream =
+  external output_stream_blocked_times : payload -> int64 * int64 = "output_stream_blocked_times"
+  let print_stream_stats file index stream =
     print_data_line
       "  Output stream"
       index
       (media_type stream)
       (stream.nb_frames,
        stream.nb_packets,
-       stream.data_size)
+       stream.data_size) ;
+    if file.File.threaded_encoding then begin
+      let send_time,recv_time =
+        output_stream_blocked_times stream.payload
+      in
+      Format.printf
+        "    Main thread blocked %Ldus on a full frame queue, \
+         %Ldus flushing the encoder; \n"
+        send_time recv_time
+    end
 
 end
 
-let load_path filter_graph file =
-  File.make file
+let load_path ?threaded_encoding ?muxer_queue_size filter_graph file =
+  File.make ?threaded_encoding ?muxer_queue_size file
   |> Stream.init_filters filter_graph
 
+let load_stream ?threaded_encoding ?muxer_queue_size ?buffer_size ?seek filter_graph format_name sink =
+  File.make_stream ?threaded_encoding ?muxer_queue_size ?buffer_size ?seek format_name sink
+  |> Stream.init_filters filter_graph
+
+(* copied streams must have been added first *)
 let init file =
+  File.dump file ;
   Stream.init_muxer file ;
   Stream.dump_mappings file
 
+module Copy = struct
+
+  type t = {
+    index       : int ;
+    (* output stream *)
+    input_path  : string ;
+    video_index : int ;
+    start_time  : float ;
+    end_time    : float ;
+    (* infinity for the end of the file *)
+    shift       : float ;
+  }
+
+  (* a segment of a video stream copied without reencoding, mapping
+   * [start_time,end_time[ to [start_time+shift,end_time+shift[ (in
+   * seconds), whose boundaries are keyframes;
+   * the segment is written in one go by [write], once the transcoded
+   * streams are over: its packets are not interleaved with theirs, the
+   * muxer holding the transcoded packets up to its max_interleave_delta
+   * while the copied stream has none, then writing them regardless *)
+  external make_copy_stream : File.payload -> string -> int -> int = "make_copy_stream"
+  let make file input_path video_index (start_time,end_time) shift =
+    {
+      index =
+        make_copy_stream
+          file.File.payload input_path video_index ;
+      input_path ;
+      video_index ;
+      start_time ;
+      end_time ;
+      shift ;
+    }
+
+  external copy_stream_segment : File.payload -> int -> string -> int -> float * float * float -> int64 * int64 = "copy_stream_segment"
+  let write file copy =
+    let nb_packets,data_size =
+      copy_stream_segment
+        file.File.payload copy.index
+        copy.input_path copy.video_index
+        (copy.start_time,copy.end_time,copy.shift)
+    in
+    Format.printf
+      "  Copied stream #%d: %Ld packets (%Ld bytes); \n"
+      copy.index nb_packets data_size ;
+    nb_packets
+
+end
+
+let flush file =
+  File.flush file
+
 let close file =
   File.write_trailer file
 
@@ -537,4 +657,14 @@ let print_file_stats file =
        Int64.add accum_data_size stream.Stream.data_size)
     file
   |> (print_data_line "Output file" (-1) (File.name file)) ;
-  Stream.iteri (Stream.print_stream_stats) file
+  if file.File.muxer_queue_size > 0 then begin
+    let send_time,drain_time = File.blocked_times file in
+    Format.printf
+      "  Main thread blocked %Ldus on a full muxer queue, \
+       %Ldus draining it; \n"
+      send_time drain_time
+  end ;
+  Stream.iteri (Stream.print_stream_stats file) file
+
+(* append files encoded alike into a new file, without reencoding *)
+external concat : string array -> string -> unit = "concat_output_files"
@@ -12,12 +12,28 @@ module Stream : sig
 
 end
 
-val load_path : Avfilter.Graph.t -> string -> Avfilter.Graph.t * Stream.t File.t
+val load_path : ?threaded_encoding:bool -> ?muxer_queue_size:int -> Avfilter.Graph.t -> string -> Avfilter.Graph.t * Stream.t File.t
+
+val load_stream : ?threaded_encoding:bool -> ?muxer_queue_size:int -> ?buffer_size:int -> ?seek:(int -> Av.seek_command -> int) -> Avfilter.Graph.t -> string -> Av.output_sink -> Avfilter.Graph.t * Stream.t File.t
+
+module Copy : sig
+
+  type t
+
+  val make : 'a File.t -> string -> int -> float * float -> float -> t
+
+  val write : 'a File.t -> t -> int64
+
+end
 
 val init : Stream.t File.t -> unit
 
+val flush : 'a File.t -> unit
+
 val close : 'a File.t -> unit
 
 val print_report : ?last:bool -> Stream.t File.t -> int64
 
 val print_file_stats : Stream.t File.t -> unit
+
+val concat : string array -> string -> unit
@@ -9,9 +9,12 @@
 
 
 #include <libavutil/bprint.h>
+#include <libavutil/fifo.h>
 #include <libavutil/intreadwrite.h>
 #include <libavutil/time.h>
 
+#include <caml/threads.h>
+
 
 /***** Output file *****/
 
@@ -22,21 +25,72 @@ CAMLprim value output_file_name(value _output_file)
   OutputFile *output_file =
     OutputFile_val(_output_file);
 
-  CAMLreturn(caml_copy_string(output_file->ctx->url));
+  CAMLreturn(caml_copy_string(output_file->ctx->url ? output_file->ctx->url : ""));
 }
 
-void free_output_file(OutputFile *output_file)
+/* cause the muxing thread to stop, dropping the packets left */
+static void free_muxer_thread(OutputFile *output_file)
 {
+  AVPacket pkt;
+
+  if (!output_file->muxer_queue)
+    return;
+  av_thread_message_queue_set_err_recv(output_file->muxer_queue, AVERROR_EOF);
+  while (av_thread_message_queue_recv(output_file->muxer_queue, &pkt, AV_THREAD_MESSAGE_NONBLOCK) >= 0)
+    av_packet_unref(&pkt);
+
+  /* the thread may be waiting for the runtime lock in a custom output
+   * callback */
+  caml_release_runtime_system();
+  pthread_join(output_file->thread, NULL);
+  caml_acquire_runtime_system();
+
+  while (av_thread_message_queue_recv(output_file->muxer_queue, &pkt, AV_THREAD_MESSAGE_NONBLOCK) >= 0)
+    av_packet_unref(&pkt);
+  av_thread_message_queue_free(&output_file->muxer_queue);
+}
+
+/* free the file once no muxing thread is running */
+static void release_output_file(OutputFile *output_file)
+{
+  pthread_mutex_destroy(&output_file->muxer_lock);
+  pthread_cond_destroy(&output_file->muxer_cond);
+
   if (output_file->ctx) {
-    if (output_file->ctx->oformat) {
+    if (output_file->ctx->oformat && !output_file->io) {
       avio_closep(&output_file->ctx->pb);
     }
     avformat_free_context(output_file->ctx);
   }
+  if (output_file->io)
+    ocaml_av_free_output_io(output_file->io);
 
   av_freep(&output_file);
 }
 
+/* called by the finalizer, which can neither join a muxing thread waiting
+ * for the runtime lock nor release the lock: the thread is told to stop,
+ * and frees the file itself */
+void free_output_file(OutputFile *output_file)
+{
+  AVPacket pkt;
+
+  if (!output_file->muxer_queue) {
+    release_output_file(output_file);
+    return;
+  }
+
+  pthread_mutex_lock(&output_file->muxer_lock);
+  output_file->detached = 1;
+  pthread_mutex_unlock(&output_file->muxer_lock);
+
+  av_thread_message_queue_set_err_recv(output_file->muxer_queue, AVERROR_EOF);
+  while (av_thread_message_queue_recv(output_file->muxer_queue, &pkt, AV_THREAD_MESSAGE_NONBLOCK) >= 0)
+    av_packet_unref(&pkt);
+
+  pthread_detach(output_file->thread);
+}
+
 static void finalise_output_file(value v)
 {
   OutputFile *output_file = OutputFile_val(v);
@@ -68,21 +122,23 @@ static OutputFile * alloc_output_file(value *pvalue)
 
   if (!(output_file = av_mallocz(sizeof(*output_file))))
     Raise (EXN_FAILURE, "failed to allocate output_file");
+  pthread_mutex_init(&output_file->muxer_lock, NULL);
+  pthread_cond_init(&output_file->muxer_cond, NULL);
 
   alloc_output_file_value(output_file, pvalue);
   return output_file;
 }
 
-AVFormatContext * open_output_context(AVDictionary *protocol_options,
+static AVFormatContext * alloc_output_context(const char *format_name,
     const char *ofilename)
 {
   int ret;
   AVFormatContext *ctx;
 
   ret = avformat_alloc_output_context2(&ctx,
-      NULL, "mp4", ofilename);
+      NULL, format_name, ofilename);
   if (!ctx) {
-    print_error(ofilename, ret);
+    print_error(ofilename ? ofilename : format_name, ret);
     exit(1);
   }
   //ctx->oformat->flags =
@@ -92,6 +148,15 @@ AVFormatContext * open_output_context(AVDictionary *protocol_options,
   ctx->max_delay = (int)(0.7 * AV_TIME_BASE);
   //av_dict_set(&ctx->metadata, "creation_time", NULL, 0);
 
+  return ctx;
+}
+
+AVFormatContext * open_output_context(AVDictionary *protocol_options,
+    const char *ofilename)
+{
+  int ret;
+  AVFormatContext *ctx = alloc_output_context("mp4", ofilename);
+
   /* open the output file with generic avio function,
    * get back unused protocol options */
   ret = avio_open2(&ctx->pb,
@@ -107,10 +172,13 @@ AVFormatContext * open_output_context(AVDictionary *protocol_options,
   return ctx;
 }
 
+/* with muxer_queue_size > 0, packets are written by a dedicated thread
+ * once the muxer is opened */
 CAMLprim value make_output_file(value _protocol_options,
+    value _muxer_queue_size,
     value _ofilename)
 {
-  CAMLparam2(_protocol_options, _ofilename);
+  CAMLparam3(_protocol_options, _muxer_queue_size, _ofilename);
   CAMLlocal2(ans, pair);
 
   int i;
@@ -129,6 +197,7 @@ CAMLprim value make_output_file(value _protocol_options,
 
   output_file->ctx =
     open_output_context(protocol_options, ofilename);
+  output_file->muxer_queue_size = Int_val(_muxer_queue_size);
 
   /* fail if there are format options left */
   assert_empty_avoptions(protocol_options);
@@ -137,6 +206,403 @@ CAMLprim value make_output_file(value _protocol_options,
   CAMLreturn(ans);
 }
 
+/* write the output through a custom I/O context, to a bigarray ring or an
+ * OCaml callback (see Av.output_sink), instead of a file */
+CAMLprim value make_output_file_stream(value _format_name,
+    value _sink,
+    value _seek,
+    value _buffer_size,
+    value _muxer_queue_size)
+{
+  CAMLparam3(_format_name, _sink, _seek);
+  CAMLlocal1(ans);
+
+  OutputFile *output_file = alloc_output_file(&ans);
+  const char *format_name = String_val(_format_name);
+
+  output_file->ctx = alloc_output_context(format_name, NULL);
+  if (output_file->ctx->oformat->flags & AVFMT_NOFILE) {
+    av_log(NULL, AV_LOG_FATAL,
+        "Output format %s does not write to a file\n", format_name);
+    exit(1);
+  }
+
+  output_file->io = ocaml_av_alloc_output_io(_sink, _seek,
+      Int_val(_buffer_size));
+  if (!output_file->io) {
+    av_log(NULL, AV_LOG_FATAL, "%s\n", ocaml_av_error_msg);
+    exit(1);
+  }
+
+  output_file->ctx->pb = ocaml_av_output_io_context(output_file->io);
+  output_file->ctx->flags |= AVFMT_FLAG_CUSTOM_IO;
+  output_file->muxer_queue_size = Int_val(_muxer_queue_size);
+
+  CAMLreturn(ans);
+}
+
+/* write a packet to the muxer, or flush it if the packet has no stream */
+static void mux_packet(AVFormatContext *s, AVPacket *pkt)
+{
+  int ret;
+
+  if (pkt->stream_index < 0) {
+    ret = av_interleaved_write_frame(s, NULL);
+    avio_flush(s->pb);
+  } else {
+    ret = av_interleaved_write_frame(s, pkt);
+  }
+
+  switch (ret) {
+    case 0:
+      break;
+
+    default:
+      av_log(NULL, AV_LOG_FATAL,
+          "Unexpected error interleaving a frame: %s\n",
+          av_err2str(ret));
+      exit(1);
+  }
+
+  av_packet_unref(pkt);
+}
+
+/* write the packets received on the muxer queue until an error (including
+ * AVERROR_EOF, once the queue is drained) is received */
+static void *muxer_thread(void *arg)
+{
+  OutputFile *output_file = arg;
+  AVPacket pkt;
+  int detached;
+
+  while (av_thread_message_queue_recv(output_file->muxer_queue, &pkt, 0) >= 0) {
+    mux_packet(output_file->ctx, &pkt);
+    atomic_store(&output_file->muxed_size,
+        avio_tell(output_file->ctx->pb));
+
+    pthread_mutex_lock(&output_file->muxer_lock);
+    output_file->nb_queued_packets--;
+    pthread_cond_signal(&output_file->muxer_cond);
+    pthread_mutex_unlock(&output_file->muxer_lock);
+  }
+
+  pthread_mutex_lock(&output_file->muxer_lock);
+  detached = output_file->detached;
+  pthread_mutex_unlock(&output_file->muxer_lock);
+
+  if (!detached)
+    return NULL;
+
+  /* the file was collected meanwhile */
+  while (av_thread_message_queue_recv(output_file->muxer_queue, &pkt, AV_THREAD_MESSAGE_NONBLOCK) >= 0)
+    av_packet_unref(&pkt);
+  av_thread_message_queue_free(&output_file->muxer_queue);
+
+  if (output_file->io) {
+    /* the roots of the custom output are removed with the runtime lock */
+    ocaml_ffmpeg_register_thread();
+    caml_acquire_runtime_system();
+    release_output_file(output_file);
+    caml_release_runtime_system();
+  } else {
+    release_output_file(output_file);
+  }
+
+  return NULL;
+}
+
+static void init_muxer_thread(OutputFile *output_file)
+{
+  int ret;
+
+  if ((ret = av_thread_message_queue_alloc(&output_file->muxer_queue,
+          output_file->muxer_queue_size, sizeof(AVPacket))) < 0) {
+    av_log(NULL, AV_LOG_FATAL,
+        "Unexpected error while allocate a new message queue: %s\n",
+        av_err2str(ret));
+    exit(1);
+  }
+
+  switch (ret = pthread_create(&output_file->thread,
+        NULL, muxer_thread, output_file)) {
+    case 0:
+      break;
+
+    default:
+      av_log(NULL, AV_LOG_FATAL,
+          "Unexpected error while creating thread: %s. Try to increase `ulimit -v` or decrease `ulimit -s`.\n",
+          strerror(ret));
+      exit(1);
+  }
+}
+
+/* send a packet to the muxing thread, waiting for room in the queue */
+static void queue_muxed_packet(OutputFile *output_file, AVPacket *pkt)
+{
+  int ret;
+  int64_t start;
+
+  pthread_mutex_lock(&output_file->muxer_lock);
+  output_file->nb_queued_packets++;
+  pthread_mutex_unlock(&output_file->muxer_lock);
+
+  /* only count the time the queue was full */
+  if ((ret = av_thread_message_queue_send(output_file->muxer_queue, pkt,
+          AV_THREAD_MESSAGE_NONBLOCK)) == AVERROR(EAGAIN)) {
+    start = av_gettime_relative();
+    caml_release_runtime_system();
+    ret = av_thread_message_queue_send(output_file->muxer_queue, pkt, 0);
+    caml_acquire_runtime_system();
+    output_file->send_blocked_time +=
+      av_gettime_relative() - start;
+  }
+
+  if (ret < 0) {
+    av_log(NULL, AV_LOG_FATAL,
+        "Unable to send packet to muxing thread: %s\n",
+        av_err2str(ret));
+    exit(1);
+  }
+}
+
+/* write a packet, or hand its reference over to the muxing thread */
+static void write_muxed_packet(OutputFile *output_file, AVPacket *pkt)
+{
+  AVPacket queued_pkt;
+
+  if (output_file->muxer_queue) {
+    av_packet_move_ref(&queued_pkt, pkt);
+    queue_muxed_packet(output_file, &queued_pkt);
+  } else {
+    caml_release_runtime_system();
+    mux_packet(output_file->ctx, pkt);
+    caml_acquire_runtime_system();
+  }
+}
+
+/* wait for the muxing thread to write all the packets sent so far */
+static void drain_muxer_queue(OutputFile *output_file)
+{
+  int64_t start = av_gettime_relative();
+
+  caml_release_runtime_system();
+  pthread_mutex_lock(&output_file->muxer_lock);
+  while (output_file->nb_queued_packets)
+    pthread_cond_wait(&output_file->muxer_cond, &output_file->muxer_lock);
+  pthread_mutex_unlock(&output_file->muxer_lock);
+  caml_acquire_runtime_system();
+  output_file->drain_blocked_time +=
+    av_gettime_relative() - start;
+}
+
+/* write the interleaved packets to the file; with threaded muxing, wait
+ * for all the packets sent so far to be written */
+CAMLprim value flush_output_file(value _output_file)
+{
+  CAMLparam1(_output_file);
+
+  OutputFile *output_file = OutputFile_val(_output_file);
+  AVPacket pkt = { .stream_index = -1 };
+
+  if (output_file->muxer_queue) {
+    queue_muxed_packet(output_file, &pkt);
+    drain_muxer_queue(output_file);
+  } else {
+    caml_release_runtime_system();
+    mux_packet(output_file->ctx, &pkt);
+    caml_acquire_runtime_system();
+  }
+
+  CAMLreturn(Val_unit);
+}
+
+/* microseconds spent by the main thread blocked on a full muxer queue,
+ * and waiting for it to drain */
+CAMLprim value output_file_blocked_times(value _output_file)
+{
+  CAMLparam1(_output_file);
+  CAMLlocal3(ans, _send_time, _drain_time);
+
+  OutputFile *output_file = OutputFile_val(_output_file);
+
+  _send_time = caml_copy_int64(output_file->send_blocked_time);
+  _drain_time = caml_copy_int64(output_file->drain_blocked_time);
+
+  ans = caml_alloc_tuple(2);
+  Store_field(ans, 0, _send_time);
+  Store_field(ans, 1, _drain_time);
+
+  CAMLreturn(ans);
+}
+
+/* copy the streams of a chunk to the output file, checking that the
+ * chunks were encoded alike */
+static void setup_concat_streams(AVFormatContext *oc, AVFormatContext *ic,
+    int is_first)
+{
+  int i;
+  AVStream *ist, *ost;
+
+  if (!is_first && ic->nb_streams != oc->nb_streams) {
+    av_log(NULL, AV_LOG_FATAL,
+        "%s: stream count differs from the first chunk.\n", ic->url);
+    exit(1);
+  }
+
+  for (i = 0; i < ic->nb_streams; i++) {
+    ist = ic->streams[i];
+
+    if (!is_first) {
+      ost = oc->streams[i];
+      if (ist->codecpar->codec_id != ost->codecpar->codec_id ||
+          ist->codecpar->extradata_size != ost->codecpar->extradata_size ||
+          memcmp(ist->codecpar->extradata, ost->codecpar->extradata,
+            ist->codecpar->extradata_size)) {
+        av_log(NULL, AV_LOG_FATAL,
+            "%s: stream #%d can't be appended to the first chunk.\n",
+            ic->url, i);
+        exit(1);
+      }
+      continue;
+    }
+
+    if (!(ost = avformat_new_stream(oc, NULL)) ||
+        avcodec_parameters_copy(ost->codecpar, ist->codecpar) < 0) {
+      av_log(NULL, AV_LOG_FATAL, "Could not alloc stream.\n");
+      exit(1);
+    }
+    ost->codecpar->codec_tag = 0;
+    ost->time_base           = ist->time_base;
+    ost->avg_frame_rate      = ist->avg_frame_rate;
+    ost->sample_aspect_ratio = ist->sample_aspect_ratio;
+    av_dict_copy(&ost->metadata, ist->metadata, 0);
+  }
+}
+
+/* concatenate files encoded alike at the packet level, each file
+ * starting where the previous one ended */
+CAMLprim value concat_output_files(value _ifilenames,
+    value _ofilename)
+{
+  CAMLparam2(_ifilenames, _ofilename);
+
+  int ret, i, j, nb_streams = 0;
+  int nb_ifilenames = Wosize_val(_ifilenames);
+  const char *ifilename;
+  AVFormatContext *ic, *oc;
+  AVDictionary *muxer_options = NULL;
+  AVStream *ist, *ost;
+  AVPacket pkt;
+  /* per output stream: timestamps offset of the current chunk, end of the
+   * previous chunks, and last dts written */
+  int64_t *offsets = NULL, *end_pts = NULL, *last_dts = NULL;
+  int *is_started = NULL;
+
+  oc = open_output_context(NULL, String_val(_ofilename));
+
+  for (i = 0; i < nb_ifilenames; i++) {
+    ifilename = String_val(Field(_ifilenames, i));
+    ic = NULL;
+    if ((ret = avformat_open_input(&ic, ifilename, NULL, NULL)) < 0 ||
+        (ret = avformat_find_stream_info(ic, NULL)) < 0) {
+      print_error(ifilename, ret);
+      exit(1);
+    }
+
+    setup_concat_streams(oc, ic, !i);
+
+    if (!i) {
+      nb_streams = oc->nb_streams;
+      if (!(offsets = av_mallocz_array(nb_streams, sizeof(*offsets))) ||
+          !(end_pts = av_mallocz_array(nb_streams, sizeof(*end_pts))) ||
+          !(last_dts = av_mallocz_array(nb_streams, sizeof(*last_dts))) ||
+          !(is_started = av_mallocz_array(nb_streams, sizeof(*is_started))))
+        Raise (EXN_FAILURE, "failed to allocate concat state");
+      for (j = 0; j < nb_streams; j++)
+        last_dts[j] = AV_NOPTS_VALUE;
+
+      av_dict_set(&muxer_options, "movflags", "faststart", 0);
+      if ((ret = avformat_write_header(oc, &muxer_options)) < 0) {
+        print_error(oc->url, ret);
+        exit(1);
+      }
+      assert_empty_avoptions(muxer_options);
+      av_dict_free(&muxer_options);
+    }
+
+    /* the chunk starts where the previous ones ended */
+    for (j = 0; j < nb_streams; j++) {
+      offsets[j] = end_pts[j];
+      is_started[j] = 0;
+    }
+
+    while ((ret = av_read_frame(ic, &pkt)) >= 0) {
+      j = pkt.stream_index;
+      ist = ic->streams[j];
+      ost = oc->streams[j];
+
+      av_packet_rescale_ts(&pkt, ist->time_base, ost->time_base);
+      if (!is_started[j] && pkt.pts != AV_NOPTS_VALUE) {
+        /* shift the chunk so that its first frame is displayed right
+         * after the last one of the previous chunk */
+        offsets[j] -= pkt.pts;
+        is_started[j] = 1;
+      }
+      if (pkt.pts != AV_NOPTS_VALUE)
+        pkt.pts += offsets[j];
+      if (pkt.dts != AV_NOPTS_VALUE)
+        pkt.dts += offsets[j];
+
+      /* the leading packets of a chunk with delayed frames may have
+       * their dts overlap the end of the previous chunk: squash them */
+      if (pkt.dts != AV_NOPTS_VALUE && last_dts[j] != AV_NOPTS_VALUE &&
+          pkt.dts <= last_dts[j]) {
+        pkt.dts = last_dts[j] + 1;
+        if (pkt.pts != AV_NOPTS_VALUE && pkt.pts < pkt.dts) {
+          av_log(NULL, AV_LOG_FATAL,
+              "%s: stream #%d can't be appended without reordering.\n",
+              ifilename, j);
+          exit(1);
+        }
+      }
+      if (pkt.dts != AV_NOPTS_VALUE)
+        last_dts[j] = pkt.dts;
+      if (pkt.pts != AV_NOPTS_VALUE)
+        end_pts[j] = FFMAX(end_pts[j],
+            pkt.pts + FFMAX(pkt.duration, 0));
+
+      if ((ret = av_interleaved_write_frame(oc, &pkt)) < 0) {
+        av_log(NULL, AV_LOG_FATAL,
+            "Unexpected error interleaving a frame: %s\n",
+            av_err2str(ret));
+        exit(1);
+      }
+    }
+    if (ret != AVERROR_EOF) {
+      print_error(ifilename, ret);
+      exit(1);
+    }
+
+    avformat_close_input(&ic);
+  }
+
+  if (nb_ifilenames && (ret = av_write_trailer(oc)) < 0) {
+    av_log(NULL, AV_LOG_ERROR,
+        "Error writing trailer of %s: %s\n",
+        oc->url, av_err2str(ret));
+    exit(1);
+  }
+
+  av_freep(&offsets);
+  av_freep(&end_pts);
+  av_freep(&last_dts);
+  av_freep(&is_started);
+  avio_closep(&oc->pb);
+  avformat_free_context(oc);
+
+  CAMLreturn(Val_unit);
+}
+
 /* allocate output streams private data, write stream headers to file */
 CAMLprim value open_muxer(value _muxer_options,
     value _output_file, value _output_streams)
@@ -157,9 +623,11 @@ CAMLprim value open_muxer(value _muxer_options,
   }
 
   /* write the output file headers with generic avformat function,
-   * get back unused muxer options */
+   * get back unused muxer options; a custom I/O calls back into OCaml */
+  caml_release_runtime_system();
   ret = avformat_write_header(output_file->ctx,
       &muxer_options);
+  caml_acquire_runtime_system();
   if (ret<0) {
     print_error("output_file->filename", ret);
     exit(1);
@@ -173,6 +641,9 @@ CAMLprim value open_muxer(value _muxer_options,
     av_dump_format(output_file->ctx, i, output_file->ctx->url, 1);
   }
 
+  if (output_file->muxer_queue_size > 0)
+    init_muxer_thread(output_file);
+
   CAMLreturn(Val_unit);
 }
 
@@ -199,10 +670,37 @@ CAMLprim value name_of_output_stream(value _output_stream)
   CAMLreturn(caml_copy_string(output_stream->enc_ctx->codec->name));
 }
 
+/* cause the encoding thread to stop */
+static void free_encode_thread(OutputStream *output_stream)
+{
+  AVFrame *frame;
+  AVPacket pkt;
+
+  if (!output_stream->frame_queue)
+    return;
+  /* cause the encoding thread to stop once it has no frame or can't
+   * queue a packet */
+  av_thread_message_queue_set_err_recv(output_stream->frame_queue, AVERROR_EOF);
+  av_thread_message_queue_set_err_send(output_stream->packet_queue, AVERROR_EOF);
+  while (av_thread_message_queue_recv(output_stream->packet_queue, &pkt, AV_THREAD_MESSAGE_NONBLOCK) >= 0)
+    av_packet_unref(&pkt);
+
+  pthread_join(output_stream->thread, NULL);
+
+  while (av_thread_message_queue_recv(output_stream->frame_queue, &frame, AV_THREAD_MESSAGE_NONBLOCK) >= 0)
+    av_frame_free(&frame);
+  while (av_thread_message_queue_recv(output_stream->packet_queue, &pkt, AV_THREAD_MESSAGE_NONBLOCK) >= 0)
+    av_packet_unref(&pkt);
+  av_thread_message_queue_free(&output_stream->frame_queue);
+  av_thread_message_queue_free(&output_stream->packet_queue);
+}
+
 static void finalise_output_stream(value v)
 {
   OutputStream *output_stream = OutputStream_val(v);
 
+  free_encode_thread(output_stream);
+
   av_freep(&output_stream->enc_ctx->stats_in);
   avcodec_free_context(&output_stream->enc_ctx);
   av_freep(&output_stream);
@@ -510,14 +1008,154 @@ static int init_output_stream(AVStream *st,
   return ret;
 }
 
+static void send_frame(AVCodecContext *avctx, const AVFrame *frame);
+
+/* move an encoded packet to the packets held back by the encoding thread */
+static void hold_packet(AVFifoBuffer *pending, AVPacket *pkt)
+{
+  if (av_fifo_space(pending) < (int)sizeof(*pkt) &&
+      av_fifo_grow(pending, av_fifo_size(pending) + (int)sizeof(*pkt)) < 0) {
+    av_log(NULL, AV_LOG_FATAL,
+        "Error allocating a queue of encoded packets.\n");
+    exit(1);
+  }
+  av_fifo_generic_write(pending, pkt, sizeof(*pkt), NULL);
+}
+
+/* send the packets held back by the encoding thread to the packet queue,
+ * in order, stopping at a full queue unless wait is set; return an error
+ * if the queue no longer accepts packets */
+static int send_pending_packets(OutputStream *output_stream,
+    AVFifoBuffer *pending, int wait)
+{
+  AVPacket pkt;
+  int ret;
+
+  while (av_fifo_size(pending) >= (int)sizeof(pkt)) {
+    av_fifo_generic_peek(pending, &pkt, sizeof(pkt), NULL);
+    ret = av_thread_message_queue_send(output_stream->packet_queue, &pkt,
+        wait ? 0 : AV_THREAD_MESSAGE_NONBLOCK);
+    if (ret == AVERROR(EAGAIN))
+      return 0;
+    if (ret < 0)
+      return ret;
+    av_fifo_drain(pending, sizeof(pkt));
+  }
+
+  return 0;
+}
+
+/* encode the frames received on the frame queue until the NULL frame
+ * flushes the encoder (or an error is received), sending the packets on
+ * the packet queue, then set AVERROR_EOF to be received on it.
+ *
+ * The thread never waits on a full packet queue while the encoder still
+ * needs frames: the main thread may itself be waiting on a full frame
+ * queue, however many packets an encoder outputs per frame. Packets that
+ * don't fit are held back, and sent before any newer one. The thread owns
+ * the encoder context: the fields set on each frame from it are set
+ * here. */
+static void *encode_thread(void *arg)
+{
+  OutputStream *output_stream = arg;
+  AVCodecContext *avctx = output_stream->enc_ctx;
+  AVFifoBuffer *pending;
+  AVFrame *frame;
+  AVPacket pkt, queued_pkt;
+  int ret = 0;
+
+  av_init_packet(&pkt);
+  pkt.data = NULL;
+  pkt.size = 0;
+
+  if (!(pending = av_fifo_alloc(8 * sizeof(AVPacket)))) {
+    av_log(NULL, AV_LOG_FATAL,
+        "Error allocating a queue of encoded packets.\n");
+    exit(1);
+  }
+
+  while (ret != AVERROR_EOF &&
+      send_pending_packets(output_stream, pending, 0) >= 0 &&
+      av_thread_message_queue_recv(output_stream->frame_queue, &frame, 0) >= 0) {
+    if (frame) {
+      frame->quality = avctx->global_quality;
+      frame->pict_type = 0;
+    }
+    send_frame(avctx, frame);
+    av_frame_free(&frame);
+
+    while ((ret = avcodec_receive_packet(avctx, &pkt)) >= 0) {
+      /* the fifo takes the reference over, pkt being reused */
+      av_packet_move_ref(&queued_pkt, &pkt);
+      hold_packet(pending, &queued_pkt);
+    }
+    if (ret != AVERROR(EAGAIN) && ret != AVERROR_EOF) {
+      av_log(NULL, AV_LOG_FATAL,
+          "Unexpected error while receiving packet: %s.\n",
+          av_err2str(ret));
+      exit(1);
+    }
+  }
+
+  /* once the encoder is flushed, the main thread waits for the packets
+   * left */
+  if (ret == AVERROR_EOF)
+    send_pending_packets(output_stream, pending, 1);
+
+  while (av_fifo_size(pending) >= (int)sizeof(pkt)) {
+    av_fifo_generic_read(pending, &pkt, sizeof(pkt), NULL);
+    av_packet_unref(&pkt);
+  }
+  av_fifo_freep(&pending);
+
+  av_thread_message_queue_set_err_recv(output_stream->packet_queue, AVERROR_EOF);
+
+  return NULL;
+}
+
+/* allocate the frame and packet queues, and create an encoding thread */
+static void init_encode_thread(OutputStream *output_stream,
+    int max_queued_frames)
+{
+  int ret;
+
+  /* the main thread drains the packets after each frame it sends; the
+   * encoding thread holds back the packets that don't fit */
+  if ((ret = av_thread_message_queue_alloc(&output_stream->frame_queue,
+          max_queued_frames, sizeof(AVFrame *))) < 0 ||
+      (ret = av_thread_message_queue_alloc(&output_stream->packet_queue,
+          2 * max_queued_frames + 2, sizeof(AVPacket))) < 0) {
+    av_log(NULL, AV_LOG_FATAL,
+        "Unexpected error while allocate a new message queue: %s\n",
+        av_err2str(ret));
+    exit(1);
+  }
+
+  switch (ret = pthread_create(&output_stream->thread,
+        NULL, encode_thread, output_stream)) {
+    case 0:
+      break;
+
+    default:
+      av_log(NULL, AV_LOG_FATAL,
+          "Unexpected error while creating thread: %s. Try to increase `ulimit -v` or decrease `ulimit -s`.\n",
+          strerror(ret));
+      exit(1);
+  }
+}
+
+/* open the encoder; with max_queued_frames > 0, encode in a dedicated
+ * thread fed by a queue of that many frames */
 CAMLprim value open_output_stream(value _output_file,
     value _stream_index,
     value _output_stream,
     value _codec_options,
-    value _output_filter)
+    value _output_filter,
+    value _max_queued_frames)
 {
   CAMLparam5(_output_file, _stream_index,
     _output_stream, _codec_options, _output_filter);
+  CAMLxparam1(_max_queued_frames);
   CAMLlocal1(pair);
 
   int i, ret;
@@ -567,9 +1205,19 @@ CAMLprim value open_output_stream(value _output_file,
     exit(1);
   }
 
+  if (Int_val(_max_queued_frames) > 0)
+    init_encode_thread(output_stream,
+        Int_val(_max_queued_frames));
+
   CAMLreturn(Val_unit);
 }
 
+CAMLprim value open_output_stream_byte(value *argv, int argn)
+{
+  return open_output_stream(argv[0], argv[1], argv[2],
+      argv[3], argv[4], argv[5]);
+}
+
 
 /***** Print *****/
 
@@ -705,9 +1353,14 @@ CAMLprim value print_report(value _is_last_report,
 
   oc = output_file->ctx;
 
-  total_size = avio_size(oc->pb);
-  if (total_size <= 0) // FIXME improve avio_size() so it works with non seekable output too
-    total_size = avio_tell(oc->pb);
+  /* the muxing thread owns the AVIOContext */
+  if (output_file->muxer_queue) {
+    total_size = atomic_load(&output_file->muxed_size);
+  } else {
+    total_size = avio_size(oc->pb);
+    if (total_size <= 0) // FIXME improve avio_size() so it works with non seekable output too
+      total_size = avio_tell(oc->pb);
+  }
 
   vid = 0;
   av_bprint_init(&buf, 0, AV_BPRINT_SIZE_AUTOMATIC);
@@ -822,8 +1475,27 @@ CAMLprim value receive_packet(value _output_stream)
 
   pkt = alloc_packet_value(&_pkt);
 
-  switch (ret = avcodec_receive_packet(avctx, pkt)) {
+  if (output_stream->packet_queue) {
+    /* only wait for the encoding thread when flushing */
+    if (output_stream->flushing) {
+      int64_t start = av_gettime_relative();
+      caml_release_runtime_system();
+      ret = av_thread_message_queue_recv(output_stream->packet_queue,
+          pkt, 0);
+      caml_acquire_runtime_system();
+      output_stream->recv_blocked_time +=
+        av_gettime_relative() - start;
+    } else {
+      ret = av_thread_message_queue_recv(output_stream->packet_queue,
+          pkt, AV_THREAD_MESSAGE_NONBLOCK);
+    }
+  } else {
+    ret = avcodec_receive_packet(avctx, pkt);
+  }
+
+  switch (ret) {
     case 0:
+      account_packet_value(_pkt);
       ans = caml_alloc(1, 0);
       Store_field(ans, 0, _pkt);
       break;
@@ -882,7 +1554,6 @@ CAMLprim value write_packet(value _output_file,
   AVPacket *pkt = Packet_val(_pkt);
   AVCodecContext *enc = output_stream->enc_ctx;
   AVFormatContext *s = output_file->ctx;
-  int ret;
   int i;
   uint8_t *sd;
 
@@ -952,18 +1623,9 @@ CAMLprim value write_packet(value _output_file,
 
   pkt->stream_index = st->index;
 
-  switch (ret = av_interleaved_write_frame(s, pkt)) {
-    case 0:
-      break;
-
-    default:
-      av_log(NULL, AV_LOG_FATAL,
-          "Unexpected error interleaving a frame: %s\n",
-          av_err2str(ret));
-      exit(1);
-  }
-
-  av_packet_unref(pkt);
+  write_muxed_packet(output_file, pkt);
+  /* the muxer took the data */
+  account_packet_value(_pkt);
 
   CAMLreturn(Val_unit);
 }
@@ -976,9 +1638,18 @@ CAMLprim value write_trailer(value _output_file)
   OutputFile *output_file = OutputFile_val(_output_file);
   AVFormatContext *ctx = output_file->ctx;
 
+  /* let the muxing thread write the packets left, and stop */
+  if (output_file->muxer_queue) {
+    drain_muxer_queue(output_file);
+    free_muxer_thread(output_file);
+  }
+
   // XXX
   /* write the trailer if needed and close file */
-  if ((ret = av_write_trailer(ctx)) < 0) {
+  caml_release_runtime_system();
+  ret = av_write_trailer(ctx);
+  caml_acquire_runtime_system();
+  if (ret < 0) {
     av_log(NULL, AV_LOG_ERROR,
         "Error writing trailer of %s: %s\n",
         ctx->url, av_err2str(ret));
@@ -988,12 +1659,40 @@ CAMLprim value write_trailer(value _output_file)
   CAMLreturn(Val_unit);
 }
 
+/* send a frame (or NULL to flush) to the encoding thread, waiting for
+ * room in the frame queue */
+static void queue_frame(OutputStream *output_stream, AVFrame *frame)
+{
+  int ret;
+  int64_t start;
+
+  /* only count the time the queue was full */
+  if ((ret = av_thread_message_queue_send(output_stream->frame_queue,
+          &frame, AV_THREAD_MESSAGE_NONBLOCK)) == AVERROR(EAGAIN)) {
+    start = av_gettime_relative();
+    caml_release_runtime_system();
+    ret = av_thread_message_queue_send(output_stream->frame_queue,
+        &frame, 0);
+    caml_acquire_runtime_system();
+    output_stream->send_blocked_time +=
+      av_gettime_relative() - start;
+  }
+
+  if (ret < 0) {
+    av_log(NULL, AV_LOG_FATAL,
+        "Unable to send frame to encoding thread: %s\n",
+        av_err2str(ret));
+    exit(1);
+  }
+}
+
 CAMLprim value send_frame_to_stream(value _output_stream,
     value _last_frame_opt)
 {
   CAMLparam2(_output_stream, _last_frame_opt);
   CAMLlocal2(_last_frame, _pts);
 
+  AVFrame *frame;
   OutputStream *output_stream =
     OutputStream_val(_output_stream);
 
@@ -1004,22 +1703,58 @@ CAMLprim value send_frame_to_stream(value _output_stream,
     int64_t pts = Int64_val(_pts);
     int64_t last_frame_pts = last_frame->pts;
 
-    last_frame->quality = output_stream->enc_ctx->global_quality;
-    last_frame->pict_type = 0;
-
-    last_frame->pts = pts;
-    send_frame(output_stream->enc_ctx, last_frame);
-    last_frame->pts = last_frame_pts;
+    if (output_stream->frame_queue) {
+      /* the encoding thread gets its own reference, the same frame
+       * being sent again with other pts; the encoder context belongs to
+       * the thread, which sets the fields taken from it */
+      if (!(frame = av_frame_clone(last_frame))) {
+        av_log(NULL, AV_LOG_FATAL,
+            "Error allocating a frame to encode.\n");
+        exit(1);
+      }
+      frame->pts = pts;
+      queue_frame(output_stream, frame);
+    } else {
+      last_frame->quality = output_stream->enc_ctx->global_quality;
+      last_frame->pict_type = 0;
+      last_frame->pts = pts;
+      send_frame(output_stream->enc_ctx, last_frame);
+      last_frame->pts = last_frame_pts;
+    }
   } else {
     av_log(NULL, AV_LOG_VERBOSE,
         "flush_output_stream\n");
 
-    send_frame(output_stream->enc_ctx, NULL);
+    output_stream->flushing = 1;
+    if (output_stream->frame_queue)
+      queue_frame(output_stream, NULL);
+    else
+      send_frame(output_stream->enc_ctx, NULL);
   }
 
   CAMLreturn(Val_unit);
 }
 
+/* microseconds spent by the main thread blocked on a full frame queue,
+ * and waiting for the last packets of the encoding thread */
+CAMLprim value output_stream_blocked_times(value _output_stream)
+{
+  CAMLparam1(_output_stream);
+  CAMLlocal3(ans, _send_time, _recv_time);
+
+  OutputStream *output_stream =
+    OutputStream_val(_output_stream);
+
+  _send_time = caml_copy_int64(output_stream->send_blocked_time);
+  _recv_time = caml_copy_int64(output_stream->recv_blocked_time);
+
+  ans = caml_alloc_tuple(2);
+  Store_field(ans, 0, _send_time);
+  Store_field(ans, 1, _recv_time);
+
+  CAMLreturn(ans);
+}
+
 CAMLprim value rescale_output_frame_pts(value _output_stream,
     value _output_filter,
     value _next_frame)
@@ -1087,3 +1822,125 @@ CAMLprim value frame_pts(value _frame)
 
   CAMLreturn(caml_copy_int64(frame->pts));
 }
+
+
+/***** Stream copy *****/
+
+/* add a stream to be copied from a video stream of a file, before the
+ * muxer is opened; return its index */
+CAMLprim value make_copy_stream(value _output_file,
+    value _ifilename,
+    value _video_index)
+{
+  CAMLparam3(_output_file, _ifilename, _video_index);
+
+  OutputFile *output_file =
+    OutputFile_val(_output_file);
+  AVStream *ist, *ost;
+  AVFormatContext *ic =
+    open_video_stream(String_val(_ifilename),
+        Int_val(_video_index), &ist);
+
+  if (!(ost = avformat_new_stream(output_file->ctx, NULL)) ||
+      avcodec_parameters_copy(ost->codecpar, ist->codecpar) < 0) {
+    av_log(NULL, AV_LOG_FATAL, "Could not alloc stream.\n");
+    exit(1);
+  }
+  ost->codecpar->codec_tag = 0;
+  ost->time_base           = ist->time_base;
+  ost->avg_frame_rate      = ist->avg_frame_rate;
+  ost->sample_aspect_ratio = ist->sample_aspect_ratio;
+  ost->disposition         = AV_DISPOSITION_DEFAULT;
+
+  avformat_close_input(&ic);
+
+  CAMLreturn(Val_int(ost->index));
+}
+
+/* copy the packets of a video stream of a file displayed in
+ * [start_time,end_time[, shifted by shift (all in seconds), to an output
+ * stream; start_time and end_time must be keyframes where the stream can
+ * be cut cleanly, as given by probe_keyframes (or end_time the end of the
+ * file), so that the copied packets decode on their own and all the
+ * packets decoded between them are displayed between them; return the
+ * number of packets and bytes copied */
+CAMLprim value copy_stream_segment(value _output_file,
+    value _stream_index,
+    value _ifilename,
+    value _video_index,
+    value _times)
+{
+  CAMLparam5(_output_file, _stream_index,
+      _ifilename, _video_index, _times);
+  CAMLlocal3(ans, _nb_packets, _data_size);
+
+  int ret, is_started = 0;
+  int64_t nb_packets = 0, data_size = 0;
+  int64_t start_pts, end_pts, shift, ts;
+  AVPacket pkt;
+  AVStream *ist, *ost;
+  OutputFile *output_file =
+    OutputFile_val(_output_file);
+  AVFormatContext *ic =
+    open_video_stream(String_val(_ifilename),
+        Int_val(_video_index), &ist);
+  double start_time = Double_val(Field(_times, 0));
+  double end_time = Double_val(Field(_times, 1));
+
+  ost = output_file->ctx->streams[Int_val(_stream_index)];
+
+  start_pts = llrint(start_time / av_q2d(ist->time_base));
+  end_pts = isinf(end_time) ? INT64_MAX :
+    llrint(end_time / av_q2d(ist->time_base));
+  shift = llrint(Double_val(Field(_times, 2)) / av_q2d(ist->time_base));
+
+  if ((ret = avformat_seek_file(ic, ist->index, INT64_MIN,
+          start_pts, start_pts, 0)) < 0) {
+    print_error(ic->url, ret);
+    exit(1);
+  }
+
+  while ((ret = av_read_frame(ic, &pkt)) >= 0) {
+    /* from the keyframe at start_time up to the one at end_time, in
+     * decoding order; packets without pts are placed by their dts */
+    ts = pkt.pts != AV_NOPTS_VALUE ? pkt.pts : pkt.dts;
+    if (pkt.flags & AV_PKT_FLAG_KEY && ts != AV_NOPTS_VALUE) {
+      if (ts >= end_pts) {
+        av_packet_unref(&pkt);
+        break;
+      }
+      if (ts >= start_pts)
+        is_started = 1;
+    }
+    if (!is_started) {
+      av_packet_unref(&pkt);
+      continue;
+    }
+
+    if (pkt.pts != AV_NOPTS_VALUE)
+      pkt.pts += shift;
+    if (pkt.dts != AV_NOPTS_VALUE)
+      pkt.dts += shift;
+    av_packet_rescale_ts(&pkt, ist->time_base, ost->time_base);
+    pkt.stream_index = ost->index;
+    pkt.pos = -1;
+
+    nb_packets++;
+    data_size += pkt.size;
+    write_muxed_packet(output_file, &pkt);
+  }
+  if (ret < 0 && ret != AVERROR_EOF) {
+    print_error(ic->url, ret);
+    exit(1);
+  }
+
+  avformat_close_input(&ic);
+
+  _nb_packets = caml_copy_int64(nb_packets);
+  _data_size = caml_copy_int64(data_size);
+  ans = caml_alloc_tuple(2);
+  Store_field(ans, 0, _nb_packets);
+  Store_field(ans, 1, _data_size);
+
+  CAMLreturn(ans);
+}
@@ -1,9 +1,38 @@
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "av_stubs.h"
 
 
 /***** Output file *****/
 
 typedef struct OutputFile {
   AVFormatContext *ctx;
+
+  /* custom I/O writing to an OCaml sink instead of a file, or NULL */
+  output_io_t *io;
+
+  /* with threaded muxing, packets are sent to the muxer queue (holding at
+   * most muxer_queue_size packets) and written by the thread; a packet
+   * without a stream (stream_index < 0) asks it to flush the muxer */
+  int muxer_queue_size;
+  AVThreadMessageQueue *muxer_queue;
+  pthread_t thread; /* thread writing to this file */
+
+  /* packets sent to the thread and not written yet */
+  pthread_mutex_t muxer_lock;
+  pthread_cond_t muxer_cond; /* signaled when the thread writes packets */
+  int nb_queued_packets;
+  /* the file was collected before the thread stopped, which frees it */
+  int detached;
+
+  /* bytes written so far, as seen from the thread */
+  atomic_int_fast64_t muxed_size;
+
+  /* time (in microseconds) spent by the main thread blocked on a full
+   * muxer queue, and waiting for the queue to drain */
+  int64_t send_blocked_time;
+  int64_t drain_blocked_time;
 } OutputFile;
 
 #define OutputFile_val(v) (*(OutputFile**)Data_custom_val(v))
@@ -17,6 +46,19 @@ typedef struct OutputStream {
 
   AVCodecContext *enc_ctx;
 
+  /* with threaded encoding, frames (AVFrame pointers, NULL to flush) are
+   * sent to the frame queue, and encoded packets are received back on the
+   * packet queue */
+  AVThreadMessageQueue *frame_queue;
+  AVThreadMessageQueue *packet_queue;
+  pthread_t thread; /* thread encoding this stream */
+  int flushing; /* the NULL frame was sent */
+
+  /* time (in microseconds) spent by the main thread blocked on a full
+   * frame queue, and waiting for the last packets while flushing */
+  int64_t send_blocked_time;
+  int64_t recv_blocked_time;
+
   /* packet quality factor */
   int quality;
 
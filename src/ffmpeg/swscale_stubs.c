@@ -15,6 +15,7 @@
 #include <libswscale/swscale.h>
 
 #include "avutil_stubs.h"
+#include "swscale_stubs.h"
 
 #define ALIGNMENT_BYTES 16
 
@@ -67,6 +68,16 @@ static int Flag_val(value v)
   return FLAGS[Int_val(v)];
 }
 
+int SwsFlags_val(value flags)
+{
+  int i, ans = 0;
+
+  for (i = 0; i < Wosize_val(flags); i++)
+    ans |= Flag_val(Field(flags, i));
+
+  return ans;
+}
+
 #define Context_val(v) (*(struct SwsContext**)Data_custom_val(v))
 
 static void finalize_context(value v)
@@ -95,13 +106,9 @@ CAMLprim value ocaml_swscale_get_context(value flags_, value src_w_, value src_h
   int dst_w = Int_val(dst_w_);
   int dst_h = Int_val(dst_h_);
   enum AVPixelFormat dst_format = PixelFormat_val(dst_format_);
-  int flags = 0;
-  int i;
+  int flags = SwsFlags_val(flags_);
   struct SwsContext *c;
 
-  for (i = 0; i < Wosize_val(flags_); i++)
-    flags |= Flag_val(Field(flags_,i));
-
   caml_release_runtime_system();
   c = sws_getContext(src_w, src_h, src_format, dst_w, dst_h, dst_format, flags, NULL, NULL, NULL);
   caml_acquire_runtime_system();
@@ -0,0 +1,11 @@
+#ifndef _SWSCALE_STUBS_H_
+#define _SWSCALE_STUBS_H_
+
+#include <libswscale/swscale.h>
+
+#include "avutil_stubs.h"
+
+// Combine an array of Swscale.flag values into sws flags
+int SwsFlags_val(value flags);
+
+#endif // _SWSCALE_STUBS_H_
@@ -0,0 +1,64 @@
+open FFmpeg
+
+(* coding by batches gives what coding one frame or packet at a time gives *)
+
+let max_frames = 32
+
+let read_frames is =
+  let rec read n frames =
+    if n = 0 then List.rev frames
+    else match Av.read_frame is with
+      | `Frame frame -> read (n - 1) (frame :: frames)
+      | `End_of_file -> List.rev frames
+  in
+  read max_frames []
+
+let encode_one id frames =
+  let encoder = Avcodec.Video.create_encoder id in
+  let packets = ref [] in
+  let add pkt = packets := pkt :: !packets in
+  List.iter (Avcodec.encode encoder add) frames;
+  Avcodec.flush_encoder encoder add;
+  List.rev !packets
+
+let encode_batch id frames =
+  let encoder = Avcodec.Video.create_encoder id in
+  let packets = ref (Array.to_list (Avcodec.encode_batch encoder (Array.of_list frames))) in
+  Avcodec.flush_encoder encoder (fun pkt -> packets := !packets @ [pkt]);
+  !packets
+
+let decode_one id packets =
+  let decoder = Avcodec.Video.create_decoder id in
+  let frames = ref [] in
+  let add frame = frames := Avutil.frame_get_pts frame :: !frames in
+  List.iter (Avcodec.decode decoder add) packets;
+  Avcodec.flush_decoder decoder add;
+  List.rev !frames
+
+let decode_batch id packets =
+  let decoder = Avcodec.Video.create_decoder id in
+  let frames = ref (Array.to_list (Array.map Avutil.frame_get_pts
+                                     (Avcodec.decode_batch decoder (Array.of_list packets)))) in
+  Avcodec.flush_decoder decoder (fun frame -> frames := !frames @ [Avutil.frame_get_pts frame]);
+  !frames
+
+let test =
+  Util.iter (fun url ->
+      Util.with_input url (fun src ->
+          match Av.get_video_streams src with
+          | (idx,is,_)::_ ->
+            let id = Avcodec.Video.find_id "mpeg4" in
+            let frames = read_frames is in
+
+            let packets = encode_one id frames in
+            let sizes = List.map Avcodec.Packet.get_size in
+            if sizes (encode_batch id frames) <> sizes packets then
+              Util.fail url "frames of stream %d encoded differently by batch" idx;
+
+            let pts = decode_one id packets in
+            if decode_batch id packets <> pts then
+              Util.fail url "packets of stream %d decoded differently by batch" idx;
+
+            Util.report url "%d frames of stream %d encoded and %d decoded by batch"
+              (List.length frames) idx (List.length pts)
+          | [] -> ()))
@@ -0,0 +1,23 @@
+open FFmpeg
+
+(* decoding the keyframes only gives fewer frames, yet some *)
+
+let count_frames ?decode_hints url =
+  Util.with_input url (fun src ->
+      match Av.get_video_streams src with
+      | (_,is,_)::_ ->
+        Av.select ?decode_hints is;
+        let nb_frames = ref 0 in
+        Av.iter_frame (fun _ -> incr nb_frames) is;
+        Some !nb_frames
+      | [] -> None)
+
+let test =
+  Util.iter (fun url ->
+      let keyframes_only = Avcodec.[Skip_frame Discard_nonkey; Skip_loop_filter Discard_all] in
+      match count_frames url, count_frames ~decode_hints:keyframes_only url with
+      | Some nb_frames, Some nb_keyframes ->
+        if nb_keyframes = 0 || nb_keyframes >= nb_frames then
+          Util.fail url "%d keyframes decoded out of %d frames" nb_keyframes nb_frames;
+        Util.report url "%d keyframes decoded out of %d frames" nb_keyframes nb_frames
+      | _ -> ())
@@ -0,0 +1,46 @@
+open FFmpeg
+
+(* the streams that are not selected are not even demuxed *)
+
+let counters src =
+  List.map (fun (idx,is,_) -> idx, (fun () -> Av.get_nb_read_packets is))
+    (Av.get_audio_streams src)
+  @ List.map (fun (idx,is,_) -> idx, (fun () -> Av.get_nb_read_packets is))
+    (Av.get_video_streams src)
+  @ List.map (fun (idx,is,_) -> idx, (fun () -> Av.get_nb_read_packets is))
+    (Av.get_subtitle_streams src)
+
+let check_counters url selected counters =
+  List.iter (fun (idx,count) ->
+      let nb_packets = count () in
+      if List.mem idx selected then begin
+        if nb_packets = 0 then Util.fail url "selected stream %d not read" idx
+      end
+      else if nb_packets <> 0 then
+        Util.fail url "%d packets of the unselected stream %d read" nb_packets idx)
+    counters
+
+let test =
+  Util.iter (fun url ->
+      (* a single selection *)
+      Util.with_input url (fun src ->
+          let counters = counters src in
+          match Av.get_audio_streams src with
+          | (idx,is,_)::_ when List.length counters > 1 ->
+            Av.select is;
+            Av.iter_input_packet ~audio:(fun _ _ -> ()) src;
+            check_counters url [idx] counters;
+            Util.report url "only stream %d demuxed" idx
+          | _ -> ());
+
+      (* a later selection of another stream *)
+      Util.with_input url (fun src ->
+          let counters = counters src in
+          match Av.get_audio_streams src, Av.get_video_streams src with
+          | (audio_idx,ias,_)::_, (video_idx,ivs,_)::_ when List.length counters > 2 ->
+            Av.select ias;
+            Av.select ivs;
+            Av.iter_input_packet ~audio:(fun _ _ -> ()) ~video:(fun _ _ -> ()) src;
+            check_counters url [audio_idx; video_idx] counters;
+            Util.report url "only streams %d and %d demuxed" audio_idx video_idx
+          | _ -> ()))
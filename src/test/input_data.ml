@@ -0,0 +1,48 @@
+open FFmpeg
+
+(* the inputs read from memory or through callbacks give the packets of the file *)
+
+let count_packets src =
+  let nb_packets = ref 0 in
+  let count _ _ = incr nb_packets in
+  Av.iter_input_packet ~audio:count ~video:count ~subtitle:count src;
+  Av.close src;
+  !nb_packets
+
+let load url =
+  let ic = open_in_bin url in
+  let content = really_input_string ic (in_channel_length ic) in
+  close_in ic;
+  let data = Bigarray.(Array1.create int8_unsigned c_layout) (String.length content) in
+  String.iteri (fun i c -> data.{i} <- Char.code c) content;
+  data
+
+let open_channel url =
+  let ic = open_in_bin url in
+  let read buf ofs len = input ic buf ofs len in
+  let seek ofs cmd =
+    begin match cmd with
+      | Av.Seek_set -> seek_in ic ofs
+      | Av.Seek_cur -> seek_in ic (pos_in ic + ofs)
+      | Av.Seek_end -> seek_in ic (in_channel_length ic + ofs)
+    end;
+    pos_in ic
+  in
+  Av.open_input_stream ~seek read, ic
+
+let test =
+  Util.iter (fun url ->
+      let nb_packets = count_packets (Av.open_input url) in
+
+      let data_packets = count_packets (Av.open_input_data (load url)) in
+      if data_packets <> nb_packets then
+        Util.fail url "%d packets read from data, %d from the file" data_packets nb_packets;
+
+      let src, ic = open_channel url in
+      let stream_packets = count_packets src in
+      close_in ic;
+      if stream_packets <> nb_packets then
+        Util.fail url "%d packets read through callbacks, %d from the file"
+          stream_packets nb_packets;
+
+      Util.report url "%d packets read from data and through callbacks" nb_packets)
@@ -0,0 +1,32 @@
+open FFmpeg
+
+(* the media data of the packets is reported while they are alive only *)
+
+let packets () = (Avutil.live_bytes ()).Avutil.packets
+
+let test =
+  Util.iter (fun url ->
+      Gc.full_major ();
+      let before = packets () in
+
+      let held_bytes = Util.with_input url (fun src ->
+          let rec read n held =
+            let size pkt = fun () -> Avcodec.Packet.get_size pkt in
+            if n = 0 then held
+            else match Av.read_input_packet src with
+              | `Audio (_,pkt) -> read (n - 1) (size pkt :: held)
+              | `Video (_,pkt) -> read (n - 1) (size pkt :: held)
+              | `Subtitle (_,pkt) -> read (n - 1) (size pkt :: held)
+              | `End_of_file -> held
+          in
+          let held = read 16 [] in
+          let held_bytes = List.fold_left (fun bytes size -> bytes + size ()) 0 held in
+          if packets () - before < held_bytes then
+            Util.fail url "%d packet bytes held, %d reported" held_bytes (packets () - before);
+          held_bytes)
+      in
+
+      Gc.full_major ();
+      if packets () <> before then
+        Util.fail url "%d packet bytes still reported after collection" (packets () - before);
+      Util.report url "%d packet bytes reported while held" held_bytes)
@@ -3,4 +3,16 @@ let () =
   FFmpeg.Avutil.Log.set_callback print_string ;
   let files = Sys.argv |> Array.to_list |> List.tl in
   Resample.test files ;
-  Info.test files
+  Info.test files ;
+  Discard.test files ;
+  Pool.test files ;
+  Live_bytes.test files ;
+  Input_data.test files ;
+  Mmap.test files ;
+  Packet_data.test files ;
+  Parse.test files ;
+  Batch.test files ;
+  Threads.test files ;
+  Decode_hints.test files ;
+  Seek.test files ;
+  Output_stream.test files
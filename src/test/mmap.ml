@@ -0,0 +1,19 @@
+open FFmpeg
+
+(* a mapped file gives the packets of the file read normally *)
+
+let read_packets src =
+  let packets = ref [] in
+  let add i pkt = packets := (i, Avcodec.Packet.to_bytes pkt) :: !packets in
+  Av.iter_input_packet ~audio:add ~video:add ~subtitle:add src;
+  Av.close src;
+  List.rev !packets
+
+let test =
+  Util.iter (fun url ->
+      let packets = read_packets (Av.open_input url) in
+      let mapped_packets = read_packets (Av.open_input ~mmap:true url) in
+      if mapped_packets <> packets then
+        Util.fail url "%d packets read from the mapping, %d from the file, or other data"
+          (List.length mapped_packets) (List.length packets);
+      Util.report url "%d packets read from the mapping" (List.length packets))
@@ -0,0 +1,21 @@
+open FFmpeg
+
+(* the muxed data reaches the sink, even once the GC moved its callback *)
+
+let test =
+  Util.iter (fun url ->
+      Util.with_input url (fun src ->
+          match Av.get_audio_streams src, Av.Format.find_output_format "matroska" with
+          | (idx,is,_)::_, Some format ->
+            let written = ref 0 in
+            let write _ _ len = written := !written + len in
+            let dst = Av.open_output_stream ~buffer_size:4096 format (Av.Write write) in
+            let os = Av.new_audio_stream ~stream:is dst in
+            Gc.compact ();
+
+            Av.iter_input_packet ~audio:(fun i pkt -> if i = idx then Av.write_packet os pkt) src;
+            Av.close dst;
+
+            if !written = 0 then Util.fail url "nothing written to the output sink";
+            Util.report url "%d bytes of stream %d written to the output sink" !written idx
+          | _ -> ()))
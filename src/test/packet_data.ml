@@ -0,0 +1,35 @@
+open FFmpeg
+
+(* the bigarrays sharing packet payloads hold their data *)
+
+let bytes_of_data data =
+  Bytes.init (Bigarray.Array1.dim data) (fun i -> Char.chr data.{i})
+
+let test =
+  Util.iter (fun url ->
+      Util.with_input url (fun src ->
+          Av.reuse_output src true;
+          let read () = match Av.read_input_packet src with
+            | `Audio (_,pkt) -> Some (Avcodec.Packet.to_data pkt, Avcodec.Packet.to_bytes pkt)
+            | `Video (_,pkt) -> Some (Avcodec.Packet.to_data pkt, Avcodec.Packet.to_bytes pkt)
+            | `Subtitle (_,pkt) -> Some (Avcodec.Packet.to_data pkt, Avcodec.Packet.to_bytes pkt)
+            | `End_of_file -> None
+          in
+          match read () with
+          | Some (data, payload) ->
+            (* the reused packet holds the next payload *)
+            ignore (read ());
+            if bytes_of_data data <> payload then
+              Util.fail url "shared payload changed by the next reading";
+
+            let len = Bytes.length payload in
+            let padded = Bigarray.(Array1.create int8_unsigned c_layout)
+                (len + Avcodec.input_buffer_padding_size) in
+            Bigarray.Array1.fill padded 0;
+            Bytes.iteri (fun i c -> padded.{i} <- Char.code c) payload;
+            let pkt = Avcodec.Packet.of_data padded len in
+            if Avcodec.Packet.get_size pkt <> len || Avcodec.Packet.to_bytes pkt <> payload then
+              Util.fail url "packet of data differs from its payload";
+
+            Util.report url "payload of %d bytes shared" len
+          | None -> ()))
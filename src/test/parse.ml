@@ -0,0 +1,43 @@
+open FFmpeg
+
+(* the packets parsed from a slice cover it and only report their own data *)
+
+let packets () = (Avutil.live_bytes ()).Avutil.packets
+
+let test =
+  Util.iter (fun url ->
+      Util.with_input url (fun src ->
+          match Av.get_video_streams src with
+          | (idx,_,codec)::_ ->
+            let payloads = ref [] in
+            Av.iter_input_packet ~video:(fun i pkt ->
+                if i = idx then payloads := Avcodec.Packet.to_bytes pkt :: !payloads) src;
+            let payloads = List.rev !payloads in
+
+            let len = List.fold_left (fun len b -> len + Bytes.length b) 0 payloads in
+            let data = Bigarray.(Array1.create int8_unsigned c_layout)
+                (len + Avcodec.input_buffer_padding_size) in
+            Bigarray.Array1.fill data 0;
+            ignore (List.fold_left (fun ofs b ->
+                Bytes.iteri (fun i c -> data.{ofs + i} <- Char.code c) b;
+                ofs + Bytes.length b) 0 payloads);
+
+            begin match Avcodec.Video.create_parser (Avcodec.Video.get_id codec) with
+              | parser ->
+                Gc.full_major ();
+                let before = packets () in
+                let parsed = Avcodec.Packet.parse_slice parser data 0 len in
+                let reported = packets () - before in
+
+                let size = Array.fold_left (fun size (pkt,_) ->
+                    size + Avcodec.Packet.get_size pkt) 0 parsed in
+                let last_end = Array.fold_left (fun _ (_,ofs) -> ofs) 0 parsed in
+                if size > last_end || last_end > len then
+                  Util.fail url "%d bytes parsed up to %d of %d" size last_end len;
+                if reported <> size then
+                  Util.fail url "%d bytes reported for %d bytes parsed" reported size;
+                Util.report url "%d packets parsed from %d bytes of stream %d"
+                  (Array.length parsed) len idx
+              | exception Avutil.Failure _ -> ()
+            end
+          | [] -> ()))
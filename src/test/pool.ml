@@ -0,0 +1,25 @@
+open FFmpeg
+
+(* a released frame value is never handed back by the reading *)
+
+let test =
+  Util.iter (fun url ->
+      Util.with_input url (fun src ->
+          match Av.get_audio_streams src with
+          | (idx,is,_)::_ ->
+            Av.pool_output src 2;
+
+            let read () = match Av.read_frame is with
+              | `Frame frame -> frame
+              | `End_of_file -> Util.fail url "stream %d too short" idx
+            in
+            let held = read () in
+            let released = read () in
+            Av.release_frame released;
+
+            let frame = read () in
+            if frame == released then Util.fail url "released frame handed back";
+            if frame == held then Util.fail url "held frame handed back";
+
+            Util.report url "released frame of stream %d not handed back" idx
+          | [] -> ()))
@@ -0,0 +1,25 @@
+open FFmpeg
+
+(* the decoding threads stopped by a seek decode again afterwards *)
+
+exception Enough
+
+let test =
+  Util.iter (fun url ->
+      Util.with_input url (fun src ->
+          match Av.get_audio_streams src with
+          | (idx,is,_)::_ ->
+            let read n =
+              let count = ref 0 in
+              let count_frame _ _ = incr count; if !count = n then raise Enough in
+              (try Av.iter_input_frame ~parallel:true ~audio:count_frame ~video:count_frame src
+               with Enough -> ());
+              !count
+            in
+            let before = read 8 in
+            Av.seek is `Millisecond 0L [||];
+            let after = read 8 in
+            if after < min before 8 then
+              Util.fail url "%d frames read after seeking, %d before" after before;
+            Util.report url "%d frames read after seeking in stream %d" after idx
+          | [] -> ()))
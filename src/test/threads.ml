@@ -0,0 +1,21 @@
+open FFmpeg
+
+(* the thread count of an input stream is given without opening its decoder *)
+
+let test =
+  Util.iter (fun url ->
+      Util.with_input url (fun src ->
+          match Av.get_audio_streams src, Av.get_video_streams src with
+          | (audio_idx,ias,_)::_, (video_idx,ivs,_)::_ ->
+            Av.set_decoder_threads src 2;
+            let thread_count = Av.get_thread_count ivs in
+            if thread_count <> 2 then
+              Util.fail url "%d threads configured for stream %d" thread_count video_idx;
+
+            Av.select ias;
+            Av.iter_input_packet ~audio:(fun _ _ -> ()) ~video:(fun _ _ -> ()) src;
+            if Av.get_nb_read_packets ivs <> 0 then
+              Util.fail url "stream %d read after getting its thread count" video_idx;
+            Util.report url "thread count of stream %d got, only stream %d read"
+              video_idx audio_idx
+          | _ -> ()))
@@ -0,0 +1,21 @@
+open FFmpeg
+
+(* the boilerplate shared by the tests run on each file given to main *)
+
+let iter test files =
+  List.iter test files
+
+(* fail the test of the [url] file with a formatted message *)
+let fail url fmt =
+  Printf.ksprintf (fun msg -> failwith (url ^ ": " ^ msg)) fmt
+
+(* print the outcome of the test of the [url] file *)
+let report url fmt =
+  Printf.ksprintf (fun msg -> Printf.printf "%s: %s\n" url msg) fmt
+
+(* give the [url] input to [f], then close it even if [f] fails *)
+let with_input url f =
+  let src = Av.open_input url in
+  match f src with
+  | result -> Av.close src; result
+  | exception exn -> Av.close src; raise exn